@@ -1,431 +1,6240 @@
 // @file monitor.c
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>     
+#include <stddef.h>
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <math.h>
+#include "sampling.h"
 
 #define SERVER_PIPE_NAME "tmp/server_pipe" ///< Name of the server pipe
 #define CLIENT_PIPE_NAME "tmp/client_pipe" ///< Name of the client pipe
+#define SHARD_SERVER_PIPE_NAME "tmp/server_pipe.%d" ///< Name of the server pipe of a shard, %d is the shard
+#define SHARD_CLIENT_PIPE_NAME "tmp/client_pipe.%d" ///< Name of the client pipe of a shard, %d is the shard
+#define SHARD_PID_STREAM_NAME "tmp/pids_%d.%d" ///< Fifo the coordinator streams pids to a shard through
+#define SHARD_REPLY_NAME "tmp/reply_%d.%d" ///< Fifo a shard answers a fanned out query through, the pid of the coordinator child then the shard
+#define REPLY_PREFIX "reply " ///< Prefix of a fanned out query, followed by the fifo of its answer
+#define SHARDS_FILE "tmp/shards" ///< File that tells the tracers how many shards there are
+#define SAMPLING_INTERVAL 1000 ///< Milliseconds between two adjustments of the adaptive sampling rates
+#define MAX_SAMPLING_RATE 1000000 ///< Fewest runs traced by the adaptive sampling, one in this many
+#define OUTPUT_DIR_FILE "tmp/output_dir" ///< File that tells the tracers where the output directory is, they capture the output of runs there
+#define MAX_SHARDS 64 ///< Maximum number of shards
 #define BUFFER_SIZE 1024 ///< Size of every buffer
-#define MAX_ENTRIES BUFFER_SIZE - 1 ///< Number of the maximum entry in the information array
+#define REPLY_CHUNK 65536 ///< Bytes of each buffer a reply is built in, what a pipe holds
+#define REPLY_CHUNKS 4 ///< Buffers a reply fills before they're written together
+#define PID_MAX_FILE "/proc/sys/kernel/pid_max" ///< File with the highest pid the kernel hands out
+#define DEFAULT_PID_MAX 4194304 ///< Highest possible pid on Linux, used if PID_MAX_FILE can't be read
+#define PID_STREAM_PREFIX '@' ///< A pid argument starting with this names a fifo the remaining pids are streamed from
+#define LONG_BITS (8 * sizeof(unsigned long)) ///< Number of bits in a word of the pid bitmap
+#define MAX_QUERY_THREADS 16 ///< Maximum number of threads that split the scan of a stats request
+#define MIN_SLICE_ENTRIES 4096 ///< Minimum number of entries worth giving a thread of its own
+#define MAX_CHILDREN 64 ///< Maximum number of monitors an aggregator follows
+#define ORIGIN_BASE (MAX_CHILDREN + 1) ///< Base the origins along the way of a run through stacked aggregators are packed in, the nearest one last
+#define MAX_SUBSCRIBERS 64 ///< Maximum number of aggregators following this monitor
+#define MAX_SUBSCRIBER_BACKLOG (1 << 20) ///< Bytes of deltas a subscriber can fall behind before it's dropped
+#define RECONNECT_INTERVAL 1000 ///< Milliseconds between attempts to reconnect to a child monitor
+#define COMMAND_HASH_SIZE 4096 ///< Number of chains of the table of command names
+#define RUNNING_HASH_SIZE 4096 ///< Number of chains of the table of running entries by pid
+#define HISTOGRAM_SUB_BITS 5 ///< Each power of two is split in 2^HISTOGRAM_SUB_BITS buckets, about 3% apart
+#define HISTOGRAM_MAX_BITS 40 ///< Times with more bits than this (about 35 years in ms) go in the last bucket
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) ///< Number of buckets of a histogram
+#define ROLLUP_TIERS 3 ///< Number of resolutions the activity is rolled up at
+#define ROLLUP_SLOTS (3600 + 1440 + 720) ///< A second for an hour, a minute for a day and an hour for a month
+#define DEFAULT_TREND_PERIODS 60 ///< Number of periods stats-trend answers with when it isn't told
+#define TOP_CAPACITY 256 ///< Number of commands kept in the top heaps, stats-top up to this is answered from them
+#define MAX_WATCHERS 64 ///< Maximum number of clients watching the status
+#define WATCH_BACKLOG 65536 ///< Bytes of deltas a watcher can fall behind before they're coalesced into a resync
+#define DEFAULT_WATCH_INTERVAL 1000 ///< Milliseconds between ticks sent to a watcher that didn't ask for an interval
+#define CACHE_SIZE 64 ///< Number of stats answers kept, each request has one slot picked by its hash
+#define CACHE_MAX_ANSWER 65536 ///< Answers bigger than this aren't kept
+#define CHANGE_LOG 4096 ///< Number of pid changes remembered to check the kept answers against
+#define METRICS_INTERVAL 10000 ///< Milliseconds between writes of the metrics file
+#define LATENCY_BOUNDS 14 ///< Number of finite buckets of the request latency histograms
+#define FLIGHT_RECORDS 4096 ///< Number of requests the flight recorder remembers
+#define FLIGHT_FILE "tmp/flight.json" ///< File the flight recorder is dumped to on SIGUSR1
+#define DEFAULT_SAMPLE_INTERVAL 1000 ///< Milliseconds between samples of the running processes when "-r" isn't given
+#define RETENTION_BATCH 64 ///< Most entries evicted at a time, so a new limit is enforced a little at each request
+#define RETENTION_INTERVAL 1000 ///< Milliseconds between checks of the age of the finished entries
+#define COMPACT_INTERVAL 5000 ///< Milliseconds between compactions of the files of evicted runs
+#define COMPACTED_FILE "compacted" ///< File of the output directory the evicted runs are appended to, as "pid program time"
+#define MAX_QUERY_CHILDREN 16 ///< Children answering queries at the same time, the rest wait their turn
+#define MAX_PENDING_QUERIES 256 ///< Queries waiting for a child, more are answered busy
+#define BUSY_LAG 50000 ///< Microseconds a read of the server pipe can spend on start and end requests before queries are answered busy
+#define QUERY_POLL_INTERVAL 5 ///< Milliseconds between checks for a free child while queries wait
+#define BUSY_ANSWER "busy\n" ///< Answer of a query the monitor has no room for, the tracer sends it again later
+#define BUSY_OPEN_TRIES 10 ///< Attempts to open the pipe of a query answered busy, a millisecond apart, before the answer is dropped
+#define JOB_AGING 1000 ///< Milliseconds a queued job waits to gain one level of priority
+#define JOB_POLL_INTERVAL 100 ///< Milliseconds between checks for finished jobs while some run, their signal may come right before the wait
+#define TIMER_TICK 10 ///< Milliseconds between two ticks of the timer wheel
+#define WHEEL_BITS 6 ///< Bits of the tick each level of the timer wheel takes
+#define WHEEL_SLOTS (1 << WHEEL_BITS) ///< Slots of each level of the timer wheel
+#define WHEEL_LEVELS 4 ///< Levels of the timer wheel, deadlines up to WHEEL_SLOTS ^ WHEEL_LEVELS ticks away fit
+#define KILL_GRACE 5000 ///< Milliseconds a run is given to exit after SIGTERM before it gets SIGKILL
+#define MAX_CORES 64 ///< Cores the placement of runs is recorded for, a bit of a word each
+#define OUTPUT_SEGMENT 65536 ///< Bytes of captured output compressed at a time, each segment is inflated on its own
+#define PERF_COUNTERS 6 ///< Counters the tracer reads with "--perf": task-clock in ns, context switches, page faults, CPU migrations, cycles and instructions
+#define ORPHAN_GRACE 2000 ///< Milliseconds the end of a run is waited for after its process exits, before it's closed as orphaned
+
+#ifndef SYS_close_range
+#define SYS_close_range 436 ///< Number of the close_range system call, for C libraries that don't know it
+#endif
+
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424 ///< Number of the pidfd_send_signal system call, for C libraries that don't know it
+#endif
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434 ///< Number of the pidfd_open system call, for C libraries that don't know it
+#endif
 
 char *output_dir; ///< Directory of the output it's read from argv[1]
 
+long started_at; ///< Time the monitor started, the per-core utilization is over the time since
+
+unsigned int next_core = 0; ///< Turn of the next round-robin placement
+
+char server_pipe_name[BUFFER_SIZE] = SERVER_PIPE_NAME; ///< Name of the pipe this monitor reads requests from
+char client_pipe_name[BUFFER_SIZE] = CLIENT_PIPE_NAME; ///< Name of the pipe this monitor writes answers to
+
+int num_shards = 1; ///< Number of shards the runs are partitioned in by pid, read from "-s"
+int shard_fds[MAX_SHARDS]; ///< Only used by the coordinator, server pipe of every shard
+
+int shard_pids[MAX_SHARDS]; ///< Only used by the coordinator, process of every shard
+
+char *listen_path = NULL; ///< Unix socket aggregators subscribe to the deltas of this monitor on, read from "-l"
+
+/**
+ *  Activity in one period of a rollup
+ */
+struct Slot {
+    long period; ///< Period the slot holds, time divided by the resolution of its tier
+    unsigned int started; ///< Runs started in the period
+    unsigned int completed; ///< Runs that ended in the period
+    long total_time; ///< Sum of the time of the runs that ended in the period
+};
+
+/**
+ *  Ring buffers of the activity at each resolution, a slot is reused when its period comes around again
+ */
+struct Rollup {
+    struct Slot slots[ROLLUP_SLOTS]; ///< Slots of every tier, one after the other
+};
+
+/**
+ *  Resolution of a rollup
+ */
+struct Tier {
+    char *name; ///< Name used in the stats-trend request
+    long resolution; ///< Milliseconds in a period
+    int num_slots; ///< Number of periods kept
+    int first; ///< First slot of the tier in the rollup
+};
+
+struct Tier tiers[ROLLUP_TIERS] = {
+    { "second", 1000, 3600, 0 },
+    { "minute", 60 * 1000, 1440, 3600 },
+    { "hour", 60 * 60 * 1000, 720, 3600 + 1440 }
+}; ///< Tiers of every rollup
+
+struct Rollup global_rollup = {0}; ///< Activity of every command
+
+/**
+ *  What the commands are ranked by in stats-top
+ */
+enum TopMetric {
+    TOP_TIME, ///< Total time of the runs
+    TOP_COUNT, ///< Number of runs
+    TOP_P99, ///< 99th percentile of the time of the runs
+    TOP_METRICS ///< Number of metrics, only the first two are kept in heaps
+};
+
+/**
+ *  Interned name of a program with the totals of its runs that ended
+ */
+struct Command {
+    char *name; ///< Name of the program, shared by all its entries
+    long count; ///< Number of runs that ended
+    long total_time; ///< Sum of the time of the runs that ended
+    long max_time; ///< Longest run
+    unsigned int histogram[HISTOGRAM_BUCKETS]; ///< Log-linear histogram of the time of the runs, in ms
+    struct Rollup *rollup; ///< Activity of the command, allocated on its first run
+    int top_index[TOP_METRICS]; ///< Position in the top heaps by time and by count, -1 if it isn't in them
+    struct Info *runs[2]; ///< Its finished (0) and running (1) entries
+    int running_jobs; ///< Submitted jobs of the command the monitor is running
+    long perf_runs; ///< Runs that ended with performance counters
+    long perf_totals[PERF_COUNTERS]; ///< Sum of each counter over the runs that had it
+    long perf_counted[PERF_COUNTERS]; ///< Runs that had each counter, the hardware ones may be missing
+    int sampling_slot; ///< Slot of the command in the sampling file plus one, 0 until it's looked up, -1 if it has none
+    struct Contribution *evicted_runs; ///< Runs of each child monitor that are only in the totals
+    struct Command *next; ///< Next command in the same chain of the table
+};
+
+/**
+ *  Runs of a command that came from a child monitor and are only in the
+ *  totals, the ones evicted here and the ones its snapshot counted. They're
+ *  taken back from the totals when the child goes away
+ */
+struct Contribution {
+    int origin; ///< Child monitor plus one
+    long count; ///< Number of runs
+    long total_time; ///< Sum of their time
+    unsigned int histogram[HISTOGRAM_BUCKETS]; ///< Histogram of their time
+    struct Contribution *next; ///< Contribution of another child monitor
+};
+
+struct SamplingSlot *sampling = NULL; ///< Slots of the sampling file, a table by the hash of the name, NULL if no command is sampled
+
+long target_rate = 0; ///< Runs per second of a command traced at most by adapting its sampling rate, read from "-t", 0 to not adapt
+
+int adapts_sampling = 1; ///< 1 in the monitor that adjusts the sampling rates, the first shard of a sharded monitor
+
+long next_sampling = 0; ///< Time the sampling rates are adjusted next
+
+struct Command *commands[COMMAND_HASH_SIZE] = {0}; ///< Table of commands, chained by the hash of the name
+
+struct Command *top_heaps[TOP_METRICS][TOP_CAPACITY]; ///< Min-heaps of the commands with the most time and the most runs
+
+int top_sizes[TOP_METRICS] = {0}; ///< Number of commands in each top heap
+
+struct Command **command_list = NULL; ///< Every command, in the order they were first seen
+
+struct Command **name_index = NULL; ///< Every command, sorted by name for prefix queries
+
+int num_commands = 0; ///< Number of commands
+
+int max_commands = 0; ///< Size of command_list
+
+/**
+ *  Deadline kept in the timer wheel
+ */
+struct Timer {
+    unsigned long expires; ///< Tick it expires at
+    struct Timer **slot; ///< Slot of the wheel it's in, NULL if it isn't in one
+    struct Timer *prev; ///< Previous timer of the same slot
+    struct Timer *next; ///< Next timer of the same slot
+};
+
 /**
  *  Struct to save information about the requests
  */
 struct Info {
     int pid; ///< Pid of the program
-    char name[BUFFER_SIZE]; ///< Name of the program
+    char *name; ///< Name of the program, the one interned in its command
+    struct Command *command; ///< Command of the program
     long time; ///< Time it took to run in case running equals 0 or start time in case running equals 1
     int running; ///< 1 if true 0 if false
+    long origin; ///< 0 if the run was traced here, otherwise the child monitor it came from plus one, and the origins it had there above it in base ORIGIN_BASE
+    struct Info *prev_run; ///< Previous entry of its command in the same state
+    struct Info *next_run; ///< Next entry of its command in the same state
+    struct Info *prev_indexed; ///< Previous entry in the running list or in the same duration bucket
+    struct Info *next_indexed; ///< Next entry in the running list or in the same duration bucket
+    struct Info *next_by_pid; ///< Running entries only, next entry in the same chain of running_by_pid
+    int stat_fd; ///< Running entries traced here only, /proc/<pid>/stat kept open between samples, -1 if it isn't
+    int statm_fd; ///< Running entries traced here only, /proc/<pid>/statm kept open between samples, -1 if it isn't
+    long cpu_ticks; ///< User and system time of the process at the last sample, in clock ticks
+    long sampled_at; ///< Time of the last sample, 0 if there's none yet
+    int cpu_permille; ///< CPU used between the last two samples, in thousandths of a core, -1 before the second sample
+    long rss_kb; ///< Resident memory at the last sample
+    int threads; ///< Threads at the last sample
+    struct Channel *pidfd; ///< Running entries traced here only, pidfd of the process, NULL if it isn't watched
+    long exited_at; ///< Time the process was seen exiting without its end, 0 if it wasn't
+    struct Info *next_exited; ///< Next entry in the list of exited processes waiting for their end
+    int orphaned; ///< 1 if the run was closed by the monitor because its end never came
+    int tree; ///< 1 if the tracer accounted for every process of the run, the four fields below are set then
+    long tree_cpu_us; ///< CPU used by the whole process tree, in microseconds
+    long tree_peak_kb; ///< Peak memory of the process tree
+    long tree_read_bytes; ///< Bytes the process tree read from storage
+    long tree_write_bytes; ///< Bytes the process tree wrote to storage
+    int index; ///< Position in the information array
+    long ended_at; ///< Finished entries only, time the run ended
+    struct Info *prev_finished; ///< Previous finished entry, in the order they finished
+    struct Info *next_finished; ///< Next finished entry, in the order they finished
+    struct Timer deadline; ///< Runs started here with a timeout only, when the run gets its next signal
+    int timed_out; ///< 0 if the run kept to its timeout, 1 once it got SIGTERM, 2 once it got SIGKILL
+    int pipeline; ///< Runs started here only, 1 if the run is a pipeline whose stages are in the process group named after its pid
+    int perf; ///< 1 if the tracer read the performance counters of the run
+    long perf_counts[PERF_COUNTERS]; ///< Counters of the run, -1 for those the tracer couldn't open
+    int output; ///< 1 if the tracer captured the output of the run, the three fields below are set then
+    long output_bytes[2]; ///< Bytes of stdout and stderr kept
+    long output_dropped; ///< Bytes of both streams left out past the cap of the tracer
+    unsigned long cpus; ///< Cores the tracer pinned the run to, a bit each, 0 if it wasn't pinned
+    long weight; ///< Runs the entry stands for, the sampling rate it was traced at, 1 if every run is traced
 };
 
-struct Info *information[BUFFER_SIZE] = {0}; ///< Initialize an array from struct Info with null pointers
+struct Info **information = NULL; ///< Every entry, running or finished, grown as needed
+
+int max_information = 0; ///< Size of the information array
+
+int num_entries = 0; ///< Number of entries in use in the information array
+
+struct Info *oldest_running = NULL; ///< Running entries, sorted by start time
+
+struct Info *newest_running = NULL; ///< Last of the running entries
+
+struct Info *running_by_pid[RUNNING_HASH_SIZE] = {0}; ///< Running entries, chained by pid, so an end finds its entry without a scan
+
+struct Info *duration_index[HISTOGRAM_BUCKETS] = {0}; ///< Finished entries, by the histogram bucket of their time
 
+struct Info *oldest_finished = NULL; ///< Finished entries, in the order they finished, evicted from here
+
+struct Info *newest_finished = NULL; ///< Last of the finished entries
+
+int num_finished = 0; ///< Number of finished entries
+
+long max_entries = 0; ///< Entries kept before the oldest finished ones are evicted, 0 for no limit, read from "-e"
+
+long max_age = 0; ///< Milliseconds a finished entry is kept, 0 for no limit, read from "-x" in seconds
+
+long max_memory = 0; ///< Bytes the entries can take before the oldest finished ones are evicted, 0 for no limit, read from "-b" in kB
+
+long next_retention = 0; ///< Time the age of the finished entries is checked next
 
 /**
- * This function creates a new entry in the iformation array
- * 
- * @param[in] pid
- * @param[in] name
- * @param[in] time
- * @paran[in] running
+ *  Run evicted from memory, kept as this much smaller record so the stats
+ *  requests by pid still find it. The file of a local run waits to be compacted
  */
-void create_info(int pid, char name[], long time, int running) {
-    struct Info *new_info = malloc(sizeof(struct Info));
-    new_info->pid = pid;
-    strcpy(new_info->name, name);
-    new_info->time = time;
-    new_info->running = running;
-    
-    // Find the first null pointer in the array
-    int i = 0;
-    while (i < MAX_ENTRIES && information[i] != NULL) {
-        i++;
+struct Evicted {
+    int pid; ///< Pid of the run, name of its file
+    long origin; ///< Origin of the entry the run had
+    struct Command *command; ///< Command of the run, commands are never freed
+    long time; ///< Time the run took
+    long weight; ///< Runs it stands for, more than 1 when its command was sampled
+};
+
+struct Evicted *evicted = NULL; ///< Runs evicted from memory, in the order they were evicted
+
+int num_evicted = 0; ///< Number of runs evicted from memory
+
+int max_evicted = 0; ///< Size of evicted
+
+int num_compacted = 0; ///< Evicted runs before this one had their files compacted already
+
+int num_to_compact = 0; ///< Local runs past num_compacted, whose files wait to be compacted
+
+int compactor = 0; ///< Pid of the child compacting files, 0 if there's none
+
+long next_compaction = 0; ///< Time the files of the evicted runs are compacted next
+
+int *compressed = NULL; ///< Pids of the runs whose captured output is waiting to be compressed
+
+int num_compressed = 0; ///< Number of runs waiting to be compressed
+
+int max_compressed = 0; ///< Size of compressed
+
+int compressor = 0; ///< Pid of the child compressing output, 0 if there's none
+
+char *stream_names[2] = { "out", "err" }; ///< Suffix of the files of each captured stream, stdout then stderr
+
+/**
+ *  Job submitted to the monitor, queued until there's room to run it
+ */
+struct Job {
+    int id; ///< Number of the job, in the order they were submitted
+    int priority; ///< Priority it was submitted with, higher runs first
+    long submitted; ///< Time it was submitted
+    long key; ///< Order in the queue, priority * JOB_AGING - submitted
+    int pipeline; ///< 1 if line is a pipeline run by the shell, 0 if it's a program and its arguments
+    char *line; ///< Program and arguments separated by spaces, or the pipeline
+    struct Command *command; ///< Command of the program, the first word of line
+    int pid; ///< Process running it, 0 while it's queued
+    struct Job *next_running; ///< Next job being run
+};
+
+struct Job **job_queue = NULL; ///< Queued jobs, a heap with the highest key first
+
+int num_queued_jobs = 0; ///< Number of queued jobs
+
+int max_queued_jobs = 0; ///< Size of job_queue
+
+struct Job *running_jobs = NULL; ///< Jobs being run
+
+int num_running_jobs = 0; ///< Number of jobs being run
+
+int next_job_id = 1; ///< Number of the next job submitted
+
+long max_jobs = 0; ///< Jobs run at the same time, read from "-j", the number of cores by default
+
+long max_command_jobs = 0; ///< Jobs of the same command run at the same time, 0 for no limit, read from "-k"
+
+/**
+ *  Bitmap with the pids a stats request asks about
+ */
+struct PidSet {
+    unsigned long *bits; ///< One bit per pid
+    long max_pid; ///< Number of pids the bitmap can hold
+};
+
+/**
+ *  Range of the pids a stats request asks about, a kept answer is checked
+ *  against the sorted ranges of its request
+ */
+struct PidRange {
+    long first; ///< First pid of the range
+    long last; ///< Last pid of the range
+};
+
+/**
+ *  Stats request over a slice of the information array. The request runs in a
+ *  child of the monitor, so the array it reads is a copy-on-write snapshot that
+ *  start and end requests applied afterwards don't change
+ */
+struct Query {
+    struct PidSet *pids; ///< Pids the request asks about
+    char *program_name; ///< Only count entries with this name, NULL to count all
+    struct Command *command; ///< Command with that name, NULL if it never ran
+    int uniq; ///< 1 if the distinct names should be collected
+    int first; ///< First entry of the slice
+    int last; ///< One past the last entry of the slice
+    long total_time; ///< Sum of the time of the completed entries found, each one counted as many times as its weight
+    long count; ///< Number of entries found, each one counted as many times as its weight
+    long sampled; ///< Entries found that stand for more than one run
+    double count_variance; ///< Variance of count as an estimate of the runs found, 0 if no entry was sampled
+    double time_variance; ///< Variance of total_time as an estimate of their time
+    char **names; ///< Distinct names found, in the order they were first seen
+    int num_names; ///< Number of distinct names found
+};
+
+/**
+ *  Buffered reader used to read requests from a pipe or socket that stays open
+ */
+struct Reader {
+    int fd; ///< File descriptor being read
+    char buffer[BUFFER_SIZE]; ///< Bytes read but not yet consumed
+    ssize_t pos; ///< Position of the first byte not yet consumed
+    ssize_t len; ///< Number of valid bytes in the buffer
+    char *line; ///< Line being read, grown with realloc when needed
+    size_t size; ///< Size of the line buffer
+    ssize_t line_len; ///< Bytes of the line read so far
+    int eof; ///< 1 once the end of file was reached
+};
+
+/**
+ *  Kinds of file descriptors the monitor waits on
+ */
+enum ChannelKind {
+    CHANNEL_SERVER, ///< Server pipe, where the clients send requests
+    CHANNEL_LISTEN, ///< Socket aggregators connect to
+    CHANNEL_SUBSCRIBER, ///< Connection of an aggregator, deltas are written to it
+    CHANNEL_CHILD, ///< Connection to a child monitor, deltas are read from it
+    CHANNEL_WATCHER, ///< Fifo of a client watching the status, deltas are written to it
+    CHANNEL_ANSWER, ///< Pipe a child writes its answer to, so it can be kept
+    CHANNEL_PIDFD, ///< Pidfd of a traced process, readable when it exits
+    CHANNEL_TIMER ///< Timerfd of the timer wheel, readable every tick while it has deadlines
+};
+
+/**
+ *  File descriptor the monitor waits on with epoll
+ */
+struct Channel {
+    enum ChannelKind kind; ///< What the file descriptor is
+    struct Reader reader; ///< Reader of the lines that arrive on it
+    int origin; ///< Child monitors only, origin given to their runs
+    char *path; ///< Child monitors only, socket to connect to
+    char *out; ///< Subscribers only, deltas not written yet, and answers, bytes read so far
+    size_t out_len; ///< Subscribers and answers only, bytes in out
+    size_t out_size; ///< Subscribers and answers only, size of out
+    long interval; ///< Watchers only, milliseconds between ticks
+    long next_tick; ///< Watchers only, time of the next tick
+    int resync; ///< Watchers only, 1 if deltas were dropped and a new snapshot is owed
+    char *request; ///< Answers only, request being answered
+    long generation; ///< Answers only, generation of the information array the answer comes from
+    struct Info *info; ///< Pidfds only, entry of the process
+};
+
+int epoll_fd; ///< Epoll instance of the monitor
+
+struct Channel *subscribers[MAX_SUBSCRIBERS] = {0}; ///< Aggregators following this monitor
+
+struct Channel *children[MAX_CHILDREN] = {0}; ///< Monitors this aggregator follows
+
+int num_children = 0; ///< Number of monitors this aggregator follows, read from "-a"
+
+struct Channel *watchers[MAX_WATCHERS] = {0}; ///< Clients watching the status
+
+/**
+ *  Answer of a stats request, good as long as no pid it asked about changes
+ */
+struct Answer {
+    char *request; ///< Request it answers, NULL if the slot is free
+    char *answer; ///< What was written to the client pipe
+    size_t answer_len; ///< Bytes in answer
+    long generation; ///< Generation of the information array it was computed from
+};
+
+struct Answer answers[CACHE_SIZE] = {0}; ///< Answers of recent stats requests
+
+struct Channel *pending_answers[CACHE_SIZE] = {0}; ///< Answers a child is still writing, in the slot they'll be kept in
+
+long generation = 0; ///< Bumped every time an entry is created, finished or removed
+
+int changed_pids[CHANGE_LOG]; ///< Pid that changed in each generation, the last CHANGE_LOG of them
+
+int answer_fd = -1; ///< Only in a child answering a request that's kept, where the answer is copied to
+
+/**
+ *  Kinds of request the latency is measured for
+ */
+enum RequestType {
+    REQUEST_START,
+    REQUEST_END,
+    REQUEST_STATUS,
+    REQUEST_STATS_TIME,
+    REQUEST_STATS_COMMAND,
+    REQUEST_STATS_UNIQ,
+    REQUEST_STATS_LATENCY,
+    REQUEST_STATS_TREND,
+    REQUEST_STATS_TOP,
+    REQUEST_STATS_PERF,
+    REQUEST_QUERY,
+    REQUEST_WATCH,
+    REQUEST_METRICS,
+    REQUEST_FLIGHT,
+    REQUEST_SUBMIT,
+    REQUEST_OUTPUT,
+    REQUEST_PLACE,
+    REQUEST_STATS_CORES,
+    REQUEST_OTHER,
+    NUM_REQUEST_TYPES
+};
+
+char *request_names[NUM_REQUEST_TYPES] = {
+    "start", "end", "status", "stats-time", "stats-command", "stats-uniq", "stats-latency",
+    "stats-trend", "stats-top", "stats-perf", "query", "watch", "metrics", "flight", "submit", "output", "place", "stats-cores", "other"
+}; ///< Label of each kind of request in the metrics
+
+long latency_bounds[LATENCY_BOUNDS] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000
+}; ///< Upper bound of each bucket of the latency histograms, in microseconds
+
+/**
+ *  What a monitor process counts about itself. It lives in shared memory, so
+ *  the children answering queries count in it too, and every update is an
+ *  atomic add instead of a lock
+ */
+struct Metrics {
+    unsigned long events_ingested; ///< Start, end and delta events applied
+    unsigned long queries_served; ///< Requests answered by a child
+    unsigned long parse_failures; ///< Requests and deltas that couldn't be parsed
+    unsigned long entries_dropped; ///< Entries lost because the information array was full
+    unsigned long ends_dropped; ///< Ends of runs that weren't running here, already closed as orphaned or never started
+    unsigned long answer_hits; ///< Stats requests answered from a kept answer
+    unsigned long answer_misses; ///< Stats requests that had to be computed
+    unsigned long queries_deferred; ///< Queries that waited for a child to be free
+    unsigned long queries_rejected; ///< Queries answered busy
+    unsigned long runs_timed_out; ///< Runs that got SIGTERM for passing their timeout
+    unsigned long output_raw_bytes; ///< Bytes of captured output compressed
+    unsigned long output_compressed_bytes; ///< Bytes the compressed output takes, segment headers included
+    long entries; ///< Entries in the information array
+    unsigned long core_running[MAX_CORES]; ///< Runs pinned to each core running now
+    unsigned long core_runs[MAX_CORES]; ///< Finished runs that were pinned to each core
+    unsigned long core_time[MAX_CORES]; ///< Milliseconds the runs pinned to each core took
+    unsigned long core_busy[MAX_CORES]; ///< The same split between the cores of each run, over the time since the start it's the average load of each core
+    unsigned long unpinned_runs; ///< Finished runs that weren't pinned
+    unsigned long unpinned_time; ///< Milliseconds the runs that weren't pinned took
+    unsigned long latency_buckets[NUM_REQUEST_TYPES][LATENCY_BOUNDS + 1]; ///< Requests by latency bucket, the last one unbounded
+    unsigned long latency_sum[NUM_REQUEST_TYPES]; ///< Sum of the latencies, in microseconds
+};
+
+struct Metrics *metrics_blocks = NULL; ///< Metrics of the coordinator followed by those of every shard, or just this monitor
+
+int num_metrics_blocks = 1; ///< Number of blocks in metrics_blocks
+
+struct Metrics *metrics = NULL; ///< Block this process counts in
+
+char *metrics_path = NULL; ///< File the metrics are written to every METRICS_INTERVAL, read from "-m"
+
+long next_metrics = 0; ///< Time the metrics file is written next
+
+/**
+ *  Query read from the server pipe, waiting for a child to answer it
+ */
+struct PendingQuery {
+    char *line; ///< Request, owned by the queue
+    enum RequestType type; ///< Type of the request
+    long received; ///< Time it was read, in microseconds
+};
+
+struct PendingQuery pending_queries[MAX_PENDING_QUERIES]; ///< Ring of the queries waiting for a child, in the order they arrived
+
+int first_query = 0; ///< Position of the oldest query waiting
+
+int num_pending_queries = 0; ///< Number of queries waiting
+
+int query_children = 0; ///< Children answering queries
+
+long drain_started = 0; ///< Time the current read of the server pipe started, in microseconds
+
+int may_reject = 1; ///< 0 in shards, the queries of the coordinator are deferred but always answered
+
+/**
+ *  Points of the life of a request the flight recorder takes the time at
+ */
+enum Phase {
+    PHASE_RECEIVE, ///< Request read from the server pipe
+    PHASE_FORK, ///< Child answering it started
+    PHASE_PARSE, ///< Arguments parsed
+    PHASE_PERSIST, ///< Output file of the run written
+    PHASE_APPLY, ///< Information array updated and deltas published
+    PHASE_RESPOND, ///< Answer written and client pipe closed
+    NUM_PHASES
+};
+
+char *phase_names[NUM_PHASES] = { "receive", "fork", "parse", "persist", "apply", "respond" }; ///< Name of each phase in the trace
+
+/**
+ *  Times of one request, kept by the flight recorder
+ */
+struct FlightRecord {
+    unsigned long sequence; ///< Number of the request since the monitor started
+    enum RequestType type; ///< Kind of request
+    int pid; ///< Pid of the run, start and end only
+    int process; ///< Process that handled it
+    long stamps[NUM_PHASES]; ///< Time each phase ended, in microseconds, 0 if it didn't happen
+};
+
+/**
+ *  Ring of the last FLIGHT_RECORDS requests, in shared memory like the metrics
+ *  so the children answering queries take their times in it too
+ */
+struct Recorder {
+    unsigned long next; ///< Sequence of the next request, its record is this modulo FLIGHT_RECORDS
+    struct FlightRecord records[FLIGHT_RECORDS]; ///< Records, the oldest overwritten first
+};
+
+struct Recorder *recorders = NULL; ///< Recorder of the coordinator followed by those of every shard, or just this monitor
+
+struct Recorder *recorder = NULL; ///< Recorder this process records in
+
+struct FlightRecord *flight = NULL; ///< Record of the request being handled, NULL between requests
+
+volatile sig_atomic_t dump_requested = 0; ///< Set by SIGUSR1, the recorder is dumped in the event loop
+
+long sample_interval = DEFAULT_SAMPLE_INTERVAL; ///< Milliseconds between samples of the running processes, 0 to not sample, read from "-r"
+
+long next_sample = 0; ///< Time the running processes are sampled next
+
+struct Info *exited = NULL; ///< Entries whose process exited without an end yet, oldest first
+
+struct Info *last_exited = NULL; ///< Last entry of the exited list
+
+
+/**
+ * This function writes a whole buffer to a file
+ * @param[in] fd
+ * @param[in] buffer
+ * @param[in] size
+ * @param[out] 0 on success -1 on failure
+ */
+int write_all(int fd, char *buffer, ssize_t size) {
+    while (size > 0) {
+        ssize_t num_written = write(fd, buffer, size);
+        if (num_written <= 0) {
+            return -1;
+        }
+        buffer += num_written;
+        size -= num_written;
     }
-    
-    if (i < MAX_ENTRIES) {
-        information[i] = new_info;
-    } else {
-        // Error: array is full
-        free(new_info);
-        new_info = NULL;
+    return 0;
+}
+
+/**
+ * This function reads a file until a buffer is full or the file ends
+ * @param[in] fd
+ * @param[out] buffer
+ * @param[in] size
+ * @param[out] bytes Bytes read, fewer than size only at the end of the file, -1 on failure
+ */
+ssize_t read_all(int fd, char *buffer, ssize_t size) {
+    ssize_t total = 0;
+    while (total < size) {
+        ssize_t bytes_read = read(fd, buffer + total, size - total);
+        if (bytes_read < 0) {
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        total += bytes_read;
     }
+    return total;
 }
 
 /**
- * This function updates the information namely the time and the running status given a certain pid
- * @param[in] pid
- * @param[in] new_time
- * @param[in] new_running
+ * This function writes part of an answer to the client pipe, and to the pipe
+ * the parent keeps it from when the answer is going to be kept
+ * @param[in] client_fd
+ * @param[in] buffer
+ * @param[in] size
  */
-void update_info(int pid, long new_time, int new_running) {
-    // Find the corresponding Info struct in the array
-    int i = 0;
-    while (i < MAX_ENTRIES && information[i] != NULL && information[i]->pid != pid) {
-        i++;
+void write_answer(int client_fd, char *buffer, size_t size) {
+    if (write(client_fd, buffer, size) != (ssize_t) size) {
+        perror("Error writing to client pipe");
+        _exit(1);
+    }
+    if (answer_fd != -1 && write_all(answer_fd, buffer, size) == -1) {
+        // Debug: the parent won't keep this one
+        close(answer_fd);
+        answer_fd = -1;
+    }
+}
+
+/**
+ *  Answer built in memory and written a few full buffers at a time, so what
+ *  it costs depends on its bytes and not on its lines
+ */
+struct Reply {
+    int fd; ///< Where it's written
+    int tee; ///< 1 if it's copied to answer_fd too, for answers that are kept
+    int chunk; ///< Buffer being filled
+    size_t lengths[REPLY_CHUNKS]; ///< Bytes in each buffer
+};
+
+char *reply_chunks[REPLY_CHUNKS]; ///< Buffers every reply of the process is built in, allocated by the first one
+
+/**
+ * This function starts a reply
+ * @param[out] reply
+ * @param[in] fd
+ * @param[in] tee 1 if the answer is kept, it's copied to answer_fd as well
+ */
+void reply_open(struct Reply *reply, int fd, int tee) {
+    for (int c = 0; c < REPLY_CHUNKS; c++) {
+        if (reply_chunks[c] == NULL && (reply_chunks[c] = malloc(REPLY_CHUNK)) == NULL) {
+            perror("malloc");
+            _exit(1);
+        }
+        reply->lengths[c] = 0;
+    }
+    reply->fd = fd;
+    reply->tee = tee;
+    reply->chunk = 0;
+}
+
+/**
+ * This function writes a set of buffers whole, a single writev unless the
+ * file takes only part of them
+ * @param[in] fd
+ * @param[in] vector
+ * @param[in] count
+ * @param[out] 0 on success -1 on failure
+ */
+int writev_all(int fd, struct iovec *vector, int count) {
+    while (count > 0) {
+        ssize_t num_written = writev(fd, vector, count);
+        if (num_written <= 0) {
+            return -1;
+        }
+        while (count > 0 && (size_t) num_written >= vector->iov_len) {
+            num_written -= vector->iov_len;
+            vector++;
+            count--;
+        }
+        if (count > 0) {
+            vector->iov_base = (char *) vector->iov_base + num_written;
+            vector->iov_len -= num_written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * This function writes what a reply has so far and empties its buffers
+ * @param[in] reply
+ */
+void reply_flush(struct Reply *reply) {
+    struct iovec vector[REPLY_CHUNKS];
+    int count = 0;
+
+    for (int c = 0; c <= reply->chunk; c++) {
+        if (reply->lengths[c] > 0) {
+            vector[count].iov_base = reply_chunks[c];
+            vector[count].iov_len = reply->lengths[c];
+            count++;
+        }
+        reply->lengths[c] = 0;
+    }
+    reply->chunk = 0;
+
+    // The copy for the parent is made first, writev moves on the vector
+    struct iovec kept[REPLY_CHUNKS];
+    memcpy(kept, vector, sizeof(kept));
+
+    if (writev_all(reply->fd, vector, count) == -1) {
+        perror("Error writing to client pipe");
+        _exit(1);
+    }
+    if (reply->tee && answer_fd != -1 && writev_all(answer_fd, kept, count) == -1) {
+        // Debug: the parent won't keep this one
+        close(answer_fd);
+        answer_fd = -1;
+    }
+}
+
+/**
+ * This function makes room for some bytes in one piece at the end of a reply
+ * @param[in] reply
+ * @param[in] size At most REPLY_CHUNK
+ * @param[out] space Where they go
+ */
+char *reply_reserve(struct Reply *reply, size_t size) {
+    if (reply->lengths[reply->chunk] + size > REPLY_CHUNK) {
+        if (reply->chunk == REPLY_CHUNKS - 1) {
+            reply_flush(reply);
+        } else {
+            reply->chunk++;
+        }
+    }
+    return reply_chunks[reply->chunk] + reply->lengths[reply->chunk];
+}
+
+/**
+ * This function adds bytes to a reply
+ * @param[in] reply
+ * @param[in] data
+ * @param[in] size
+ */
+void reply_bytes(struct Reply *reply, char *data, size_t size) {
+    while (size > 0) {
+        size_t piece = size < REPLY_CHUNK ? size : REPLY_CHUNK;
+        memcpy(reply_reserve(reply, piece), data, piece);
+        reply->lengths[reply->chunk] += piece;
+        data += piece;
+        size -= piece;
+    }
+}
+
+/**
+ * This function adds a string to a reply
+ * @param[in] reply
+ * @param[in] string
+ */
+void reply_string(struct Reply *reply, char *string) {
+    reply_bytes(reply, string, strlen(string));
+}
+
+/**
+ * This function adds a number to a reply, in decimal
+ * @param[in] reply
+ * @param[in] value
+ */
+void reply_long(struct Reply *reply, long value) {
+    char digits[24];
+    int first = sizeof(digits);
+    unsigned long magnitude = value < 0 ? -(unsigned long) value : (unsigned long) value;
+
+    do {
+        digits[--first] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    if (value < 0) {
+        digits[--first] = '-';
+    }
+
+    reply_bytes(reply, digits + first, sizeof(digits) - first);
+}
+
+/**
+ * This function writes the rest of a reply
+ * @param[in] reply
+ */
+void reply_close(struct Reply *reply) {
+    reply_flush(reply);
+}
+
+/**
+ * This function adds to a counter of the metrics
+ * @param[in] counter
+ * @param[in] value
+ */
+void count_metric(unsigned long *counter, unsigned long value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * This function returns the current time in milliseconds
+ * @param[out] time_now
+ */
+long now_ms() {
+    struct timeval time_so_far;
+    gettimeofday(&time_so_far, NULL);
+
+    return time_so_far.tv_sec * 1000 + time_so_far.tv_usec / 1000;
+}
+
+/**
+ * This function returns the current time in microseconds
+ */
+long now_us() {
+    struct timeval time_so_far;
+    gettimeofday(&time_so_far, NULL);
+
+    return time_so_far.tv_sec * 1000000 + time_so_far.tv_usec;
+}
+
+/**
+ * This function tells the kind of a request from its first word
+ * @param[in] request
+ */
+enum RequestType request_type(char *request) {
+    size_t length = strcspn(request, " ");
+
+    // stats-histogram is the stats-latency a coordinator sends its shards
+    if (length == 15 && strncmp(request, "stats-histogram", 15) == 0) {
+        return REQUEST_STATS_LATENCY;
+    }
+    if (length == 8 && strncmp(request, "commands", 8) == 0) {
+        return REQUEST_STATS_TOP;
+    }
+    if (length == 9 && strncmp(request, "perf-sums", 9) == 0) {
+        return REQUEST_STATS_PERF;
+    }
+
+    for (int type = 0; type < REQUEST_OTHER; type++) {
+        if (strlen(request_names[type]) == length && strncmp(request, request_names[type], length) == 0) {
+            return type;
+        }
+    }
+
+    return REQUEST_OTHER;
+}
+
+/**
+ * This function adds the time a request took to the latency histogram of its kind
+ * @param[in] type
+ * @param[in] start Time the request was read, in microseconds
+ */
+void record_latency(enum RequestType type, long start) {
+    long latency = now_us() - start;
+    int bucket = 0;
+
+    while (bucket < LATENCY_BOUNDS && latency > latency_bounds[bucket]) {
+        bucket++;
+    }
+
+    count_metric(&metrics->latency_buckets[type][bucket], 1);
+    count_metric(&metrics->latency_sum[type], latency > 0 ? latency : 0);
+}
+
+/**
+ * This function writes a line of the metrics, with the shard of the block as a
+ * label when there are shards
+ * @param[in] fd
+ * @param[in] block
+ * @param[in] name Name of the metric, with the suffix of the line
+ * @param[in] labels Other labels, "" if there are none
+ * @param[in] value
+ */
+void write_metric(int fd, int block, char *name, char *labels, char *value) {
+    char buffer[BUFFER_SIZE];
+    char shard[BUFFER_SIZE] = "";
+    int num_written;
+
+    if (num_metrics_blocks > 1 && block == 0) {
+        snprintf(shard, BUFFER_SIZE, "shard=\"coordinator\"");
+    } else if (num_metrics_blocks > 1) {
+        snprintf(shard, BUFFER_SIZE, "shard=\"%d\"", block - 1);
+    }
+
+    if (shard[0] == '\0' && labels[0] == '\0') {
+        num_written = snprintf(buffer, BUFFER_SIZE, "%s %s\n", name, value);
+    } else {
+        num_written = snprintf(buffer, BUFFER_SIZE, "%s{%s%s%s} %s\n", name, shard, shard[0] != '\0' && labels[0] != '\0' ? "," : "", labels, value);
+    }
+
+    if (num_written > 0 && num_written < BUFFER_SIZE) {
+        write_all(fd, buffer, num_written);
+    }
+}
+
+/**
+ * This function writes the metrics of every block in the OpenMetrics text format
+ * @param[in] fd
+ */
+void write_metrics(int fd) {
+    char buffer[BUFFER_SIZE];
+    char labels[BUFFER_SIZE];
+    char value[BUFFER_SIZE];
+
+    struct {
+        char *name;
+        char *type;
+        char *help;
+        size_t offset;
+    } scalars[] = {
+        { "monitor_events_ingested", "counter", "Start, end and delta events applied.", offsetof(struct Metrics, events_ingested) },
+        { "monitor_queries_served", "counter", "Requests answered by a child process.", offsetof(struct Metrics, queries_served) },
+        { "monitor_parse_failures", "counter", "Requests and deltas that could not be parsed.", offsetof(struct Metrics, parse_failures) },
+        { "monitor_entries_dropped", "counter", "Runs lost because the information array was full.", offsetof(struct Metrics, entries_dropped) },
+        { "monitor_ends_dropped", "counter", "Ends of runs that were not running, already closed as orphaned or never started.", offsetof(struct Metrics, ends_dropped) },
+        { "monitor_answer_cache_hits", "counter", "Stats requests answered from a kept answer.", offsetof(struct Metrics, answer_hits) },
+        { "monitor_answer_cache_misses", "counter", "Stats requests that had to be computed.", offsetof(struct Metrics, answer_misses) },
+        { "monitor_queries_deferred", "counter", "Queries that waited for a child to be free.", offsetof(struct Metrics, queries_deferred) },
+        { "monitor_queries_rejected", "counter", "Queries answered busy.", offsetof(struct Metrics, queries_rejected) },
+        { "monitor_runs_timed_out", "counter", "Runs that were sent SIGTERM for passing their timeout.", offsetof(struct Metrics, runs_timed_out) },
+        { "monitor_output_raw_bytes", "counter", "Bytes of captured output compressed.", offsetof(struct Metrics, output_raw_bytes) },
+        { "monitor_output_compressed_bytes", "counter", "Bytes the compressed output takes.", offsetof(struct Metrics, output_compressed_bytes) },
+        { "monitor_entries", "gauge", "Entries in the information array.", offsetof(struct Metrics, entries) }
+    };
+
+    for (size_t m = 0; m < sizeof(scalars) / sizeof(scalars[0]); m++) {
+        int num_written = snprintf(buffer, BUFFER_SIZE, "# TYPE %s %s\n# HELP %s %s\n", scalars[m].name, scalars[m].type, scalars[m].name, scalars[m].help);
+        write_all(fd, buffer, num_written);
+
+        char name[BUFFER_SIZE];
+        snprintf(name, BUFFER_SIZE, "%s%s", scalars[m].name, strcmp(scalars[m].type, "counter") == 0 ? "_total" : "");
+
+        for (int block = 0; block < num_metrics_blocks; block++) {
+            snprintf(value, BUFFER_SIZE, "%ld", *(long *) ((char *) &metrics_blocks[block] + scalars[m].offset));
+            write_metric(fd, block, name, "", value);
+        }
+    }
+
+    int num_written = snprintf(buffer, BUFFER_SIZE, "# TYPE monitor_request_duration_seconds histogram\n# HELP monitor_request_duration_seconds Time from reading a request to answering it.\n");
+    write_all(fd, buffer, num_written);
+
+    for (int block = 0; block < num_metrics_blocks; block++) {
+        for (int type = 0; type < NUM_REQUEST_TYPES; type++) {
+            unsigned long *buckets = metrics_blocks[block].latency_buckets[type];
+            unsigned long count = 0;
+
+            for (int bucket = 0; bucket <= LATENCY_BOUNDS; bucket++) {
+                count += buckets[bucket];
+            }
+            if (count == 0) {
+                continue;
+            }
+
+            // OpenMetrics buckets are cumulative
+            unsigned long cumulative = 0;
+            for (int bucket = 0; bucket <= LATENCY_BOUNDS; bucket++) {
+                cumulative += buckets[bucket];
+                if (bucket < LATENCY_BOUNDS) {
+                    snprintf(labels, BUFFER_SIZE, "request=\"%s\",le=\"%ld.%06ld\"", request_names[type], latency_bounds[bucket] / 1000000, latency_bounds[bucket] % 1000000);
+                } else {
+                    snprintf(labels, BUFFER_SIZE, "request=\"%s\",le=\"+Inf\"", request_names[type]);
+                }
+                snprintf(value, BUFFER_SIZE, "%lu", cumulative);
+                write_metric(fd, block, "monitor_request_duration_seconds_bucket", labels, value);
+            }
+
+            unsigned long sum = metrics_blocks[block].latency_sum[type];
+            snprintf(labels, BUFFER_SIZE, "request=\"%s\"", request_names[type]);
+            snprintf(value, BUFFER_SIZE, "%lu.%06lu", sum / 1000000, sum % 1000000);
+            write_metric(fd, block, "monitor_request_duration_seconds_sum", labels, value);
+            snprintf(value, BUFFER_SIZE, "%lu", count);
+            write_metric(fd, block, "monitor_request_duration_seconds_count", labels, value);
+        }
+    }
+
+    write_all(fd, "# EOF\n", 6);
+}
+
+/**
+ * This function writes the metrics file when it's due, through a temporary
+ * file renamed over it so a collector never reads half of it
+ * @param[out] timeout Milliseconds until the next write, -1 if there's no metrics file
+ */
+int tick_metrics() {
+    if (metrics_path == NULL) {
+        return -1;
+    }
+
+    long time_now = now_ms();
+
+    if (next_metrics <= time_now) {
+        char temporary[BUFFER_SIZE];
+        snprintf(temporary, BUFFER_SIZE, "%s.tmp", metrics_path);
+
+        int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            // Debug: it's tried again next time
+            perror("Error opening metrics file");
+        } else {
+            write_metrics(fd);
+            close(fd);
+            if (rename(temporary, metrics_path) == -1) {
+                perror("Error renaming metrics file");
+            }
+        }
+
+        next_metrics = time_now + METRICS_INTERVAL;
+    }
+
+    return next_metrics - time_now;
+}
+
+/**
+ * This function maps the shared memory the metrics are counted in and the
+ * flight recorder records in, before any process that uses it is forked
+ * @param[in] num_blocks One, or the coordinator and every shard
+ */
+void map_metrics(int num_blocks) {
+    metrics_blocks = mmap(NULL, num_blocks * sizeof(struct Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    recorders = mmap(NULL, num_blocks * sizeof(struct Recorder), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics_blocks == MAP_FAILED || recorders == MAP_FAILED) {
+        perror("mmap");
+        _exit(1);
+    }
+
+    num_metrics_blocks = num_blocks;
+    metrics = &metrics_blocks[0];
+    recorder = &recorders[0];
+}
+
+/**
+ * This function takes a record of the flight recorder for a request that was just read
+ * @param[in] type
+ * @param[in] received Time it was read, in microseconds
+ */
+void begin_flight(enum RequestType type, long received) {
+    unsigned long sequence = __atomic_fetch_add(&recorder->next, 1, __ATOMIC_RELAXED);
+
+    flight = &recorder->records[sequence % FLIGHT_RECORDS];
+    memset(flight->stamps, 0, sizeof(flight->stamps));
+    flight->sequence = sequence;
+    flight->type = type;
+    flight->pid = 0;
+    flight->process = getpid();
+    flight->stamps[PHASE_RECEIVE] = received;
+}
+
+/**
+ * This function takes the time at the end of a phase of the request being handled
+ * @param[in] phase
+ */
+void stamp(enum Phase phase) {
+    if (flight != NULL) {
+        flight->stamps[phase] = now_us();
+    }
+}
+
+/**
+ * This function writes every request the flight recorder remembers as Chrome
+ * trace events, which Perfetto opens too: one event for the whole request and
+ * one for each phase, from the end of the phase before it
+ * @param[in] fd
+ */
+void write_flight(int fd) {
+    char buffer[BUFFER_SIZE];
+    int first = 1;
+
+    write_all(fd, "{\"traceEvents\":[\n", 17);
+
+    for (int block = 0; block < num_metrics_blocks; block++) {
+        struct Recorder *source = &recorders[block];
+        unsigned long last = source->next;
+        unsigned long oldest = last > FLIGHT_RECORDS ? last - FLIGHT_RECORDS : 0;
+
+        for (unsigned long sequence = oldest; sequence < last; sequence++) {
+            struct FlightRecord record = source->records[sequence % FLIGHT_RECORDS];
+
+            // Taken again while it was being copied, or not filled in yet
+            if (record.sequence != sequence || record.stamps[PHASE_RECEIVE] == 0) {
+                continue;
+            }
+
+            long end = record.stamps[PHASE_RECEIVE];
+            for (int phase = 1; phase < NUM_PHASES; phase++) {
+                if (record.stamps[phase] > end) {
+                    end = record.stamps[phase];
+                }
+            }
+
+            int num_written = snprintf(buffer, BUFFER_SIZE, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":%d,\"args\":{\"sequence\":%lu,\"run\":%d}}",
+                first ? "" : ",\n", request_names[record.type], record.stamps[PHASE_RECEIVE], end - record.stamps[PHASE_RECEIVE], block, record.process, sequence, record.pid);
+            write_all(fd, buffer, num_written);
+            first = 0;
+
+            long previous = record.stamps[PHASE_RECEIVE];
+            for (int phase = 1; phase < NUM_PHASES; phase++) {
+                if (record.stamps[phase] == 0) {
+                    continue;
+                }
+                num_written = snprintf(buffer, BUFFER_SIZE, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":%d}",
+                    phase_names[phase], previous, record.stamps[phase] - previous, block, record.process);
+                write_all(fd, buffer, num_written);
+                previous = record.stamps[phase];
+            }
+        }
+    }
+
+    write_all(fd, "\n]}\n", 4);
+}
+
+/**
+ * This function is the handler of SIGUSR1, the dump is left to the event loop
+ * @param[in] signum
+ */
+void request_dump(int signum) {
+    (void) signum;
+    dump_requested = 1;
+}
+
+/**
+ * This function dumps the flight recorder to FLIGHT_FILE, through a temporary
+ * file of its own since the shards get the signal too when it's sent to the group
+ */
+void dump_flight() {
+    char temporary[BUFFER_SIZE];
+    snprintf(temporary, BUFFER_SIZE, "%s.%d", FLIGHT_FILE, getpid());
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Error opening flight recorder file");
+        return;
+    }
+
+    write_flight(fd);
+    close(fd);
+
+    if (rename(temporary, FLIGHT_FILE) == -1) {
+        perror("Error renaming flight recorder file");
+    }
+}
+
+/**
+ * This function ends the copy of an answer, before the client pipe is closed
+ * so the parent already has it when the client sends its next request
+ */
+void finish_answer() {
+    if (answer_fd != -1) {
+        write_all(answer_fd, "", 1);
+        close(answer_fd);
+        answer_fd = -1;
+    }
+}
+
+/**
+ * This function finds the first command of the name index whose name isn't smaller than a prefix
+ * @param[in] prefix
+ * @param[out] position Position in the name index, num_commands if there's none
+ */
+int find_prefix(char *prefix) {
+    int low = 0;
+    int high = num_commands;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (strcmp(name_index[middle]->name, prefix) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * This function returns the command with a name, so every entry of a program
+ * shares the same name and totals
+ * @param[in] name
+ * @param[in] create 1 if it should be created when it doesn't exist yet
+ * @param[out] command NULL if it doesn't exist and create is 0
+ */
+struct Command *intern_command(char *name, int create) {
+    unsigned long chain = hash_name(name) % COMMAND_HASH_SIZE;
+
+    for (struct Command *command = commands[chain]; command != NULL; command = command->next) {
+        if (strcmp(command->name, name) == 0) {
+            return command;
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    struct Command *command = calloc(1, sizeof(struct Command));
+    command->name = strdup(name);
+    if (command->name == NULL) {
+        perror("malloc");
+        _exit(1);
+    }
+    command->top_index[TOP_TIME] = -1;
+    command->top_index[TOP_COUNT] = -1;
+    command->next = commands[chain];
+    commands[chain] = command;
+
+    if (num_commands == max_commands) {
+        max_commands = max_commands == 0 ? 64 : max_commands * 2;
+        command_list = realloc(command_list, max_commands * sizeof(struct Command *));
+        name_index = realloc(name_index, max_commands * sizeof(struct Command *));
+        if (command_list == NULL || name_index == NULL) {
+            perror("realloc");
+            _exit(1);
+        }
+    }
+
+    // Keep the name index sorted, new commands are rare next to new runs
+    int position = find_prefix(name);
+    memmove(name_index + position + 1, name_index + position, (num_commands - position) * sizeof(struct Command *));
+    name_index[position] = command;
+
+    command_list[num_commands++] = command;
+
+    return command;
+}
+
+/**
+ * This function returns the histogram bucket of a time: times under
+ * 2^HISTOGRAM_SUB_BITS have one each, above that every power of two is split
+ * in 2^HISTOGRAM_SUB_BITS buckets
+ * @param[in] time
+ */
+int histogram_bucket(long time) {
+    if (time < (1 << HISTOGRAM_SUB_BITS)) {
+        return time < 0 ? 0 : time;
+    }
+
+    int bits = 64 - __builtin_clzl(time);
+    if (bits > HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    int shift = bits - HISTOGRAM_SUB_BITS - 1;
+    return (shift << HISTOGRAM_SUB_BITS) + (time >> shift);
+}
+
+/**
+ * This function returns the highest time that goes in a histogram bucket
+ * @param[in] bucket
+ */
+long histogram_value(int bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    long first = bucket - (shift << HISTOGRAM_SUB_BITS);
+    return ((first + 1) << shift) - 1;
+}
+
+/**
+ * This function returns the time under which a fraction of the runs of a command ended
+ * @param[in] command
+ * @param[in] per_mille Fraction of the runs, in thousandths
+ */
+long command_percentile(struct Command *command, int per_mille) {
+    long rank = (command->count * per_mille + 999) / 1000;
+    long seen = 0;
+
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += command->histogram[bucket];
+        if (seen >= rank) {
+            long value = histogram_value(bucket);
+            return value < command->max_time ? value : command->max_time;
+        }
+    }
+
+    return command->max_time;
+}
+
+/**
+ * This function returns the score of a command in a ranking
+ * @param[in] command
+ * @param[in] metric
+ */
+long command_score(struct Command *command, enum TopMetric metric) {
+    if (metric == TOP_TIME) {
+        return command->total_time;
+    } else if (metric == TOP_COUNT) {
+        return command->count;
+    }
+    return command->count > 0 ? command_percentile(command, 990) : -1;
+}
+
+/**
+ * This function swaps two commands of a top heap
+ * @param[in] metric
+ * @param[in] i
+ * @param[in] j
+ */
+void top_swap(enum TopMetric metric, int i, int j) {
+    struct Command *command = top_heaps[metric][i];
+
+    top_heaps[metric][i] = top_heaps[metric][j];
+    top_heaps[metric][j] = command;
+    top_heaps[metric][i]->top_index[metric] = i;
+    top_heaps[metric][j]->top_index[metric] = j;
+}
+
+/**
+ * This function moves a command down a top heap until it's in its place
+ * @param[in] metric
+ * @param[in] i Position of the command
+ */
+void top_sift_down(enum TopMetric metric, int i) {
+    while (1) {
+        int smallest = i;
+
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < top_sizes[metric]; child++) {
+            if (command_score(top_heaps[metric][child], metric) < command_score(top_heaps[metric][smallest], metric)) {
+                smallest = child;
+            }
+        }
+
+        if (smallest == i) {
+            return;
+        }
+
+        top_swap(metric, i, smallest);
+        i = smallest;
+    }
+}
+
+/**
+ * This function moves a command up a top heap until it's in its place
+ * @param[in] metric
+ * @param[in] i Position of the command
+ */
+void top_sift_up(enum TopMetric metric, int i) {
+    while (i > 0 && command_score(top_heaps[metric][i], metric) < command_score(top_heaps[metric][(i - 1) / 2], metric)) {
+        top_swap(metric, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/**
+ * This function updates the top heaps after the score of a command went up.
+ * Scores only go up, so a command left out always scores no more than the
+ * smallest one in the heap and the heap holds the exact top TOP_CAPACITY
+ * @param[in] command
+ */
+void top_update(struct Command *command) {
+    for (enum TopMetric metric = TOP_TIME; metric <= TOP_COUNT; metric++) {
+        int i = command->top_index[metric];
+
+        if (i >= 0) {
+            top_sift_down(metric, i);
+        } else if (top_sizes[metric] < TOP_CAPACITY) {
+            i = top_sizes[metric]++;
+            top_heaps[metric][i] = command;
+            command->top_index[metric] = i;
+            top_sift_up(metric, i);
+        } else if (command_score(command, metric) > command_score(top_heaps[metric][0], metric)) {
+            top_heaps[metric][0]->top_index[metric] = -1;
+            top_heaps[metric][0] = command;
+            command->top_index[metric] = 0;
+            top_sift_down(metric, 0);
+        }
+    }
+}
+
+/**
+ * This function builds the top heaps again, needed when scores went down
+ */
+void top_rebuild() {
+    for (enum TopMetric metric = TOP_TIME; metric <= TOP_COUNT; metric++) {
+        top_sizes[metric] = 0;
+    }
+
+    for (int c = 0; c < num_commands; c++) {
+        command_list[c]->top_index[TOP_TIME] = -1;
+        command_list[c]->top_index[TOP_COUNT] = -1;
+        top_update(command_list[c]);
+    }
+}
+
+enum TopMetric sort_metric; ///< Metric compare_scores sorts by
+
+/**
+ * This function compares two commands by their score, highest first, for qsort
+ * @param[in] a
+ * @param[in] b
+ */
+int compare_scores(const void *a, const void *b) {
+    long first = command_score(*(struct Command **) a, sort_metric);
+    long second = command_score(*(struct Command **) b, sort_metric);
+
+    return (first < second) - (first > second);
+}
+
+/**
+ * This function writes the commands with the highest score to a file, one
+ * "rank name score" line each. Up to TOP_CAPACITY by time or count comes
+ * straight from the top heaps, anything else is selected from every command
+ * @param[in] fd
+ * @param[in] n Number of commands
+ * @param[in] metric
+ * @param[in] use_heaps 0 to select from every command even when the heaps could answer
+ */
+void write_top(int fd, int n, enum TopMetric metric, int use_heaps) {
+    char buffer[BUFFER_SIZE];
+    struct Command **top;
+    int num_top = 0;
+
+    if (n < 1) {
+        n = 1;
+    }
+
+    if (use_heaps && metric != TOP_P99 && n <= TOP_CAPACITY) {
+        top = malloc(TOP_CAPACITY * sizeof(struct Command *));
+        num_top = top_sizes[metric];
+        memcpy(top, top_heaps[metric], num_top * sizeof(struct Command *));
+    } else {
+        top = malloc((num_commands + 1) * sizeof(struct Command *));
+        for (int c = 0; c < num_commands; c++) {
+            if (command_list[c]->count > 0) {
+                top[num_top++] = command_list[c];
+            }
+        }
+    }
+
+    sort_metric = metric;
+    qsort(top, num_top, sizeof(struct Command *), compare_scores);
+
+    for (int i = 0; i < num_top && i < n; i++) {
+        long score = command_score(top[i], metric);
+        int num_written;
+
+        if (metric == TOP_COUNT) {
+            num_written = snprintf(buffer, BUFFER_SIZE, "%d %s %ld executions\n", i + 1, top[i]->name, score);
+        } else {
+            num_written = snprintf(buffer, BUFFER_SIZE, "%d %s %ld ms%s\n", i + 1, top[i]->name, score, metric == TOP_P99 ? " p99" : "");
+        }
+
+        if (num_written > 0 && num_written < BUFFER_SIZE) {
+            write_all(fd, buffer, num_written);
+        }
+    }
+
+    free(top);
+}
+
+/**
+ * This function parses the request "stats-top n [time|count|p99]"
+ * @param[in] request
+ * @param[out] n Number of commands asked for
+ * @param[out] metric What they're ranked by, time by default
+ */
+void parse_top(char *request, int *n, enum TopMetric *metric) {
+    char metric_name[BUFFER_SIZE] = "time";
+
+    *n = 10;
+    sscanf(request, "stats-top %d %1023s", n, metric_name);
+
+    if (strcmp(metric_name, "count") == 0) {
+        *metric = TOP_COUNT;
+    } else if (strcmp(metric_name, "p99") == 0) {
+        *metric = TOP_P99;
+    } else {
+        *metric = TOP_TIME;
+    }
+}
+
+/**
+ * This function adds (or takes back) a run that ended to the totals of its command
+ * @param[in] command
+ * @param[in] time Time the run took
+ * @param[in] sign 1 to add the run, -1 to take it back
+ */
+void command_record(struct Command *command, long time, int sign) {
+    command->count += sign;
+    command->total_time += sign * time;
+    command->histogram[histogram_bucket(time)] += sign;
+
+    if (sign > 0 && time > command->max_time) {
+        command->max_time = time;
+    }
+
+    if (sign > 0) {
+        top_update(command);
+    }
+}
+
+/**
+ * This function writes the latency percentiles of a command to a file
+ * @param[in] fd
+ * @param[in] command
+ * @param[in] name Name asked for, used if the command never ran
+ */
+void write_latency(int fd, struct Command *command, char *name) {
+    char buffer[BUFFER_SIZE];
+    int num_written;
+
+    if (command == NULL || command->count == 0) {
+        num_written = snprintf(buffer, BUFFER_SIZE, "%s has no finished executions\n", name);
+    } else {
+        num_written = snprintf(buffer, BUFFER_SIZE, "%s: %ld executions, p50 %ld ms, p90 %ld ms, p99 %ld ms, p99.9 %ld ms, max %ld ms\n",
+            command->name, command->count, command_percentile(command, 500), command_percentile(command, 900),
+            command_percentile(command, 990), command_percentile(command, 999), command->max_time);
+    }
+
+    if (num_written < 0 || num_written >= BUFFER_SIZE) {
+        perror("Error formatting message");
+        _exit(1);
+    }
+    if (write(fd, buffer, num_written) != num_written) {
+        perror("Error writing to client pipe");
+        _exit(1);
+    }
+}
+
+/**
+ * This function writes the raw histogram of a command to a file, as
+ * "label count total_time max_time" followed by " bucket:count" for the
+ * buckets in use, so the coordinator of a sharded monitor can merge them
+ * @param[in] fd
+ * @param[in] command
+ * @param[in] label First word of the line
+ */
+void write_histogram(int fd, struct Command *command, char *label) {
+    char buffer[BUFFER_SIZE];
+    int num_written = 0;
+
+    if (command != NULL) {
+        num_written = snprintf(buffer, BUFFER_SIZE, "%s %ld %ld %ld", label, command->count, command->total_time, command->max_time);
+
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            if (command->histogram[bucket] == 0) {
+                continue;
+            }
+            if (num_written > BUFFER_SIZE - 32) {
+                write_all(fd, buffer, num_written);
+                num_written = 0;
+            }
+            num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, " %d:%u", bucket, command->histogram[bucket]);
+        }
+    }
+
+    buffer[num_written++] = '\n';
+    write_all(fd, buffer, num_written);
+}
+
+/**
+ * This function adds a histogram written by write_histogram, without its label,
+ * to the totals of a command
+ * @param[in] text "count total_time max_time bucket:count..."
+ * @param[in] command
+ */
+void merge_histogram(char *text, struct Command *command) {
+    long count, total_time, max_time;
+    int skip;
+
+    if (sscanf(text, "%ld %ld %ld%n", &count, &total_time, &max_time, &skip) != 3) {
+        return;
+    }
+
+    command->count += count;
+    command->total_time += total_time;
+    if (max_time > command->max_time) {
+        command->max_time = max_time;
+    }
+    text += skip;
+
+    int bucket;
+    unsigned int bucket_count;
+    while (sscanf(text, " %d:%u%n", &bucket, &bucket_count, &skip) == 2) {
+        if (bucket >= 0 && bucket < HISTOGRAM_BUCKETS) {
+            command->histogram[bucket] += bucket_count;
+        }
+        text += skip;
+    }
+}
+
+/**
+ * This function adds the counters of a run to the totals of its command
+ * @param[in] command
+ * @param[in] counts -1 for the counters the run didn't have
+ */
+void record_perf(struct Command *command, long counts[PERF_COUNTERS]) {
+    command->perf_runs++;
+
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+        if (counts[c] >= 0) {
+            command->perf_totals[c] += counts[c];
+            command->perf_counted[c]++;
+        }
+    }
+}
+
+/**
+ * This function writes the averages of the counters of a command to a file,
+ * the instructions per cycle when both were counted
+ * @param[in] fd
+ * @param[in] command
+ * @param[in] name Name asked for, used if the command never ran
+ */
+void write_perf(int fd, struct Command *command, char *name) {
+    char *labels[PERF_COUNTERS] = { "task-clock", "context switches", "page faults", "cpu migrations", "cycles", "instructions" };
+    char buffer[BUFFER_SIZE];
+    int num_written;
+
+    if (command == NULL || command->perf_runs == 0) {
+        num_written = snprintf(buffer, BUFFER_SIZE, "%s has no executions with counters\n", name);
+    } else {
+        num_written = snprintf(buffer, BUFFER_SIZE, "%s: %ld executions with counters, average", command->name, command->perf_runs);
+
+        for (int c = 0; c < PERF_COUNTERS && num_written < BUFFER_SIZE; c++) {
+            if (command->perf_counted[c] == 0) {
+                num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, "%s %s n/a", c > 0 ? "," : "", labels[c]);
+            } else if (c == 0) {
+                // Task clock is in nanoseconds
+                num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, " %s %.3f ms", labels[c], command->perf_totals[c] / 1e6 / command->perf_counted[c]);
+            } else {
+                num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, ", %s %.1f", labels[c], (double) command->perf_totals[c] / command->perf_counted[c]);
+            }
+        }
+
+        if (num_written < BUFFER_SIZE && command->perf_totals[4] > 0 && command->perf_counted[5] > 0) {
+            num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, ", IPC %.2f", (double) command->perf_totals[5] / command->perf_totals[4]);
+        }
+        if (num_written < BUFFER_SIZE) {
+            num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, "\n");
+        }
+    }
+
+    if (num_written < 0 || num_written >= BUFFER_SIZE) {
+        perror("Error formatting message");
+        _exit(1);
+    }
+    write_all(fd, buffer, num_written);
+}
+
+/**
+ * This function writes a set of cores as a list of ranges, like "0-3,6"
+ * @param[in] cpus A bit for each core
+ * @param[out] buffer
+ * @param[in] size
+ * @param[out] length Length of the list
+ */
+int format_cpus(unsigned long cpus, char *buffer, size_t size) {
+    int length = 0;
+    buffer[0] = '\0';
+
+    for (int c = 0; c < MAX_CORES && (size_t) length < size; c++) {
+        if (!(cpus & (1UL << c))) {
+            continue;
+        }
+        int last = c;
+        while (last + 1 < MAX_CORES && (cpus & (1UL << (last + 1)))) {
+            last++;
+        }
+        length += last == c ? snprintf(buffer + length, size - length, "%s%d", length > 0 ? "," : "", c)
+            : snprintf(buffer + length, size - length, "%s%d-%d", length > 0 ? "," : "", c, last);
+        c = last;
+    }
+
+    return (size_t) length < size ? length : (int) size - 1;
+}
+
+/**
+ * This function picks the core a run is pinned to for a "place round-robin"
+ * or "place least-loaded" request, among those the monitor may run on. The
+ * least loaded core has the fewest pinned runs running on it, added up over
+ * every shard, and ties go round-robin so a burst of runs is spread out before
+ * their starts arrive
+ * @param[in] policy
+ * @param[out] core -1 if there's no core to pick from
+ */
+int choose_core(char *policy) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        // Debug: every core is fair game
+        CPU_ZERO(&allowed);
+        for (int c = 0; c < MAX_CORES && c < sysconf(_SC_NPROCESSORS_ONLN); c++) {
+            CPU_SET(c, &allowed);
+        }
+    }
+
+    int cores[MAX_CORES];
+    int num_cores = 0;
+    for (int c = 0; c < MAX_CORES; c++) {
+        if (CPU_ISSET(c, &allowed)) {
+            cores[num_cores++] = c;
+        }
+    }
+    if (num_cores == 0) {
+        return -1;
+    }
+
+    int turn = next_core++ % num_cores;
+    if (strcmp(policy, "least-loaded") != 0) {
+        return cores[turn];
+    }
+
+    int best = -1;
+    unsigned long best_load = 0;
+    for (int k = 0; k < num_cores; k++) {
+        int c = cores[(turn + k) % num_cores];
+        unsigned long load = 0;
+        for (int b = 0; b < num_metrics_blocks; b++) {
+            load += metrics_blocks[b].core_running[c];
+        }
+        if (best == -1 || load < best_load) {
+            best = c;
+            best_load = load;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * This function answers a request "place round-robin|least-loaded fifo" with
+ * the core the tracer pins its run to, "none" if there's none. It's answered
+ * here and not by a child, so the turn of round-robin moves on, and through
+ * the fifo of the tracer, so runs launched together don't mix their answers
+ * @param[in] request
+ */
+void place_request(char *request) {
+    char policy[BUFFER_SIZE];
+    char path[BUFFER_SIZE];
+
+    if (sscanf(request, "place %1023s %1023s", policy, path) != 2 || (strcmp(policy, "round-robin") != 0 && strcmp(policy, "least-loaded") != 0)) {
+        // Debug: malformed request
+        count_metric(&metrics->parse_failures, 1);
+        return;
+    }
+
+    // The client opened its fifo for reading before asking, so this doesn't block
+    int fd = open(path, O_WRONLY | O_NONBLOCK);
+    if (fd == -1) {
+        perror("Error opening place fifo");
+        return;
+    }
+
+    char buffer[BUFFER_SIZE];
+    int core = choose_core(policy);
+    int num_written = core >= 0 ? snprintf(buffer, BUFFER_SIZE, "%d\n", core) : snprintf(buffer, BUFFER_SIZE, "none\n");
+    write_all(fd, buffer, num_written);
+    close(fd);
+}
+
+/**
+ * This function writes how every core was used by the runs pinned to it, as
+ * "CPU n: r running, f finished averaging t ms, load l", where load is the
+ * number of pinned runs the core had on average since the monitor started,
+ * finished runs only and a run pinned to several cores counting for a part.
+ * The runs that weren't pinned follow for comparison. It's read from the
+ * metrics of every shard, so the coordinator answers it alone
+ * @param[in] fd
+ */
+void write_cores(int fd) {
+    char buffer[BUFFER_SIZE];
+    int num_written;
+    long uptime = now_ms() - started_at;
+
+    unsigned long unpinned_runs = 0;
+    unsigned long unpinned_time = 0;
+    int num_lines = 0;
+
+    for (int b = 0; b < num_metrics_blocks; b++) {
+        unpinned_runs += metrics_blocks[b].unpinned_runs;
+        unpinned_time += metrics_blocks[b].unpinned_time;
+    }
+
+    for (int c = 0; c < MAX_CORES; c++) {
+        unsigned long running = 0;
+        unsigned long runs = 0;
+        unsigned long time = 0;
+        unsigned long busy = 0;
+        for (int b = 0; b < num_metrics_blocks; b++) {
+            running += metrics_blocks[b].core_running[c];
+            runs += metrics_blocks[b].core_runs[c];
+            time += metrics_blocks[b].core_time[c];
+            busy += metrics_blocks[b].core_busy[c];
+        }
+        if (running == 0 && runs == 0) {
+            continue;
+        }
+
+        num_written = snprintf(buffer, BUFFER_SIZE, "CPU %d: %lu running, %lu finished averaging %lu ms, load %.2f\n", c, running, runs,
+            runs > 0 ? time / runs : 0, uptime > 0 ? (double) busy / uptime : 0.0);
+        write_all(fd, buffer, num_written);
+        num_lines++;
+    }
+
+    if (num_lines == 0) {
+        num_written = snprintf(buffer, BUFFER_SIZE, "No runs were pinned\n");
+        write_all(fd, buffer, num_written);
+    }
+
+    num_written = snprintf(buffer, BUFFER_SIZE, "Unpinned: %lu finished averaging %lu ms\n", unpinned_runs, unpinned_runs > 0 ? unpinned_time / unpinned_runs : 0);
+    write_all(fd, buffer, num_written);
+}
+
+/**
+ * This function writes the raw counter totals of a command to a file, as
+ * "perf runs" followed by " total counted" for each counter, so the
+ * coordinator of a sharded monitor can add them up
+ * @param[in] fd
+ * @param[in] command
+ */
+void write_perf_sums(int fd, struct Command *command) {
+    char buffer[BUFFER_SIZE];
+    int num_written = snprintf(buffer, BUFFER_SIZE, "perf %ld", command != NULL ? command->perf_runs : 0);
+
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+        num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, " %ld %ld",
+            command != NULL ? command->perf_totals[c] : 0, command != NULL ? command->perf_counted[c] : 0);
+    }
+    num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, "\n");
+
+    write_all(fd, buffer, num_written);
+}
+
+/**
+ * This function adds counter totals written by write_perf_sums, without
+ * "perf", to those of a command
+ * @param[in] text
+ * @param[in] command
+ */
+void merge_perf(char *text, struct Command *command) {
+    long runs;
+    int skip;
+
+    if (sscanf(text, "%ld%n", &runs, &skip) != 1) {
+        return;
+    }
+    command->perf_runs += runs;
+    text += skip;
+
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+        long total, counted;
+        if (sscanf(text, " %ld %ld%n", &total, &counted, &skip) != 2) {
+            return;
+        }
+        command->perf_totals[c] += total;
+        command->perf_counted[c] += counted;
+        text += skip;
+    }
+}
+
+/**
+ * This function adds activity to every tier of a rollup
+ * @param[in] rollup
+ * @param[in] time Time of the activity, in milliseconds
+ * @param[in] started Runs started
+ * @param[in] completed Runs that ended
+ * @param[in] total_time Time of the runs that ended
+ */
+void rollup_add(struct Rollup *rollup, long time, int started, int completed, long total_time) {
+    for (int t = 0; t < ROLLUP_TIERS; t++) {
+        long period = time / tiers[t].resolution;
+        struct Slot *slot = &rollup->slots[tiers[t].first + period % tiers[t].num_slots];
+
+        if (slot->period > period) {
+            // Older than anything the tier still keeps
+            continue;
+        }
+        if (slot->period != period) {
+            slot->period = period;
+            slot->started = 0;
+            slot->completed = 0;
+            slot->total_time = 0;
+        }
+
+        slot->started += started;
+        slot->completed += completed;
+        slot->total_time += total_time;
+    }
+}
+
+/**
+ * This function adds activity to the global rollup and to the one of a command
+ * @param[in] command
+ * @param[in] time Time of the activity, in milliseconds
+ * @param[in] started Runs started
+ * @param[in] completed Runs that ended
+ * @param[in] total_time Time of the runs that ended
+ */
+void record_activity(struct Command *command, long time, int started, int completed, long total_time) {
+    if (command->rollup == NULL) {
+        command->rollup = calloc(1, sizeof(struct Rollup));
+        if (command->rollup == NULL) {
+            perror("calloc");
+            _exit(1);
+        }
+    }
+
+    rollup_add(&global_rollup, time, started, completed, total_time);
+    rollup_add(command->rollup, time, started, completed, total_time);
+}
+
+/**
+ * This function writes the last periods of a tier of a rollup to a file, oldest
+ * first, one "time started completed total_time" line per period (time in seconds)
+ * @param[in] fd
+ * @param[in] rollup NULL if the command never ran
+ * @param[in] tier
+ * @param[in] num_periods
+ * @param[in] time_now
+ */
+void write_trend(int fd, struct Rollup *rollup, struct Tier *tier, long num_periods, long time_now) {
+    char buffer[BUFFER_SIZE];
+    int num_written = 0;
+    long now = time_now / tier->resolution;
+
+    if (num_periods > tier->num_slots) {
+        num_periods = tier->num_slots;
+    }
+
+    for (long period = now - num_periods + 1; period <= now; period++) {
+        struct Slot empty = {0};
+        struct Slot *slot = &empty;
+
+        if (rollup != NULL && rollup->slots[tier->first + period % tier->num_slots].period == period) {
+            slot = &rollup->slots[tier->first + period % tier->num_slots];
+        }
+
+        if (num_written > BUFFER_SIZE - 64) {
+            write_all(fd, buffer, num_written);
+            num_written = 0;
+        }
+        num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, "%ld %u %u %ld\n",
+            period * tier->resolution / 1000, slot->started, slot->completed, slot->total_time);
+    }
+
+    write_all(fd, buffer, num_written);
+}
+
+/**
+ * This function starts a new generation of the information array, remembering
+ * the pid that changed in it so the answers that asked about it are dropped
+ * @param[in] pid
+ */
+void touch_pid(int pid) {
+    generation++;
+    changed_pids[generation % CHANGE_LOG] = pid;
+}
+
+/**
+ * This function adds an entry to the list of its command in its state and to
+ * the running list, kept sorted by start time, and the table of running
+ * entries by pid, or to its duration bucket
+ * @param[in] info
+ */
+void index_info(struct Info *info) {
+    struct Info **runs = &info->command->runs[info->running];
+
+    touch_pid(info->pid);
+
+    info->prev_run = NULL;
+    info->next_run = *runs;
+    if (*runs != NULL) {
+        (*runs)->prev_run = info;
+    }
+    *runs = info;
+
+    if (info->running == 0) {
+        info->prev_finished = newest_finished;
+        info->next_finished = NULL;
+        if (newest_finished != NULL) {
+            newest_finished->next_finished = info;
+        } else {
+            oldest_finished = info;
+        }
+        newest_finished = info;
+        num_finished++;
+    }
+
+    if (info->running == 1) {
+        // Runs mostly start in order, so the place is found near the end
+        struct Info *prev = newest_running;
+        while (prev != NULL && prev->time > info->time) {
+            prev = prev->prev_indexed;
+        }
+
+        info->prev_indexed = prev;
+        info->next_indexed = prev != NULL ? prev->next_indexed : oldest_running;
+        if (info->next_indexed != NULL) {
+            info->next_indexed->prev_indexed = info;
+        } else {
+            newest_running = info;
+        }
+        if (prev != NULL) {
+            prev->next_indexed = info;
+        } else {
+            oldest_running = info;
+        }
+
+        struct Info **chain = &running_by_pid[(unsigned int) info->pid % RUNNING_HASH_SIZE];
+        info->next_by_pid = *chain;
+        *chain = info;
+    } else {
+        struct Info **bucket = &duration_index[histogram_bucket(info->time)];
+
+        info->prev_indexed = NULL;
+        info->next_indexed = *bucket;
+        if (*bucket != NULL) {
+            (*bucket)->prev_indexed = info;
+        }
+        *bucket = info;
+    }
+}
+
+/**
+ * This function takes an entry out of the lists index_info put it in
+ * @param[in] info
+ */
+void unindex_info(struct Info *info) {
+    if (info->running == 0) {
+        if (info->prev_finished != NULL) {
+            info->prev_finished->next_finished = info->next_finished;
+        } else {
+            oldest_finished = info->next_finished;
+        }
+        if (info->next_finished != NULL) {
+            info->next_finished->prev_finished = info->prev_finished;
+        } else {
+            newest_finished = info->prev_finished;
+        }
+        num_finished--;
+    }
+
+    if (info->prev_run != NULL) {
+        info->prev_run->next_run = info->next_run;
+    } else {
+        info->command->runs[info->running] = info->next_run;
+    }
+    if (info->next_run != NULL) {
+        info->next_run->prev_run = info->prev_run;
+    }
+
+    if (info->prev_indexed != NULL) {
+        info->prev_indexed->next_indexed = info->next_indexed;
+    } else if (info->running == 1) {
+        oldest_running = info->next_indexed;
+    } else {
+        duration_index[histogram_bucket(info->time)] = info->next_indexed;
+    }
+    if (info->next_indexed != NULL) {
+        info->next_indexed->prev_indexed = info->prev_indexed;
+    } else if (info->running == 1) {
+        newest_running = info->prev_indexed;
+    }
+
+    if (info->running == 1) {
+        struct Info **link = &running_by_pid[(unsigned int) info->pid % RUNNING_HASH_SIZE];
+        while (*link != info) {
+            link = &(*link)->next_by_pid;
+        }
+        *link = info->next_by_pid;
+    }
+}
+
+/**
+ * This function closes the files a running entry was sampled from
+ * @param[in] info
+ */
+void close_samples(struct Info *info) {
+    if (info->stat_fd != -1) {
+        close(info->stat_fd);
+        info->stat_fd = -1;
+    }
+    if (info->statm_fd != -1) {
+        close(info->statm_fd);
+        info->statm_fd = -1;
+    }
+}
+
+/**
+ * This function samples the resource usage of a running process from
+ * /proc/<pid>/stat and /proc/<pid>/statm. Both are opened on the first sample
+ * and read again from the start with pread on the next ones
+ * @param[in] info
+ * @param[in] now Current time
+ * @param[out] 0 on success -1 if the process can't be read
+ */
+int sample_info(struct Info *info, long now) {
+    char buffer[BUFFER_SIZE];
+    char path[BUFFER_SIZE];
+
+    if (info->stat_fd == -1) {
+        snprintf(path, BUFFER_SIZE, "/proc/%d/stat", info->pid);
+        info->stat_fd = open(path, O_RDONLY);
+        snprintf(path, BUFFER_SIZE, "/proc/%d/statm", info->pid);
+        info->statm_fd = open(path, O_RDONLY);
+        if (info->stat_fd == -1 || info->statm_fd == -1) {
+            close_samples(info);
+            return -1;
+        }
+    }
+
+    ssize_t bytes_read = pread(info->stat_fd, buffer, BUFFER_SIZE - 1, 0);
+    if (bytes_read <= 0) {
+        close_samples(info);
+        return -1;
+    }
+    buffer[bytes_read] = '\0';
+
+    // The name can have spaces and parentheses, the fields start after the last ')'
+    char *fields = strrchr(buffer, ')');
+    unsigned long user_ticks, system_ticks;
+    long threads;
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %ld", &user_ticks, &system_ticks, &threads) != 3) {
+        return -1;
+    }
+
+    long pages = 0;
+    bytes_read = pread(info->statm_fd, buffer, BUFFER_SIZE - 1, 0);
+    if (bytes_read > 0) {
+        buffer[bytes_read] = '\0';
+        sscanf(buffer, "%*d %ld", &pages);
+    }
+
+    long cpu_ticks = user_ticks + system_ticks;
+    if (info->sampled_at != 0 && now > info->sampled_at) {
+        info->cpu_permille = (cpu_ticks - info->cpu_ticks) * 1000 * 1000 / sysconf(_SC_CLK_TCK) / (now - info->sampled_at);
+    }
+
+    info->cpu_ticks = cpu_ticks;
+    info->sampled_at = now;
+    info->rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    info->threads = threads;
+
+    return 0;
+}
+
+/**
+ * This function samples every running process traced here when it's due, all
+ * in one pass over the running list
+ * @param[out] timeout Milliseconds until the next sample, -1 if sampling is off
+ */
+int tick_sampler() {
+    if (sample_interval <= 0) {
+        return -1;
+    }
+
+    long time_now = now_ms();
+
+    if (next_sample <= time_now) {
+        for (struct Info *info = oldest_running; info != NULL; info = info->next_indexed) {
+            if (info->origin == 0) {
+                sample_info(info, time_now);
+            }
+        }
+        next_sample = time_now + sample_interval;
+    }
+
+    return next_sample - time_now;
+}
+
+struct Timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS] = {0}; ///< Timers by level and slot, a level covers WHEEL_SLOTS times the ticks of the one below
+
+unsigned long wheel_tick = 0; ///< Ticks the wheel went through
+
+int num_timers = 0; ///< Timers in the wheel, the timerfd only ticks while there's some
+
+struct Channel wheel_channel = { .kind = CHANNEL_TIMER, .reader.fd = -1 }; ///< Timerfd that drives the wheel
+
+/**
+ * This function starts or stops the ticks of the timerfd
+ * @param[in] ticking
+ */
+void arm_wheel(int ticking) {
+    struct itimerspec spec = {0};
+
+    if (ticking) {
+        spec.it_interval.tv_nsec = TIMER_TICK * 1000000L;
+        spec.it_value = spec.it_interval;
+    }
+    timerfd_settime(wheel_channel.reader.fd, 0, &spec, NULL);
+}
+
+/**
+ * This function puts a timer in the slot of the wheel for its tick: the
+ * lowest level whose slots still tell it apart from the current tick
+ * @param[in] timer
+ */
+void place_timer(struct Timer *timer) {
+    unsigned long delta = timer->expires - wheel_tick;
+    unsigned long expires = timer->expires;
+
+    // Further than the wheel reaches, it's put in the last slot and placed again when it gets there
+    if (delta >= 1UL << (WHEEL_BITS * WHEEL_LEVELS)) {
+        expires = wheel_tick + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        delta = expires - wheel_tick;
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= 1UL << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    struct Timer **slot = &wheel[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+}
+
+/**
+ * This function adds a timer to the wheel, in O(1)
+ * @param[in] timer Not in the wheel
+ * @param[in] delay Milliseconds from now
+ */
+void add_timer(struct Timer *timer, long delay) {
+    if (wheel_channel.reader.fd == -1) {
+        wheel_channel.reader.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (wheel_channel.reader.fd == -1) {
+            // Debug: timerfd failed, no deadlines are kept
+            perror("timerfd_create");
+            return;
+        }
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = &wheel_channel };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wheel_channel.reader.fd, &event);
+    }
+
+    long ticks = (delay + TIMER_TICK - 1) / TIMER_TICK;
+    timer->expires = wheel_tick + (ticks > 0 ? ticks : 1);
+    place_timer(timer);
+
+    if (num_timers++ == 0) {
+        arm_wheel(1);
+    }
+}
+
+/**
+ * This function takes a timer out of the wheel, in O(1)
+ * @param[in] timer
+ */
+void cancel_timer(struct Timer *timer) {
+    if (timer->slot == NULL) {
+        return;
+    }
+
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    timer->slot = NULL;
+
+    if (--num_timers == 0) {
+        arm_wheel(0);
+    }
+}
+
+/**
+ * This function sends the next signal to a run that passed its timeout,
+ * SIGTERM first and SIGKILL KILL_GRACE milliseconds later. The stages of a
+ * pipeline are in a process group named after the pid of the run, the whole
+ * group gets it, even once its first stage exited. Any other run only gets
+ * it itself, through the pidfd while the process is watched so a pid that was
+ * used again is never hit
+ * @param[in] info
+ */
+void expire_info(struct Info *info) {
+    int signum = info->timed_out == 0 ? SIGTERM : SIGKILL;
+
+    if (info->pipeline) {
+        kill(-info->pid, signum);
+    } else if (info->pidfd != NULL) {
+        syscall(SYS_pidfd_send_signal, info->pidfd->reader.fd, signum, NULL, 0);
+    } else {
+        kill(info->pid, signum);
+    }
+
+    if (info->timed_out++ == 0) {
+        count_metric(&metrics->runs_timed_out, 1);
+        add_timer(&info->deadline, KILL_GRACE);
+    }
+}
+
+/**
+ * This function moves the wheel on by the ticks the timerfd counted. Each
+ * tick fires the timers of one slot of the first level, and when the first
+ * level goes round the next slot of the level above is placed again, lower
+ */
+void tick_wheel() {
+    uint64_t ticks = 0;
+
+    if (read(wheel_channel.reader.fd, &ticks, sizeof(ticks)) != sizeof(ticks)) {
+        return;
+    }
+
+    while (ticks-- > 0 && num_timers > 0) {
+        wheel_tick++;
+
+        for (int level = 1; level < WHEEL_LEVELS && (wheel_tick & ((1UL << (WHEEL_BITS * level)) - 1)) == 0; level++) {
+            struct Timer **slot = &wheel[level][(wheel_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            struct Timer *timer = *slot;
+            *slot = NULL;
+            while (timer != NULL) {
+                struct Timer *next = timer->next;
+                place_timer(timer);
+                timer = next;
+            }
+        }
+
+        struct Timer **slot = &wheel[0][wheel_tick & (WHEEL_SLOTS - 1)];
+        while (*slot != NULL) {
+            struct Timer *timer = *slot;
+            cancel_timer(timer);
+            expire_info((struct Info *) ((char *) timer - offsetof(struct Info, deadline)));
+        }
+    }
+}
+
+/**
+ * This function notes that the process of a running entry exited, its end is
+ * waited for ORPHAN_GRACE milliseconds since the tracer sends it after that
+ * @param[in] info
+ */
+void mark_exited(struct Info *info) {
+    // Nothing to signal anymore, the pid could be someone else's soon
+    cancel_timer(&info->deadline);
+
+    if (info->pidfd != NULL) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, info->pidfd->reader.fd, NULL);
+        close(info->pidfd->reader.fd);
+        free(info->pidfd);
+        info->pidfd = NULL;
+    }
+
+    info->exited_at = now_ms();
+    info->next_exited = NULL;
+    if (last_exited != NULL) {
+        last_exited->next_exited = info;
+    } else {
+        exited = info;
+    }
+    last_exited = info;
+}
+
+/**
+ * This function watches the process of a run that started here with a pidfd,
+ * so the monitor learns when it exits even if its end never comes
+ * @param[in] info
+ */
+void watch_info(struct Info *info) {
+    int fd = syscall(SYS_pidfd_open, info->pid, 0);
+
+    if (fd == -1) {
+        if (errno == ESRCH) {
+            // Already gone, its end may still be on the way
+            mark_exited(info);
+        }
+        return;
+    }
+
+    info->pidfd = calloc(1, sizeof(struct Channel));
+    info->pidfd->kind = CHANNEL_PIDFD;
+    info->pidfd->reader.fd = fd;
+    info->pidfd->info = info;
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = info->pidfd };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * This function stops watching the process of an entry, and takes it out of
+ * the exited list
+ * @param[in] info
+ */
+void unwatch_info(struct Info *info) {
+    if (info->pidfd != NULL) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, info->pidfd->reader.fd, NULL);
+        close(info->pidfd->reader.fd);
+        free(info->pidfd);
+        info->pidfd = NULL;
+    }
+
+    if (info->exited_at != 0) {
+        struct Info **link = &exited;
+        struct Info *prev = NULL;
+        while (*link != NULL && *link != info) {
+            prev = *link;
+            link = &(*link)->next_exited;
+        }
+        if (*link == info) {
+            *link = info->next_exited;
+            if (last_exited == info) {
+                last_exited = prev;
+            }
+        }
+        info->exited_at = 0;
+        info->next_exited = NULL;
+    }
+}
+
+/**
+ * This function counts a run traced here as running on the cores it was pinned to
+ * @param[in] info
+ */
+void place_run(struct Info *info) {
+    for (int c = 0; c < MAX_CORES; c++) {
+        if (info->cpus & (1UL << c)) {
+            count_metric(&metrics->core_running[c], 1);
+        }
+    }
+}
+
+/**
+ * This function takes a run traced here off the cores it was pinned to. A
+ * run that finished counts for them, split evenly in their busy time
+ * @param[in] info
+ * @param[in] time Time the run took, -1 if it was removed before it finished
+ */
+void release_run(struct Info *info, long time) {
+    if (info->origin != 0 || info->running != 1) {
+        return;
+    }
+
+    if (info->cpus == 0) {
+        if (time >= 0) {
+            count_metric(&metrics->unpinned_runs, 1);
+            count_metric(&metrics->unpinned_time, time);
+        }
+        return;
+    }
+
+    int num_cores = __builtin_popcountl(info->cpus);
+    for (int c = 0; c < MAX_CORES; c++) {
+        if (info->cpus & (1UL << c)) {
+            // Adding the largest value takes one off
+            count_metric(&metrics->core_running[c], -1UL);
+            if (time >= 0) {
+                count_metric(&metrics->core_runs[c], 1);
+                count_metric(&metrics->core_time[c], time);
+                count_metric(&metrics->core_busy[c], time / num_cores);
+            }
+        }
+    }
+}
+
+/**
+ * This function marks a running entry as finished, moving it in the indexes
+ * @param[in] info
+ * @param[in] time Time the run took
+ */
+void finish_info(struct Info *info, long time) {
+    release_run(info, time);
+    cancel_timer(&info->deadline);
+    unwatch_info(info);
+    close_samples(info);
+    unindex_info(info);
+    info->ended_at = info->time + time;
+    info->time = time;
+    info->running = 0;
+    index_info(info);
+}
+
+/**
+ * This function creates a new entry in the iformation array
+ * 
+ * @param[in] pid
+ * @param[in] name
+ * @param[in] time
+ * @paran[in] running
+ * @param[out] new_info The new entry, NULL if there's no memory for it
+ */
+struct Info *create_info(int pid, char name[], long time, int running) {
+    struct Info *new_info = malloc(sizeof(struct Info));
+    new_info->pid = pid;
+    new_info->command = intern_command(name, 1);
+    new_info->name = new_info->command->name;
+    new_info->time = time;
+    new_info->running = running;
+    new_info->origin = 0;
+    new_info->stat_fd = -1;
+    new_info->statm_fd = -1;
+    new_info->sampled_at = 0;
+    new_info->cpu_permille = -1;
+    new_info->rss_kb = 0;
+    new_info->threads = 0;
+    new_info->pidfd = NULL;
+    new_info->exited_at = 0;
+    new_info->next_exited = NULL;
+    new_info->orphaned = 0;
+    new_info->deadline.slot = NULL;
+    new_info->timed_out = 0;
+    new_info->perf = 0;
+    new_info->output = 0;
+    new_info->cpus = 0;
+    new_info->pipeline = 0;
+    new_info->weight = 1;
+    new_info->tree = 0;
+    new_info->ended_at = now_ms();
+
+    // Entries are kept together at the start of the array, which grows when it's full
+    if (num_entries == max_information) {
+        int size = max_information == 0 ? BUFFER_SIZE : max_information * 2;
+        struct Info **grown = realloc(information, size * sizeof(struct Info *));
+        if (grown == NULL) {
+            // Error: no memory for the entry
+            count_metric(&metrics->entries_dropped, 1);
+            free(new_info);
+            return NULL;
+        }
+        information = grown;
+        max_information = size;
+    }
+
+    new_info->index = num_entries;
+    information[num_entries++] = new_info;
+    index_info(new_info);
+    metrics->entries = num_entries;
+
+    return new_info;
+}
+
+/**
+ * This function removes an entry from the information array, moving the last entry to its place
+ * @param[in] i Index of the entry
+ */
+void remove_info(int i) {
+    release_run(information[i], -1);
+    cancel_timer(&information[i]->deadline);
+    unwatch_info(information[i]);
+    close_samples(information[i]);
+    touch_pid(information[i]->pid);
+    unindex_info(information[i]);
+    free(information[i]);
+    information[i] = information[--num_entries];
+    if (i < num_entries) {
+        information[i]->index = i;
+    }
+    information[num_entries] = NULL;
+    metrics->entries = num_entries;
+}
+
+/**
+ * This function finds the entry of a pid that is still running
+ * @param[in] pid
+ * @param[in] origin 0 for runs traced here, the origin of the entry otherwise
+ * @param[out] info The entry, NULL if there's none
+ */
+struct Info *find_running(int pid, long origin) {
+    for (struct Info *info = running_by_pid[(unsigned int) pid % RUNNING_HASH_SIZE]; info != NULL; info = info->next_by_pid) {
+        if (info->pid == pid && info->origin == origin) {
+            return info;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * This function tells how many entries can be kept, the smallest of the limit
+ * on entries and the one that follows from the limit on memory
+ * @param[out] limit 0 if there's no limit
+ */
+long entry_limit() {
+    long limit = max_entries;
+
+    if (max_memory > 0) {
+        long by_memory = max_memory / (long) (sizeof(struct Info) + sizeof(struct Info *));
+        if (limit == 0 || by_memory < limit) {
+            limit = by_memory > 0 ? by_memory : 1;
+        }
+    }
+
+    return limit;
+}
+
+/**
+ * This function finds the contribution of a child monitor to a command,
+ * adding an empty one if it has none yet
+ * @param[in] command
+ * @param[in] origin Child monitor plus one
+ * @param[out] contribution
+ */
+struct Contribution *find_contribution(struct Command *command, int origin) {
+    struct Contribution *contribution = command->evicted_runs;
+    while (contribution != NULL && contribution->origin != origin) {
+        contribution = contribution->next;
+    }
+
+    if (contribution == NULL) {
+        contribution = calloc(1, sizeof(struct Contribution));
+        if (contribution == NULL) {
+            perror("malloc");
+            _exit(1);
+        }
+        contribution->origin = origin;
+        contribution->next = command->evicted_runs;
+        command->evicted_runs = contribution;
+    }
+
+    return contribution;
+}
+
+/**
+ * This function keeps the run of an entry that came from a child monitor in
+ * the contribution of that child to its command, before the entry is evicted
+ * @param[in] info
+ */
+void keep_contribution(struct Info *info) {
+    struct Contribution *contribution = find_contribution(info->command, info->origin % ORIGIN_BASE);
+
+    contribution->count++;
+    contribution->total_time += info->time;
+    contribution->histogram[histogram_bucket(info->time)]++;
+}
+
+/**
+ * This function evicts the oldest finished entries while there are more entries
+ * than the limits allow or they're older than max_age, at most RETENTION_BATCH
+ * at a time. Their runs stay in the totals of their commands, and in evicted
+ * for the stats requests by pid. The files of local runs are queued to be
+ * compacted, the runs of a child monitor are kept in its contribution, taken
+ * back when it goes away
+ */
+void enforce_retention() {
+    long limit = entry_limit();
+    long time_now = max_age > 0 ? now_ms() : 0;
+
+    for (int batch = 0; batch < RETENTION_BATCH && oldest_finished != NULL; batch++) {
+        struct Info *info = oldest_finished;
+
+        int too_many = limit > 0 && num_entries > limit;
+        int too_old = max_age > 0 && info->ended_at + max_age <= time_now;
+        if (!too_many && !too_old) {
+            break;
+        }
+
+        if (num_evicted == max_evicted) {
+            max_evicted = max_evicted == 0 ? 64 : max_evicted * 2;
+            evicted = realloc(evicted, max_evicted * sizeof(struct Evicted));
+            if (evicted == NULL) {
+                perror("realloc");
+                _exit(1);
+            }
+        }
+        evicted[num_evicted].pid = info->pid;
+        evicted[num_evicted].origin = info->origin;
+        evicted[num_evicted].command = info->command;
+        evicted[num_evicted].time = info->time;
+        evicted[num_evicted].weight = info->weight;
+        num_evicted++;
+
+        if (info->origin == 0) {
+            num_to_compact++;
+        } else {
+            keep_contribution(info);
+        }
+
+        remove_info(info->index);
+    }
+}
+
+/**
+ * This function enforces max_age when it's due, entries get old without any request arriving
+ * @param[out] timeout Milliseconds until the next check, -1 if there's no max_age
+ */
+int tick_retention() {
+    if (max_age <= 0) {
+        return -1;
+    }
+
+    long time_now = now_ms();
+
+    if (next_retention <= time_now) {
+        enforce_retention();
+        next_retention = time_now + RETENTION_INTERVAL;
+
+        // The oldest entry may get too old before the next regular check
+        if (oldest_finished != NULL && oldest_finished->ended_at + max_age < next_retention) {
+            next_retention = oldest_finished->ended_at + max_age;
+        }
+    }
+
+    return next_retention - time_now;
+}
+
+/**
+ * This function creates the sampling file and maps it, the tracers map it too
+ * to find whether to trace a run without asking the monitor
+ */
+void open_sampling() {
+    int sampling_fd = open(SAMPLING_FILE, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (sampling_fd == -1) {
+        // Debug: opening failed
+        perror("open");
+        _exit(1);
+    }
+
+    if (ftruncate(sampling_fd, SAMPLING_SLOTS * sizeof(struct SamplingSlot)) == -1) {
+        // Debug: sizing failed
+        perror("ftruncate");
+        _exit(1);
+    }
+
+    sampling = mmap(NULL, SAMPLING_SLOTS * sizeof(struct SamplingSlot), PROT_READ | PROT_WRITE, MAP_SHARED, sampling_fd, 0);
+    if (sampling == MAP_FAILED) {
+        // Debug: mapping failed
+        perror("mmap");
+        _exit(1);
+    }
+
+    close(sampling_fd);
+}
+
+/**
+ * This function finds the slot of a command in the sampling file, claiming a
+ * free one for it the first time. Slots are never freed, so a tracer probing
+ * for a command doesn't stop short of it. Every shard claims slots, the
+ * claimed flag settles which one gets a free slot
+ * @param[in] name
+ * @param[out] slot -1 if the name is too long or the file is full
+ */
+int claim_sampling(char *name) {
+    if (sampling == NULL || strlen(name) >= SAMPLING_NAME) {
+        return -1;
+    }
+
+    unsigned long slot = hash_name(name) % SAMPLING_SLOTS;
+    for (int probe = 0; probe < SAMPLING_SLOTS; probe++, slot = (slot + 1) % SAMPLING_SLOTS) {
+        unsigned int unclaimed = 0;
+        if (__atomic_compare_exchange_n(&sampling[slot].claimed, &unclaimed, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            // The name goes in before the rate, whoever reads the rate finds the whole name
+            strcpy(sampling[slot].name, name);
+            __atomic_store_n(&sampling[slot].rate, 1, __ATOMIC_RELEASE);
+            return slot;
+        }
+
+        // Claimed by another shard that may still be writing the name
+        while (__atomic_load_n(&sampling[slot].rate, __ATOMIC_ACQUIRE) == 0) {
+            sched_yield();
+        }
+        if (strcmp(sampling[slot].name, name) == 0) {
+            return slot;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * This function counts the runs a start request stands for in the slot of its
+ * command, for the adaptive sampling to see the runs of every shard
+ * @param[in] command
+ * @param[in] weight
+ */
+void count_sampling(struct Command *command, long weight) {
+    if (sampling == NULL || target_rate <= 0) {
+        return;
+    }
+
+    if (command->sampling_slot == 0) {
+        int slot = claim_sampling(command->name);
+        command->sampling_slot = slot >= 0 ? slot + 1 : -1;
+    }
+
+    if (command->sampling_slot > 0) {
+        __atomic_fetch_add(&sampling[command->sampling_slot - 1].runs, weight, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * This function adapts the sampling rate of every command to the runs it started
+ * since the last adjustment, so none of them is traced more than target_rate
+ * times per second. The rates given with "-n" stay as they are
+ * @param[out] timeout Milliseconds until the next adjustment, -1 if the rates don't adapt
+ */
+int tick_sampling() {
+    if (target_rate <= 0 || !adapts_sampling) {
+        return -1;
+    }
+
+    long time_now = now_ms();
+
+    if (next_sampling == 0) {
+        next_sampling = time_now + SAMPLING_INTERVAL;
+    } else if (next_sampling <= time_now) {
+        long elapsed = time_now - next_sampling + SAMPLING_INTERVAL;
+
+        for (int slot = 0; slot < SAMPLING_SLOTS; slot++) {
+            unsigned int old_rate = __atomic_load_n(&sampling[slot].rate, __ATOMIC_ACQUIRE);
+            if (old_rate == 0 || sampling[slot].fixed) {
+                continue;
+            }
+
+            // Runs per second of the command, rounded up to the rate that brings them under the target
+            unsigned long runs = __atomic_exchange_n(&sampling[slot].runs, 0, __ATOMIC_RELAXED);
+            double rate = ceil((double) runs * 1000 / elapsed / target_rate);
+            unsigned int new_rate = rate < 1 ? 1 : rate > MAX_SAMPLING_RATE ? MAX_SAMPLING_RATE : (unsigned int) rate;
+
+            if (new_rate != old_rate) {
+                __atomic_store_n(&sampling[slot].rate, new_rate, __ATOMIC_RELEASE);
+            }
+        }
+
+        next_sampling = time_now + SAMPLING_INTERVAL;
+    }
+
+    return next_sampling - time_now;
+}
+
+/**
+ * This function appends the evicted runs to the compacted file of the output
+ * directory and removes their own files and captured output, in a child so the monitor goes on.
+ * A file is only removed if it still holds the run, its pid may have been
+ * used again by then
+ * @param[out] timeout Milliseconds until the next compaction, -1 if there's nothing to compact
+ */
+int tick_compaction() {
+    if (num_to_compact == 0) {
+        return -1;
+    }
+
+    long time_now = now_ms();
+
+    if (next_compaction > time_now || compactor != 0) {
+        return next_compaction > time_now ? next_compaction - time_now : COMPACT_INTERVAL;
+    }
+
+    int pid = fork();
+
+    if (pid == 0) {
+        char filename[BUFFER_SIZE];
+        char expected[BUFFER_SIZE];
+        char found[BUFFER_SIZE];
+
+        snprintf(filename, BUFFER_SIZE, "%s/%s", output_dir, COMPACTED_FILE);
+        int compacted_fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (compacted_fd == -1) {
+            perror("Error opening compacted file");
+            _exit(1);
+        }
+
+        for (int e = num_compacted; e < num_evicted; e++) {
+            if (evicted[e].origin != 0) {
+                continue;
+            }
+
+            int num_written = snprintf(expected, BUFFER_SIZE, "%s %ld\n", evicted[e].command->name, evicted[e].time);
+            snprintf(filename, BUFFER_SIZE, "%s/%d", output_dir, evicted[e].pid);
+
+            int file_fd = open(filename, O_RDONLY);
+            if (file_fd == -1) {
+                continue;
+            }
+            ssize_t bytes_read = read(file_fd, found, BUFFER_SIZE - 1);
+            close(file_fd);
+
+            if (bytes_read == num_written && memcmp(found, expected, num_written) == 0) {
+                num_written = snprintf(found, BUFFER_SIZE, "%d %s", evicted[e].pid, expected);
+                if (write_all(compacted_fd, found, num_written) == -1) {
+                    perror("Error writing compacted file");
+                    _exit(1);
+                }
+                unlink(filename);
+
+                // Its captured output goes with it
+                for (int k = 0; k < 2; k++) {
+                    snprintf(filename, BUFFER_SIZE, "%s/%d.%s", output_dir, evicted[e].pid, stream_names[k]);
+                    unlink(filename);
+                    snprintf(filename, BUFFER_SIZE, "%s/%d.%s.z", output_dir, evicted[e].pid, stream_names[k]);
+                    unlink(filename);
+                }
+            }
+        }
+
+        close(compacted_fd);
+        _exit(0);
+
+    } else if (pid < 0) {
+        // Debug: fork failed, tried again next time
+        perror("fork");
+    } else {
+        compactor = pid;
+        num_compacted = num_evicted;
+        num_to_compact = 0;
+    }
+
+    next_compaction = time_now + COMPACT_INTERVAL;
+    return COMPACT_INTERVAL;
+}
+
+/**
+ * This function queues the captured output of a run to be compressed
+ * @param[in] pid
+ */
+void queue_output(int pid) {
+    if (num_compressed == max_compressed) {
+        max_compressed = max_compressed == 0 ? 64 : max_compressed * 2;
+        compressed = realloc(compressed, max_compressed * sizeof(int));
+        if (compressed == NULL) {
+            perror("realloc");
+            _exit(1);
+        }
+    }
+    compressed[num_compressed++] = pid;
+}
+
+/**
+ * This function compresses a captured stream of a run, "pid.out" or
+ * "pid.err", into "pid.out.z" or "pid.err.z". It's written in segments of
+ * OUTPUT_SEGMENT bytes, each one a header of two 32 bit words with its size
+ * before and after compression followed by the compressed bytes, so it can
+ * be streamed back a segment at a time. The raw file is only removed once the
+ * compressed one took its name
+ * @param[in] pid
+ * @param[in] stream 0 for stdout 1 for stderr
+ * @param[out] 0 on success -1 on failure
+ */
+int compress_output(int pid, int stream) {
+    char raw_name[BUFFER_SIZE];
+    char temp_name[BUFFER_SIZE];
+    char packed_name[BUFFER_SIZE];
+
+    snprintf(raw_name, BUFFER_SIZE, "%s/%d.%s", output_dir, pid, stream_names[stream]);
+    snprintf(temp_name, BUFFER_SIZE, "%s/%d.%s.z.tmp", output_dir, pid, stream_names[stream]);
+    snprintf(packed_name, BUFFER_SIZE, "%s/%d.%s.z", output_dir, pid, stream_names[stream]);
+
+    int raw_fd = open(raw_name, O_RDONLY);
+    if (raw_fd == -1) {
+        // Nothing was captured or it's compressed already
+        return -1;
+    }
+
+    int packed_fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (packed_fd == -1) {
+        // Debug: opening failed
+        perror("Error opening compressed output");
+        close(raw_fd);
+        return -1;
+    }
+
+    uLong bound = compressBound(OUTPUT_SEGMENT);
+    char *segment = malloc(OUTPUT_SEGMENT);
+    char *packed = malloc(bound);
+    if (segment == NULL || packed == NULL) {
+        perror("malloc");
+        _exit(1);
+    }
+
+    int result = 0;
+    ssize_t bytes_read;
+    while ((bytes_read = read_all(raw_fd, segment, OUTPUT_SEGMENT)) > 0) {
+        uLongf packed_len = bound;
+        if (compress2((Bytef *) packed, &packed_len, (Bytef *) segment, bytes_read, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            result = -1;
+            break;
+        }
+
+        uint32_t header[2] = { bytes_read, packed_len };
+        if (write_all(packed_fd, (char *) header, sizeof(header)) == -1 || write_all(packed_fd, packed, packed_len) == -1) {
+            perror("Error writing compressed output");
+            result = -1;
+            break;
+        }
+        count_metric(&metrics->output_raw_bytes, bytes_read);
+        count_metric(&metrics->output_compressed_bytes, sizeof(header) + packed_len);
+    }
+
+    free(segment);
+    free(packed);
+    close(raw_fd);
+    close(packed_fd);
+
+    if (bytes_read < 0 || result == -1 || rename(temp_name, packed_name) == -1) {
+        // Debug: the raw file stays, it's still served as it is
+        unlink(temp_name);
+        return -1;
+    }
+
+    unlink(raw_name);
+    return 0;
+}
+
+/**
+ * This function compresses the output captured of the runs that ended, in a
+ * child so the monitor goes on. A run that ended while it works waits for the
+ * next one
+ * @param[out] timeout Milliseconds until the next check, -1 if there's nothing to compress
+ */
+int tick_compression() {
+    if (num_compressed == 0) {
+        return -1;
+    }
+
+    if (compressor != 0) {
+        // Its exit may signal right before the wait, so it's checked for like a job's
+        return JOB_POLL_INTERVAL;
+    }
+
+    int pid = fork();
+
+    if (pid == 0) {
+        for (int c = 0; c < num_compressed; c++) {
+            compress_output(compressed[c], 0);
+            compress_output(compressed[c], 1);
+        }
+        _exit(0);
+
+    } else if (pid < 0) {
+        // Debug: fork failed, tried again next time
+        perror("fork");
+        return COMPACT_INTERVAL;
+    }
+
+    compressor = pid;
+    num_compressed = 0;
+    return -1;
+}
+
+/**
+ * This function streams back a captured stream of a run. The compressed file
+ * is inflated a segment at a time, the raw one of a run that wasn't compressed
+ * yet is spliced to the client pipe without going through this process. If
+ * the raw file is compressed and removed between the two, the compressed one
+ * is looked for again
+ * @param[in] fd
+ * @param[in] pid
+ * @param[in] stream 0 for stdout 1 for stderr
+ */
+void write_output(int fd, int pid, int stream) {
+    char filename[BUFFER_SIZE];
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        snprintf(filename, BUFFER_SIZE, "%s/%d.%s.z", output_dir, pid, stream_names[stream]);
+        int packed_fd = open(filename, O_RDONLY);
+
+        if (packed_fd != -1) {
+            uLong bound = compressBound(OUTPUT_SEGMENT);
+            char *segment = malloc(OUTPUT_SEGMENT);
+            char *packed = malloc(bound);
+            if (segment == NULL || packed == NULL) {
+                perror("malloc");
+                _exit(1);
+            }
+
+            uint32_t header[2];
+            while (read_all(packed_fd, (char *) header, sizeof(header)) == sizeof(header)) {
+                uLongf segment_len = OUTPUT_SEGMENT;
+                if (header[0] > OUTPUT_SEGMENT || header[1] > bound || read_all(packed_fd, packed, header[1]) != header[1] ||
+                    uncompress((Bytef *) segment, &segment_len, (Bytef *) packed, header[1]) != Z_OK || segment_len != header[0]) {
+                    // Debug: the compressed file is damaged
+                    fprintf(stderr, "Damaged output of pid %d\n", pid);
+                    break;
+                }
+                if (write_all(fd, segment, segment_len) == -1) {
+                    break;
+                }
+            }
+
+            free(segment);
+            free(packed);
+            close(packed_fd);
+            return;
+        }
+
+        snprintf(filename, BUFFER_SIZE, "%s/%d.%s", output_dir, pid, stream_names[stream]);
+        int raw_fd = open(filename, O_RDONLY);
+
+        if (raw_fd != -1) {
+            ssize_t num_spliced;
+            while ((num_spliced = splice(raw_fd, NULL, fd, NULL, OUTPUT_SEGMENT, SPLICE_F_MORE)) > 0);
+
+            if (num_spliced < 0) {
+                // Debug: splice failed, copied the rest instead
+                char buffer[BUFFER_SIZE];
+                ssize_t bytes_read;
+                while ((bytes_read = read(raw_fd, buffer, BUFFER_SIZE)) > 0 && write_all(fd, buffer, bytes_read) == 0);
+            }
+
+            close(raw_fd);
+            return;
+        }
+    }
+
+    char buffer[BUFFER_SIZE];
+    int num_written = snprintf(buffer, BUFFER_SIZE, "No output for pid %d\n", pid);
+    write_all(fd, buffer, num_written);
+}
+
+/**
+ * This function tells if a job goes before another in the queue, those
+ * submitted in the same millisecond go in the order they were submitted
+ * @param[in] job
+ * @param[in] other
+ */
+int job_before(struct Job *job, struct Job *other) {
+    return job->key > other->key || (job->key == other->key && job->id < other->id);
+}
+
+/**
+ * This function moves a job of the queue up to its place in the heap
+ * @param[in] j Position of the job
+ */
+void sift_job_up(int j) {
+    while (j > 0 && job_before(job_queue[j], job_queue[(j - 1) / 2])) {
+        struct Job *parent = job_queue[(j - 1) / 2];
+        job_queue[(j - 1) / 2] = job_queue[j];
+        job_queue[j] = parent;
+        j = (j - 1) / 2;
+    }
+}
+
+/**
+ * This function adds a job to the queue. Every queued job ages at the same
+ * pace, so comparing priority + waited / JOB_AGING of two jobs at any time is
+ * comparing their priority * JOB_AGING - submitted, and the heap never has to
+ * be reordered as they wait
+ * @param[in] job
+ */
+void queue_job(struct Job *job) {
+    if (num_queued_jobs == max_queued_jobs) {
+        max_queued_jobs = max_queued_jobs == 0 ? 64 : max_queued_jobs * 2;
+        job_queue = realloc(job_queue, max_queued_jobs * sizeof(struct Job *));
+        if (job_queue == NULL) {
+            perror("realloc");
+            _exit(1);
+        }
+    }
+
+    job->key = job->priority * JOB_AGING - job->submitted;
+    job_queue[num_queued_jobs] = job;
+    sift_job_up(num_queued_jobs++);
+}
+
+/**
+ * This function takes the first job out of the queue
+ * @param[out] job NULL if the queue is empty
+ */
+struct Job *unqueue_job() {
+    if (num_queued_jobs == 0) {
+        return NULL;
+    }
+
+    struct Job *first = job_queue[0];
+    job_queue[0] = job_queue[--num_queued_jobs];
+
+    int j = 0;
+    while (1) {
+        int largest = j;
+        for (int child = 2 * j + 1; child <= 2 * j + 2 && child < num_queued_jobs; child++) {
+            if (job_before(job_queue[child], job_queue[largest])) {
+                largest = child;
+            }
+        }
+        if (largest == j) {
+            break;
+        }
+        struct Job *swap = job_queue[j];
+        job_queue[j] = job_queue[largest];
+        job_queue[largest] = swap;
+        j = largest;
+    }
+
+    return first;
+}
+
+/**
+ * This function writes a line for each queued job, as
+ * "queued id program priority p waiting ms"
+ * @param[in] fd
+ */
+void write_jobs(int fd) {
+    char buffer[BUFFER_SIZE];
+    long time_now = now_ms();
+
+    for (int j = 0; j < num_queued_jobs; j++) {
+        struct Job *job = job_queue[j];
+        int num_written = snprintf(buffer, BUFFER_SIZE, "queued %d %s priority %d waiting %ld\n", job->id, job->command->name, job->priority, time_now - job->submitted);
+        if (num_written > 0 && num_written < BUFFER_SIZE) {
+            write_all(fd, buffer, num_written);
+        }
+    }
+}
+
+/**
+ * This function updates the information namely the time and the running status given a certain pid
+ * @param[in] pid
+ * @param[in] new_time
+ * @param[in] new_running
+ * @param[out] info The updated entry, NULL if the pid wasn't running
+ */
+struct Info *update_info(int pid, long new_time, int new_running) {
+    // Find the corresponding Info struct in the array
+    struct Info *info = find_running(pid, 0);
+    
+    if (info != NULL) {
+        // Update the Info struct
+        if (new_running == 0) {
+            command_record(info->command, new_time, 1);
+            record_activity(info->command, info->time + new_time, 0, 1, new_time);
+            finish_info(info, new_time);
+        } else {
+            unindex_info(info);
+            info->time = new_time;
+            index_info(info);
+        }
+    }
+
+    return info;
+}
+
+/**
+ * This function prepares a reader for a file descriptor
+ * @param[in] reader
+ * @param[in] fd
+ */
+void reader_init(struct Reader *reader, int fd) {
+    reader->fd = fd;
+    reader->pos = 0;
+    reader->len = 0;
+    reader->size = BUFFER_SIZE;
+    reader->line = malloc(reader->size);
+    reader->line_len = 0;
+    reader->eof = 0;
+
+    if (reader->line == NULL) {
+        perror("malloc");
+        _exit(1);
+    }
+}
+
+/**
+ * This is the readln function, it reads a whole line into reader->line no matter
+ * how long it is. On a non blocking file a line that isn't complete yet is kept
+ * in the reader for the next call
+ * @param[in] reader Reader of the file from witch is the lines will be read
+ * @param[out] total_bytes_read Length of the line or -1 if there's no line (yet)
+ */
+ssize_t readln(struct Reader *reader) {
+
+    while (1) {
+        if (reader->pos == reader->len) {
+            reader->pos = 0;
+            reader->len = read(reader->fd, reader->buffer, BUFFER_SIZE);
+            if (reader->len <= 0) {
+                if (reader->len == 0) {
+                    reader->eof = 1;
+                }
+                reader->len = 0;
+                if (reader->eof && reader->line_len > 0) {
+                    break;
+                }
+                return -1;
+            }
+        }
+
+        char c = reader->buffer[reader->pos++];
+        if (c == '\n') {
+            break;
+        }
+
+        if ((size_t) reader->line_len + 1 >= reader->size) {
+            reader->size *= 2;
+            reader->line = realloc(reader->line, reader->size);
+            if (reader->line == NULL) {
+                perror("realloc");
+                _exit(1);
+            }
+        }
+        reader->line[reader->line_len++] = c;
+    }
+
+    ssize_t total_bytes_read = reader->line_len;
+    reader->line[total_bytes_read] = '\0';
+    reader->line_len = 0;
+    return total_bytes_read;
+}
+
+/**
+ * This function allocates an empty pid set big enough for every pid of the system
+ * @param[out] set
+ */
+void pidset_init(struct PidSet *set) {
+    char buffer[BUFFER_SIZE];
+
+    set->max_pid = DEFAULT_PID_MAX;
+
+    int fd = open(PID_MAX_FILE, O_RDONLY);
+    if (fd != -1) {
+        ssize_t bytes_read = read(fd, buffer, BUFFER_SIZE - 1);
+        if (bytes_read > 0) {
+            buffer[bytes_read] = '\0';
+            set->max_pid = atol(buffer);
+        }
+        close(fd);
+    }
+
+    set->bits = calloc(set->max_pid / LONG_BITS + 1, sizeof(unsigned long));
+    if (set->bits == NULL) {
+        perror("calloc");
+        _exit(1);
+    }
+}
+
+/**
+ * This function adds every pid from first to last to the set, whole words at a time
+ * @param[in] set
+ * @param[in] first
+ * @param[in] last
+ */
+void pidset_add_range(struct PidSet *set, long first, long last) {
+    if (first < 0) {
+        first = 0;
+    }
+    if (last >= set->max_pid) {
+        last = set->max_pid - 1;
+    }
+
+    while (first <= last && first % LONG_BITS != 0) {
+        set->bits[first / LONG_BITS] |= 1UL << (first % LONG_BITS);
+        first++;
+    }
+    while (first + (long) LONG_BITS - 1 <= last) {
+        set->bits[first / LONG_BITS] = ~0UL;
+        first += LONG_BITS;
+    }
+    while (first <= last) {
+        set->bits[first / LONG_BITS] |= 1UL << (first % LONG_BITS);
+        first++;
+    }
+}
+
+/**
+ * This function adds a pid ("1234") or an inclusive pid range ("1000-5000") to the set
+ * @param[in] set
+ * @param[in] token
+ */
+void pidset_add_token(struct PidSet *set, char *token) {
+    char *end;
+    long first = strtol(token, &end, 10);
+    long last = first;
+
+    if (*end == '-') {
+        last = strtol(end + 1, &end, 10);
+    }
+
+    if (end == token || *end != '\0') {
+        // Debug: not a pid, ignore it
+        return;
+    }
+
+    pidset_add_range(set, first, last);
+}
+
+/**
+ * This function reads pids and pid ranges separated by white space from a fifo
+ * until the writer closes it, so a request isn't limited to the size of one line
+ * @param[in] set
+ * @param[in] path Path of the fifo
+ */
+void pidset_add_stream(struct PidSet *set, char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening pid stream");
+        return;
+    }
+
+    char buffer[BUFFER_SIZE];
+    char token[BUFFER_SIZE];
+    int token_len = 0;
+    ssize_t bytes_read;
+
+    while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
+        for (int i = 0; i < bytes_read; i++) {
+            if (buffer[i] == ' ' || buffer[i] == '\n' || buffer[i] == '\t') {
+                if (token_len > 0) {
+                    token[token_len] = '\0';
+                    pidset_add_token(set, token);
+                    token_len = 0;
+                }
+            } else if (token_len < BUFFER_SIZE - 1) {
+                token[token_len++] = buffer[i];
+            }
+        }
+    }
+
+    if (token_len > 0) {
+        token[token_len] = '\0';
+        pidset_add_token(set, token);
+    }
+
+    close(fd);
+}
+
+/**
+ * This function fills the set with the remaining tokens of a request being split with strtok
+ * @param[in] set
+ * @param[in] token First pid token of the request
+ */
+void pidset_parse(struct PidSet *set, char *token) {
+    pidset_init(set);
+
+    while (token != NULL) {
+        if (token[0] == PID_STREAM_PREFIX) {
+            pidset_add_stream(set, token + 1);
+        } else {
+            pidset_add_token(set, token);
+        }
+        token = strtok(NULL, " ");
+    }
+}
+
+/**
+ * This function tells if a pid belongs to the set
+ * @param[in] set
+ * @param[in] pid
+ * @param[out] 1 if true 0 if false
+ */
+int pidset_has(struct PidSet *set, int pid) {
+    if (pid < 0 || pid >= set->max_pid) {
+        return 0;
+    }
+    return (set->bits[pid / LONG_BITS] >> (pid % LONG_BITS)) & 1;
+}
+
+/**
+ * This function adds a name to an open addressing hash set of names
+ * @param[in] set Array of size slots, NULL when free
+ * @param[in] size Number of slots, a power of two bigger than the number of names
+ * @param[in] name
+ * @param[out] 1 if the name was new 0 if it was already there
+ */
+int name_set_add(char **set, int size, char *name) {
+    int slot = hash_name(name) & (size - 1);
+    while (set[slot] != NULL) {
+        if (strcmp(set[slot], name) == 0) {
+            return 0;
+        }
+        slot = (slot + 1) & (size - 1);
+    }
+
+    set[slot] = name;
+    return 1;
+}
+
+/**
+ * This function returns the number of slots a name set needs to hold count names
+ * @param[in] count
+ */
+int name_set_size(int count) {
+    int size = 16;
+    while (size < 2 * count) {
+        size *= 2;
+    }
+    return size;
+}
+
+/**
+ * This function counts one run found by a stats request
+ * @param[in] query
+ * @param[in] seen Names already collected, NULL unless they're collected
+ * @param[in] size Size of seen
+ * @param[in] pid
+ * @param[in] command
+ * @param[in] time Elapsed time, ignored while it runs
+ * @param[in] weight Runs it stands for
+ * @param[in] running 1 if it's still running
+ */
+void count_run(struct Query *query, char **seen, int size, int pid, struct Command *command, long time, long weight, int running) {
+    if (!pidset_has(query->pids, pid)) {
+        return;
+    }
+    if (query->program_name != NULL && command != query->command) {
+        return;
+    }
+
+    // A sampled entry stands for weight runs, each adds w(w - 1) times its value squared to the variance
+    query->count += weight;
+    if (weight > 1) {
+        query->sampled++;
+        query->count_variance += (double) weight * (weight - 1);
+    }
+    if (running == 0) {
+        query->total_time += weight * time;
+        query->time_variance += (double) weight * (weight - 1) * time * time;
+    }
+    if (seen != NULL && name_set_add(seen, size, command->name)) {
+        query->names[query->num_names++] = command->name;
+    }
+}
+
+/**
+ * This function scans one slice of the runs a stats request looks at, it's the
+ * body of the query threads. The entries of the information array come first
+ * and the evicted runs after them
+ * @param[in] arg Query with the slice to scan
+ */
+void *scan_slice(void *arg) {
+    struct Query *query = arg;
+
+    int size = name_set_size(query->last - query->first);
+    char **seen = NULL;
+
+    if (query->uniq) {
+        seen = calloc(size, sizeof(char *));
+        query->names = malloc((query->last - query->first + 1) * sizeof(char *));
+        if (seen == NULL || query->names == NULL) {
+            perror("malloc");
+            _exit(1);
+        }
+    }
+
+    for (int i = query->first; i < query->last; i++) {
+        if (i < num_entries) {
+            struct Info *info = information[i];
+            count_run(query, seen, size, info->pid, info->command, info->time, info->weight, info->running);
+        } else {
+            struct Evicted *run = &evicted[i - num_entries];
+            count_run(query, seen, size, run->pid, run->command, run->time, run->weight, 0);
+        }
+    }
+
+    free(seen);
+    return NULL;
+}
+
+/**
+ * This function answers a stats request, splitting the scan of a big information
+ * array and the evicted runs between threads and merging their results in the
+ * order of the slices
+ * @param[in,out] query Query with the pids and filters, gets the merged result
+ */
+void run_query(struct Query *query) {
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_runs = num_entries + num_evicted;
+
+    if (num_threads > num_runs / MIN_SLICE_ENTRIES) {
+        num_threads = num_runs / MIN_SLICE_ENTRIES;
+    }
+    if (num_threads > MAX_QUERY_THREADS) {
+        num_threads = MAX_QUERY_THREADS;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    struct Query slices[MAX_QUERY_THREADS];
+    pthread_t threads[MAX_QUERY_THREADS];
+    int started[MAX_QUERY_THREADS] = {0};
+
+    for (int t = 0; t < num_threads; t++) {
+        slices[t] = *query;
+        slices[t].first = (long) num_runs * t / num_threads;
+        slices[t].last = (long) num_runs * (t + 1) / num_threads;
+
+        if (t > 0) {
+            started[t] = pthread_create(&threads[t], NULL, scan_slice, &slices[t]) == 0;
+            if (!started[t]) {
+                // Debug: no thread, scan the slice here
+                scan_slice(&slices[t]);
+            }
+        }
+    }
+
+    scan_slice(&slices[0]);
+
+    int size = name_set_size(num_runs);
+    char **seen = NULL;
+
+    if (query->uniq) {
+        seen = calloc(size, sizeof(char *));
+        query->names = malloc((num_runs + 1) * sizeof(char *));
+        if (seen == NULL || query->names == NULL) {
+            perror("malloc");
+            _exit(1);
+        }
+    }
+
+    for (int t = 0; t < num_threads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+
+        query->total_time += slices[t].total_time;
+        query->count += slices[t].count;
+        query->sampled += slices[t].sampled;
+        query->count_variance += slices[t].count_variance;
+        query->time_variance += slices[t].time_variance;
+
+        for (int j = 0; j < slices[t].num_names; j++) {
+            if (name_set_add(seen, size, slices[t].names[j])) {
+                query->names[query->num_names++] = slices[t].names[j];
+            }
+        }
+        free(slices[t].names);
+    }
+
+    free(seen);
+}
+
+/**
+ * This function writes as much as it can of the deltas a subscriber or watcher
+ * has pending, without blocking, and waits for it to be writable if some are left
+ * @param[in] channel
+ * @param[out] 0 on success -1 if the subscriber went away
+ */
+int flush_channel(struct Channel *channel) {
+    size_t done = 0;
+
+    while (done < channel->out_len) {
+        ssize_t num_written = write(channel->reader.fd, channel->out + done, channel->out_len - done);
+        if (num_written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (num_written <= 0) {
+            return -1;
+        }
+        done += num_written;
+    }
+
+    memmove(channel->out, channel->out + done, channel->out_len - done);
+    channel->out_len -= done;
+
+    struct epoll_event event = { .events = (channel->kind == CHANNEL_WATCHER ? 0 : EPOLLIN) | (channel->out_len > 0 ? EPOLLOUT : 0), .data.ptr = channel };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, channel->reader.fd, &event);
+
+    return 0;
+}
+
+/**
+ * This function forgets a subscriber, it will get a new snapshot if it connects again
+ * @param[in] k Index of the subscriber
+ */
+void drop_subscriber(int k) {
+    struct Channel *channel = subscribers[k];
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, channel->reader.fd, NULL);
+    close(channel->reader.fd);
+    free(channel->reader.line);
+    free(channel->out);
+    free(channel);
+    subscribers[k] = NULL;
+}
+
+/**
+ * This function queues a delta for one subscriber, dropping it if it fell too far behind
+ * @param[in] k Index of the subscriber
+ * @param[in] delta
+ * @param[in] size
+ */
+void queue_delta(int k, char *delta, size_t size) {
+    struct Channel *channel = subscribers[k];
+
+    if (channel->out_len + size > MAX_SUBSCRIBER_BACKLOG) {
+        drop_subscriber(k);
+        return;
+    }
+
+    while (channel->out_len + size > channel->out_size) {
+        channel->out_size *= 2;
+        channel->out = realloc(channel->out, channel->out_size);
+        if (channel->out == NULL) {
+            perror("realloc");
+            _exit(1);
+        }
+    }
+
+    memcpy(channel->out + channel->out_len, delta, size);
+    channel->out_len += size;
+}
+
+/**
+ * This function formats the delta of an entry: "run pid name start_time weight
+ * origin" when it starts and "done pid name elapsed_time weight origin" when
+ * it ends, weight being the runs a sampled entry stands for and origin the one
+ * of the entry here, so an aggregator above tells apart the runs of monitors
+ * below with the same pid. The running entries of a snapshot are "running"
+ * instead, they don't count as activity
+ * @param[in] info
+ * @param[in] buffer
+ * @param[in] snapshot 1 if the entry is part of a snapshot
+ * @param[out] num_written
+ */
+int format_delta(struct Info *info, char *buffer, int snapshot) {
+    char *kind = info->running ? (snapshot ? "running" : "run") : "done";
+    int num_written = snprintf(buffer, BUFFER_SIZE, "%s %d %s %ld %ld %ld\n", kind, info->pid, info->name, info->time, info->weight, info->origin);
+
+    if (num_written < 0 || num_written >= BUFFER_SIZE) {
+        num_written = 0;
+    }
+    return num_written;
+}
+
+/**
+ * This function stops sending deltas to a watcher
+ * @param[in] k Index of the watcher
+ */
+void drop_watcher(int k) {
+    struct Channel *channel = watchers[k];
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, channel->reader.fd, NULL);
+    close(channel->reader.fd);
+    free(channel->out);
+    free(channel);
+    watchers[k] = NULL;
+}
+
+/**
+ * This function queues a delta for a watcher if it fits in its buffer. If it
+ * doesn't the delta is dropped and the watcher gets a new snapshot once it
+ * catches up, so a slow watcher costs a bounded amount of memory and no waiting
+ * @param[in] k Index of the watcher
+ * @param[in] delta
+ * @param[in] size
+ * @param[out] 0 if it was queued -1 if it was dropped
+ */
+int queue_watch(int k, char *delta, size_t size) {
+    struct Channel *channel = watchers[k];
+
+    if (channel->resync || channel->out_len + size > channel->out_size) {
+        channel->resync = 1;
+        return -1;
+    }
+
+    memcpy(channel->out + channel->out_len, delta, size);
+    channel->out_len += size;
+    return 0;
+}
+
+/**
+ * This function queues the running entries for a watcher, from the running
+ * list, after a "resync" line if deltas were dropped since the last snapshot
+ * @param[in] k Index of the watcher
+ */
+void snapshot_watch(int k) {
+    struct Channel *channel = watchers[k];
+    char buffer[BUFFER_SIZE];
+
+    if (channel->resync) {
+        channel->resync = 0;
+        queue_watch(k, "resync\n", 7);
+    }
+
+    for (struct Info *info = oldest_running; info != NULL && channel->resync == 0; info = info->next_indexed) {
+        int num_written = snprintf(buffer, BUFFER_SIZE, "+ %d %s %ld\n", info->pid, info->name, info->time);
+        if (num_written > 0 && num_written < BUFFER_SIZE) {
+            queue_watch(k, buffer, num_written);
+        }
+    }
+}
+
+/**
+ * This function writes what a watcher has pending and, once it caught up after
+ * dropping deltas, sends it a new snapshot
+ * @param[in] k Index of the watcher
+ * @param[out] 0 on success -1 if the watcher went away, in which case it was dropped
+ */
+int service_watcher(int k) {
+    if (flush_channel(watchers[k]) == -1) {
+        drop_watcher(k);
+        return -1;
+    }
+
+    if (watchers[k]->resync && watchers[k]->out_len == 0) {
+        snapshot_watch(k);
+        if (flush_channel(watchers[k]) == -1) {
+            drop_watcher(k);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * This function sends a delta to every watcher: "+ pid name start_time" when a
+ * run starts and "- pid name elapsed_time" when it ends
+ * @param[in] info
+ */
+void push_watch(struct Info *info) {
+    char buffer[BUFFER_SIZE];
+    int num_written = snprintf(buffer, BUFFER_SIZE, "%c %d %s %ld\n", info->running ? '+' : '-', info->pid, info->name, info->time);
+
+    if (num_written < 0 || num_written >= BUFFER_SIZE) {
+        return;
+    }
+
+    for (int k = 0; k < MAX_WATCHERS; k++) {
+        if (watchers[k] != NULL) {
+            queue_watch(k, buffer, num_written);
+            service_watcher(k);
+        }
+    }
+}
+
+/**
+ * This function sends a "tick time_now" line to the watchers that are due one,
+ * so they can update the elapsed time of the runs themselves
+ * @param[out] timeout Milliseconds until the next tick is due, -1 if there are no watchers
+ */
+int tick_watchers() {
+    char buffer[BUFFER_SIZE];
+    long time_now = now_ms();
+    long timeout = -1;
+
+    for (int k = 0; k < MAX_WATCHERS; k++) {
+        if (watchers[k] == NULL) {
+            continue;
+        }
+
+        if (watchers[k]->next_tick <= time_now) {
+            int num_written = snprintf(buffer, BUFFER_SIZE, "tick %ld\n", time_now);
+            watchers[k]->next_tick = time_now + watchers[k]->interval;
+
+            // A tick that doesn't fit is just skipped, the next one does the same job
+            if (watchers[k]->resync == 0 && watchers[k]->out_len + num_written <= watchers[k]->out_size) {
+                queue_watch(k, buffer, num_written);
+            }
+            if (service_watcher(k) == -1) {
+                continue;
+            }
+        }
+
+        if (timeout == -1 || watchers[k]->next_tick - time_now < timeout) {
+            timeout = watchers[k]->next_tick - time_now;
+        }
+    }
+
+    return timeout;
+}
+
+/**
+ * This function registers a client that watches the status, given the request
+ * "watch fifo [interval]". It gets the running entries and then only deltas
+ * @param[in] request
+ */
+void add_watcher(char *request) {
+    char path[BUFFER_SIZE];
+    long interval = DEFAULT_WATCH_INTERVAL;
+
+    if (sscanf(request, "watch %1023s %ld", path, &interval) < 1 || interval <= 0) {
+        // Debug: bad request
+        return;
+    }
+
+    int k = 0;
+    while (k < MAX_WATCHERS && watchers[k] != NULL) {
+        k++;
+    }
+    if (k == MAX_WATCHERS) {
+        // Error: too many watchers
+        return;
+    }
+
+    // The client opened its fifo for reading before asking, so this doesn't block
+    int fd = open(path, O_WRONLY | O_NONBLOCK);
+    if (fd == -1) {
+        perror("Error opening watch fifo");
+        return;
+    }
+
+    struct Channel *channel = calloc(1, sizeof(struct Channel));
+    channel->kind = CHANNEL_WATCHER;
+    channel->reader.fd = fd;
+    channel->out_size = WATCH_BACKLOG;
+    channel->out = malloc(channel->out_size);
+    channel->interval = interval;
+    channel->next_tick = now_ms() + interval;
+    watchers[k] = channel;
+
+    struct epoll_event event = { .events = 0, .data.ptr = channel };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+    snapshot_watch(k);
+    service_watcher(k);
+}
+
+/**
+ * This function sends a delta to every aggregator following this monitor
+ * @param[in] delta
+ * @param[in] size
+ */
+void publish_line(char *delta, int size) {
+    for (int k = 0; k < MAX_SUBSCRIBERS; k++) {
+        if (subscribers[k] != NULL) {
+            queue_delta(k, delta, size);
+            if (subscribers[k] != NULL && flush_channel(subscribers[k]) == -1) {
+                drop_subscriber(k);
+            }
+        }
+    }
+}
+
+/**
+ * This function formats the totals of a command for a snapshot: "totals name
+ * count total_time max_time", then "bucket name index runs" for each bucket
+ * of its histogram that isn't empty, and queues them for a subscriber
+ * @param[in] k Index of the subscriber
+ * @param[in] command
+ */
+void queue_totals(int k, struct Command *command) {
+    char buffer[BUFFER_SIZE];
+
+    int num_written = snprintf(buffer, BUFFER_SIZE, "totals %s %ld %ld %ld\n", command->name, command->count, command->total_time, command->max_time);
+    if (num_written < 0 || num_written >= BUFFER_SIZE) {
+        return;
+    }
+    queue_delta(k, buffer, num_written);
+
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS && subscribers[k] != NULL; bucket++) {
+        if (command->histogram[bucket] == 0) {
+            continue;
+        }
+        num_written = snprintf(buffer, BUFFER_SIZE, "bucket %s %d %u\n", command->name, bucket, command->histogram[bucket]);
+        if (num_written > 0 && num_written < BUFFER_SIZE) {
+            queue_delta(k, buffer, num_written);
+        }
+    }
+}
+
+/**
+ * This function sends the change of an entry to every aggregator following this monitor
+ * and to the clients watching the status
+ * @param[in] info Entry that was created or ended
+ */
+void publish(struct Info *info) {
+    char buffer[BUFFER_SIZE];
+    int num_written = format_delta(info, buffer, 0);
+
+    push_watch(info);
+    publish_line(buffer, num_written);
+}
+
+/**
+ * This function accepts an aggregator and sends it a snapshot: the totals of
+ * every command that has finished runs, evicted ones included, and the
+ * running entries. After that it only gets deltas, so its entries are the
+ * runs that ended since and its totals the rest
+ * @param[in] listen_fd
+ */
+void accept_subscriber(int listen_fd) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+        perror("accept");
+        return;
+    }
+
+    int k = 0;
+    while (k < MAX_SUBSCRIBERS && subscribers[k] != NULL) {
+        k++;
+    }
+    if (k == MAX_SUBSCRIBERS) {
+        // Error: too many subscribers
+        close(fd);
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    struct Channel *channel = calloc(1, sizeof(struct Channel));
+    channel->kind = CHANNEL_SUBSCRIBER;
+    reader_init(&channel->reader, fd);
+    channel->out_size = BUFFER_SIZE;
+    channel->out = malloc(channel->out_size);
+    subscribers[k] = channel;
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = channel };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+    for (int c = 0; c < num_commands && subscribers[k] != NULL; c++) {
+        if (command_list[c]->count > 0) {
+            queue_totals(k, command_list[c]);
+        }
+    }
+
+    char buffer[BUFFER_SIZE];
+    for (struct Info *info = oldest_running; info != NULL && subscribers[k] != NULL; info = info->next_indexed) {
+        queue_delta(k, buffer, format_delta(info, buffer, 1));
+    }
+
+    if (subscribers[k] != NULL && flush_channel(channel) == -1) {
+        drop_subscriber(k);
+    }
+}
+
+/**
+ * This function connects an aggregator to one of its child monitors
+ * @param[in] channel Channel of the child monitor
+ * @param[out] 0 on success -1 on failure
+ */
+int connect_child(struct Channel *channel) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, channel->path, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    free(channel->reader.line);
+    reader_init(&channel->reader, fd);
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = channel };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+    return 0;
+}
+
+/**
+ * This function forgets every entry of a child monitor that went away and
+ * takes its runs back from the totals, the evicted ones too. They come back
+ * with the snapshot it sends when the aggregator reconnects
+ * @param[in] channel
+ */
+void disconnect_child(struct Channel *channel) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, channel->reader.fd, NULL);
+    close(channel->reader.fd);
+    channel->reader.fd = -1;
+
+    int i = 0;
+    while (i < num_entries) {
+        if (information[i]->origin % ORIGIN_BASE == channel->origin) {
+            if (information[i]->running == 0) {
+                command_record(information[i]->command, information[i]->time, -1);
+            }
+            remove_info(i);
+        } else {
+            i++;
+        }
+    }
+
+    // Its evicted runs too, none of them is waiting to be compacted
+    int kept = 0;
+    for (int e = 0; e < num_evicted; e++) {
+        if (evicted[e].origin % ORIGIN_BASE != channel->origin) {
+            evicted[kept++] = evicted[e];
+        } else if (e < num_compacted) {
+            num_compacted--;
+        }
+    }
+    num_evicted = kept;
+
+    for (int c = 0; c < num_commands; c++) {
+        struct Command *command = command_list[c];
+        for (struct Contribution **link = &command->evicted_runs; *link != NULL; link = &(*link)->next) {
+            struct Contribution *contribution = *link;
+            if (contribution->origin != channel->origin) {
+                continue;
+            }
+
+            command->count -= contribution->count;
+            command->total_time -= contribution->total_time;
+            for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+                command->histogram[bucket] -= contribution->histogram[bucket];
+            }
+
+            *link = contribution->next;
+            free(contribution);
+            break;
+        }
+    }
+
+    top_rebuild();
+}
+
+/**
+ * This function adds the totals of a command in the snapshot of a child monitor
+ * to the contribution of the child, and passes them on
+ * @param[in] delta "totals name count total_time max_time" or "bucket name index runs"
+ * @param[in] origin Child monitor plus one
+ */
+void apply_totals(char *delta, int origin) {
+    char kind[BUFFER_SIZE];
+    char name[BUFFER_SIZE];
+    long values[3];
+
+    int num_fields = sscanf(delta, "%1023s %1023s %ld %ld %ld", kind, name, &values[0], &values[1], &values[2]);
+    int totals = strcmp(kind, "totals") == 0;
+
+    if (totals ? num_fields != 5 || values[0] < 0 : num_fields != 4 || values[0] < 0 || values[0] >= HISTOGRAM_BUCKETS || values[1] < 0) {
+        // Debug: malformed totals
+        count_metric(&metrics->parse_failures, 1);
+        return;
+    }
+
+    count_metric(&metrics->events_ingested, 1);
+
+    struct Command *command = intern_command(name, 1);
+    struct Contribution *contribution = find_contribution(command, origin);
+
+    if (totals) {
+        contribution->count += values[0];
+        contribution->total_time += values[1];
+        command->count += values[0];
+        command->total_time += values[1];
+        if (values[2] > command->max_time) {
+            command->max_time = values[2];
+        }
+        top_update(command);
+    } else {
+        contribution->histogram[values[0]] += values[1];
+        command->histogram[values[0]] += values[1];
+    }
+
+    int size = strlen(delta);
+    delta[size] = '\n';
+    publish_line(delta, size + 1);
+    delta[size] = '\0';
+}
+
+/**
+ * This function applies a delta sent by a child monitor to the information array
+ * and passes it on, so aggregators can be stacked. Runs are found by pid and
+ * by origin, the child they came from and the origin they had there, so runs
+ * of two monitors below with the same pid stay apart
+ * @param[in] delta "run pid name start_time weight origin" or "done pid name
+ * elapsed_time weight origin", "running" for the running entries of a snapshot,
+ * "totals" and "bucket" for the totals of its commands
+ * @param[in] origin Child monitor plus one
+ */
+void apply_delta(char *delta, int origin) {
+    char kind[BUFFER_SIZE];
+    char name[BUFFER_SIZE];
+    int pid;
+    long time;
+    long weight = 1;
+    long source = 0;
+
+    if (strncmp(delta, "totals ", 7) == 0 || strncmp(delta, "bucket ", 7) == 0) {
+        apply_totals(delta, origin);
+        return;
+    }
+
+    if (sscanf(delta, "%1023s %d %1023s %ld %ld %ld", kind, &pid, name, &time, &weight, &source) < 4 || weight < 1
+        || source < 0 || source > (LONG_MAX - origin) / ORIGIN_BASE) {
+        // Debug: not a delta
+        count_metric(&metrics->parse_failures, 1);
+        return;
+    }
+
+    count_metric(&metrics->events_ingested, 1);
+
+    // The child it came from goes last, so it's the remainder
+    long full_origin = origin + ORIGIN_BASE * source;
+
+    struct Info *info = NULL;
+    int snapshot = strcmp(kind, "running") == 0;
+
+    if (strcmp(kind, "run") == 0 || snapshot) {
+        info = create_info(pid, name, time, 1);
+        if (info != NULL && !snapshot) {
+            record_activity(info->command, time, 1, 0, 0);
+        }
+    } else if (strcmp(kind, "done") == 0) {
+        info = find_running(pid, full_origin);
+        long end_time = info != NULL ? info->time + time : now_ms();
+        if (info != NULL) {
+            finish_info(info, time);
+        } else {
+            info = create_info(pid, name, time, 0);
+        }
+        if (info != NULL) {
+            command_record(info->command, time, 1);
+            record_activity(info->command, end_time, 0, 1, time);
+        }
+    }
+
+    if (info != NULL) {
+        info->origin = full_origin;
+        info->weight = weight;
+        publish(info);
+    }
+}
+
+/**
+ * This function saves a run to its file in the output directory, as
+ * "program time" with the start time while it runs and the elapsed time after
+ * @param[in] pid
+ * @param[in] program
+ * @param[in] time
+ * @param[out] 0 on success -1 on failure
+ */
+int save_run(int pid, char *program, long time) {
+    char buffer[BUFFER_SIZE];
+    char filename[BUFFER_SIZE];
+    sprintf(filename, "%s/%d", output_dir, pid);
+
+    int file_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (file_fd == -1) {
+        // Debug: opening failed
+        perror("Error opening file");
+        return -1;
+    }
+
+    int num_written = snprintf(buffer, BUFFER_SIZE, "%s %ld\n", program, time);
+
+    if (num_written < 0 || num_written >= BUFFER_SIZE) {
+        // Debug: message formatting failed
+        perror("Formatting message!");
+        close(file_fd);
+        return -1;
+    }
+
+    if (write(file_fd, buffer, num_written) != num_written) {
+        // Debug: writing failed
+        perror("Writing");
+        close(file_fd);
+        return -1;
+    }
+
+    close(file_fd);
+    return 0;
+}
+
+/**
+ * This function adds an entry to a reply if its duration passes the filter
+ * of a query. The line is "pid name ms" and its state, running, finished or
+ * orphaned. Then come "timed-out" if it passed its timeout and "sampled 1 in
+ * n" if it stands for n runs. Last come the fields the tracer sent: the
+ * usage of the process tree, the cores of the run, the size of its output
+ * and its counters, -1 for those it couldn't read
+ * @param[in] reply
+ * @param[in] info
+ * @param[in] now Current time, for the duration of running entries
+ * @param[in] min_ms
+ * @param[in] max_ms -1 if there's no upper bound
+ * @param[out] duration Duration of the entry, whether it was written or not
+ */
+long write_match(struct Reply *reply, struct Info *info, long now, long min_ms, long max_ms) {
+    long duration = info->running == 1 ? now - info->time : info->time;
+
+    if (duration >= min_ms && (max_ms < 0 || duration <= max_ms)) {
+        char tree[BUFFER_SIZE] = "";
+        int tree_len = 0;
+        if (info->tree) {
+            tree_len = snprintf(tree, BUFFER_SIZE, " tree cpu %ld ms peak %ld kB read %ld B written %ld B",
+                info->tree_cpu_us / 1000, info->tree_peak_kb, info->tree_read_bytes, info->tree_write_bytes);
+        }
+        if (info->cpus != 0) {
+            tree_len += snprintf(tree + tree_len, BUFFER_SIZE - tree_len, " cpus ");
+            tree_len += format_cpus(info->cpus, tree + tree_len, BUFFER_SIZE - tree_len);
+        }
+        if (info->output) {
+            tree_len += snprintf(tree + tree_len, BUFFER_SIZE - tree_len, " output stdout %ld B stderr %ld B dropped %ld B",
+                info->output_bytes[0], info->output_bytes[1], info->output_dropped);
+        }
+        if (info->perf) {
+            snprintf(tree + tree_len, BUFFER_SIZE - tree_len, " perf task-clock %ld us ctx %ld faults %ld migrations %ld cycles %ld instructions %ld",
+                info->perf_counts[0] / 1000, info->perf_counts[1], info->perf_counts[2], info->perf_counts[3], info->perf_counts[4], info->perf_counts[5]);
+        }
+
+        reply_long(reply, info->pid);
+        reply_string(reply, " ");
+        reply_string(reply, info->name);
+        reply_string(reply, " ");
+        reply_long(reply, duration);
+        reply_string(reply, info->running == 1 ? " ms running" : info->orphaned ? " ms orphaned" : " ms finished");
+        if (info->timed_out) {
+            reply_string(reply, " timed-out");
+        }
+        if (info->weight > 1) {
+            reply_string(reply, " sampled 1 in ");
+            reply_long(reply, info->weight);
+        }
+        reply_string(reply, tree);
+        reply_string(reply, "\n");
+    }
+
+    return duration;
+}
+
+/**
+ * This function answers a query "query [prefix name] [running] [finished]
+ * [min ms] [max ms]". A name prefix narrows it to the commands of a range of
+ * the name index, without one running entries are walked from the oldest
+ * until they get too short and finished ones only from the duration buckets
+ * the bounds fall in, so neither case scans the whole information array
+ * @param[in] fd
+ * @param[in] request
+ */
+void run_filter_query(int fd, char *request) {
+    char *prefix = NULL;
+    int states[2] = {0, 0};
+    long min_ms = 0;
+    long max_ms = -1;
+
+    char *token = strtok(request, " ");
+    while ((token = strtok(NULL, " ")) != NULL) {
+        if (strcmp(token, "prefix") == 0) {
+            prefix = strtok(NULL, " ");
+        } else if (strcmp(token, "running") == 0) {
+            states[1] = 1;
+        } else if (strcmp(token, "finished") == 0) {
+            states[0] = 1;
+        } else if (strcmp(token, "min") == 0 && (token = strtok(NULL, " ")) != NULL) {
+            min_ms = atol(token);
+        } else if (strcmp(token, "max") == 0 && (token = strtok(NULL, " ")) != NULL) {
+            max_ms = atol(token);
+        }
+    }
+
+    // No state asked for means both
+    if (!states[0] && !states[1]) {
+        states[0] = states[1] = 1;
+    }
+
+    long now = now_ms();
+
+    struct Reply reply;
+    reply_open(&reply, fd, 0);
+
+    if (prefix != NULL) {
+        size_t prefix_len = strlen(prefix);
+
+        for (int c = find_prefix(prefix); c < num_commands && strncmp(name_index[c]->name, prefix, prefix_len) == 0; c++) {
+            struct Command *command = name_index[c];
+
+            if (states[1]) {
+                for (struct Info *info = command->runs[1]; info != NULL; info = info->next_run) {
+                    write_match(&reply, info, now, min_ms, max_ms);
+                }
+            }
+
+            // Finished runs can be skipped as a whole when none of them was long enough
+            if (states[0] && command->max_time >= min_ms) {
+                for (struct Info *info = command->runs[0]; info != NULL; info = info->next_run) {
+                    write_match(&reply, info, now, min_ms, max_ms);
+                }
+            }
+        }
+        reply_close(&reply);
+        return;
+    }
+
+    if (states[1]) {
+        for (struct Info *info = oldest_running; info != NULL; info = info->next_indexed) {
+            if (write_match(&reply, info, now, min_ms, max_ms) < min_ms) {
+                break;
+            }
+        }
+    }
+
+    if (states[0]) {
+        int last = max_ms < 0 ? HISTOGRAM_BUCKETS - 1 : histogram_bucket(max_ms);
+
+        for (int bucket = histogram_bucket(min_ms); bucket <= last; bucket++) {
+            for (struct Info *info = duration_index[bucket]; info != NULL; info = info->next_indexed) {
+                write_match(&reply, info, now, min_ms, max_ms);
+            }
+        }
+    }
+
+    reply_close(&reply);
+}
+
+/**
+ * This function compares two rows of a trend by their period, for qsort
+ * @param[in] a
+ * @param[in] b
+ */
+int compare_periods(const void *a, const void *b) {
+    long first = ((struct Slot *) a)->period;
+    long second = ((struct Slot *) b)->period;
+
+    return (first > second) - (first < second);
+}
+
+/**
+ * This function adds the error bound of a shard's estimate, "(estimated from
+ * n sampled runs, +/- bound", to those of the others
+ * @param[in] answer
+ * @param[in,out] sampled
+ * @param[in,out] square_bound Sum of the squares of the bounds
+ */
+void merge_bound(char *answer, long *sampled, double *square_bound) {
+    char *estimate = strstr(answer, "(estimated from ");
+    long runs;
+    double bound;
+
+    if (estimate != NULL && sscanf(estimate, "(estimated from %ld sampled runs, +/- %lf", &runs, &bound) == 2) {
+        *sampled += runs;
+        *square_bound += bound * bound;
+    }
+}
+
+/**
+ * This function answers a query that can't be parsed, the client is waiting
+ * for an answer on the client pipe whatever it sent
+ * @param[in] kind First word of the query
+ */
+void answer_malformed(char *kind) {
+    count_metric(&metrics->parse_failures, 1);
+
+    int client_fd = open(client_pipe_name, O_WRONLY);
+    if (client_fd == -1) {
+        perror("Error opening client pipe");
+        _exit(1);
+    }
+
+    char buffer[BUFFER_SIZE];
+    int num_written = snprintf(buffer, BUFFER_SIZE, "Malformed %.64s request\n", kind);
+    if (write(client_fd, buffer, num_written) != num_written) {
+        perror("Error writing to client pipe");
+        _exit(1);
+    }
+
+    close(client_fd);
+}
+
+/**
+ * This function is used by the coordinator of a sharded monitor: it sends a query
+ * to every shard, streaming them the pid list if the client streamed one, and
+ * merges their answers into one (sums for stats-time, counts for stats-command,
+ * the distinct names for stats-uniq, the histograms for stats-latency, the
+ * counter totals for stats-perf, the periods for stats-trend, the lines of
+ * every shard otherwise)
+ * @param[in] request
+ */
+void fan_out_request(char *request) {
+    char buffer[BUFFER_SIZE];
+    char line[PIPE_BUF];
+    struct Command merged = {0};
+
+    // Without a command every shard would answer it malformed, it's answered once here
+    if (strcmp(request, "stats-latency") == 0 || strcmp(request, "stats-perf") == 0) {
+        answer_malformed(request);
+        return;
+    }
+
+    // The shards send their histograms instead of percentiles, those can't be merged
+    int latency = strncmp(request, "stats-latency ", 14) == 0;
+    if (latency) {
+        request += 14;
+        merged.name = request;
+    }
+
+    // Averages of counters can't either, the shards send the totals
+    int perf = strncmp(request, "stats-perf ", 11) == 0;
+    if (perf) {
+        request += 11;
+        merged.name = request;
+    }
+
+    // Same for stats-top, they send the totals of every command and the ranking is done here
+    int top = strncmp(request, "stats-top", 9) == 0;
+    char stream_names[MAX_SHARDS][BUFFER_SIZE];
+    int stream_fds[MAX_SHARDS];
+
+    // Every fan-out gets answers through fifos of its own, others may be fanning out at the same time
+    char reply_names[MAX_SHARDS][BUFFER_SIZE];
+
+    // A streamed pid list is the last argument, it's read once and copied to every shard
+    char *stream = strchr(request, PID_STREAM_PREFIX);
+    if (stream != NULL && stream[-1] != ' ') {
+        stream = NULL;
+    }
+
+    for (int k = 0; k < num_shards; k++) {
+        int num_written;
+
+        snprintf(reply_names[k], BUFFER_SIZE, SHARD_REPLY_NAME, getpid(), k);
+        unlink(reply_names[k]);
+        if (mkfifo(reply_names[k], 0666) == -1) {
+            perror("mkfifo");
+            _exit(1);
+        }
+
+        if (stream != NULL) {
+            snprintf(stream_names[k], BUFFER_SIZE, SHARD_PID_STREAM_NAME, getpid(), k);
+            unlink(stream_names[k]);
+            if (mkfifo(stream_names[k], 0666) == -1) {
+                perror("mkfifo");
+                _exit(1);
+            }
+            num_written = snprintf(line, PIPE_BUF, REPLY_PREFIX "%s %.*s%c%s\n", reply_names[k], (int) (stream - request), request, PID_STREAM_PREFIX, stream_names[k]);
+        } else {
+            num_written = snprintf(line, PIPE_BUF, REPLY_PREFIX "%s %s%s\n", reply_names[k], latency ? "stats-histogram " : perf ? "perf-sums " : "", top ? "commands" : request);
+        }
+
+        if (num_written < 0 || num_written >= PIPE_BUF) {
+            perror("Error formatting message");
+            _exit(1);
+        }
+        if (write(shard_fds[k], line, num_written) != num_written) {
+            perror("Error writing to shard pipe");
+            _exit(1);
+        }
+    }
+
+    if (stream != NULL) {
+        int fd = open(stream + 1, O_RDONLY);
+        if (fd == -1) {
+            perror("Error opening pid stream");
+            _exit(1);
+        }
+
+        for (int k = 0; k < num_shards; k++) {
+            stream_fds[k] = open(stream_names[k], O_WRONLY);
+            if (stream_fds[k] == -1) {
+                perror("Error opening shard pid stream");
+                _exit(1);
+            }
+        }
+
+        ssize_t bytes_read;
+        while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
+            for (int k = 0; k < num_shards; k++) {
+                write_all(stream_fds[k], buffer, bytes_read);
+            }
+        }
+
+        close(fd);
+        for (int k = 0; k < num_shards; k++) {
+            close(stream_fds[k]);
+            unlink(stream_names[k]);
+        }
+    }
+
+    int client_fd = open(client_pipe_name, O_WRONLY);
+    if (client_fd == -1) {
+        perror("Error opening client pipe");
+        _exit(1);
+    }
+
+    long total_time = 0;
+    long count = 0;
+    char program_name[BUFFER_SIZE] = "";
+
+    // The shards sample apart, their variances add up so their bounds add up squared
+    long sampled = 0;
+    double square_bound = 0;
+
+    int size = BUFFER_SIZE;
+    int num_names = 0;
+    char **seen = calloc(size, sizeof(char *));
+
+    struct Slot *rows = NULL;
+    int num_rows = 0;
+    int max_rows = 0;
+
+    // Lines of the shards that are passed on as they are
+    struct Reply reply;
+    reply_open(&reply, client_fd, 0);
+
+    for (int k = 0; k < num_shards; k++) {
+        struct Reader shard;
+        reader_init(&shard, open(reply_names[k], O_RDONLY));
+        if (shard.fd == -1) {
+            perror("Error opening shard reply pipe");
+            _exit(1);
+        }
+        unlink(reply_names[k]);
+
+        ssize_t length;
+
+        while ((length = readln(&shard)) >= 0) {
+            char *answer = shard.line;
+            long value;
+
+            if (latency && strncmp(answer, "histogram ", 10) == 0) {
+                merge_histogram(answer + 10, &merged);
+            } else if (top && strncmp(answer, "command ", 8) == 0) {
+                // "command name count..." of every command of the shard
+                char *name = answer + 8;
+                char *histogram = strchr(name, ' ');
+                if (histogram != NULL) {
+                    *histogram = '\0';
+                    merge_histogram(histogram + 1, intern_command(name, 1));
+                }
+            } else if (perf && strncmp(answer, "perf ", 5) == 0) {
+                merge_perf(answer + 5, &merged);
+            } else if (latency || top || perf) {
+                continue;
+            } else if (strncmp(request, "stats-trend", 11) == 0) {
+                struct Slot row = {0};
+
+                if (sscanf(answer, "%ld %u %u %ld", &row.period, &row.started, &row.completed, &row.total_time) != 4) {
+                    continue;
+                }
+
+                // Shards answer with the same periods, add the rows up
+                int r = num_rows - 1;
+                while (r >= 0 && rows[r].period != row.period) {
+                    r--;
+                }
+                if (r >= 0) {
+                    rows[r].started += row.started;
+                    rows[r].completed += row.completed;
+                    rows[r].total_time += row.total_time;
+                } else {
+                    if (num_rows == max_rows) {
+                        max_rows = max_rows == 0 ? 64 : max_rows * 2;
+                        rows = realloc(rows, max_rows * sizeof(struct Slot));
+                    }
+                    rows[num_rows++] = row;
+                }
+            } else if (strncmp(request, "stats-time", 10) == 0 && sscanf(answer, "Total execution time is %ld ms", &value) == 1) {
+                total_time += value;
+                merge_bound(answer, &sampled, &square_bound);
+            } else if (strncmp(request, "stats-command", 13) == 0 && sscanf(answer, "%1023s was executed %ld times", program_name, &value) == 2) {
+                count += value;
+                merge_bound(answer, &sampled, &square_bound);
+            } else if (strncmp(request, "stats-uniq", 10) == 0) {
+                if (num_names * 2 >= size) {
+                    // Grow the set of names, adding them again
+                    char **old = seen;
+                    seen = calloc(size * 2, sizeof(char *));
+                    for (int j = 0; j < size; j++) {
+                        if (old[j] != NULL) {
+                            name_set_add(seen, size * 2, old[j]);
+                        }
+                    }
+                    size *= 2;
+                    free(old);
+                }
+                char *name = strdup(answer);
+                if (name_set_add(seen, size, name)) {
+                    num_names++;
+                    answer[length] = '\n';
+                    reply_bytes(&reply, answer, length + 1);
+                } else {
+                    free(name);
+                }
+            } else {
+                answer[length] = '\n';
+                reply_bytes(&reply, answer, length + 1);
+            }
+        }
+
+        free(shard.line);
+        close(shard.fd);
+    }
+
+    reply_close(&reply);
+
+    int num_written = 0;
+    if (latency) {
+        write_latency(client_fd, &merged, merged.name);
+    } else if (perf) {
+        write_perf(client_fd, &merged, merged.name);
+    } else if (top) {
+        int n;
+        enum TopMetric metric;
+        parse_top(request, &n, &metric);
+        write_top(client_fd, n, metric, 0);
+    } else if (num_rows > 0) {
+        qsort(rows, num_rows, sizeof(struct Slot), compare_periods);
+        for (int r = 0; r < num_rows; r++) {
+            num_written = snprintf(buffer, BUFFER_SIZE, "%ld %u %u %ld\n", rows[r].period, rows[r].started, rows[r].completed, rows[r].total_time);
+            write_all(client_fd, buffer, num_written);
+        }
+        num_written = 0;
+    } else if (strncmp(request, "stats-time", 10) == 0 && sampled > 0) {
+        num_written = snprintf(buffer, BUFFER_SIZE, "Total execution time is %ld ms (estimated from %ld sampled runs, +/- %.0f ms at 95%%)\n",
+            total_time, sampled, sqrt(square_bound));
+    } else if (strncmp(request, "stats-time", 10) == 0) {
+        num_written = snprintf(buffer, BUFFER_SIZE, "Total execution time is %ld ms\n", total_time);
+    } else if (strncmp(request, "stats-command", 13) == 0 && sampled > 0) {
+        num_written = snprintf(buffer, BUFFER_SIZE, "%s was executed %ld times (estimated from %ld sampled runs, +/- %.0f at 95%%)\n",
+            program_name, count, sampled, sqrt(square_bound));
+    } else if (strncmp(request, "stats-command", 13) == 0) {
+        num_written = snprintf(buffer, BUFFER_SIZE, "%s was executed %ld times\n", program_name, count);
+    }
+
+    if (num_written < 0 || num_written >= BUFFER_SIZE) {
+        perror("Error formatting message");
+        _exit(1);
+    }
+    if (num_written > 0 && write(client_fd, buffer, num_written) != num_written) {
+        perror("Error writing to client pipe");
+        _exit(1);
+    }
+
+    // Jobs are queued by the coordinator, the shards only know the ones that run
+    if (strncmp(request, "status", 6) == 0) {
+        write_jobs(client_fd);
+    }
+
+    close(client_fd);
+}
+
+/**
+ * This function processes the request that as been given by the client.
+ * Start and end requests are applied by the monitor itself so the information
+ * array keeps them, every other request runs in a child with a copy of it
+ * @param[in] request
+ */
+void process_request (char *request){
+
+    if(strncmp (request, "start", 5) == 0) {
+        int pid;
+
+        char program[BUFFER_SIZE];
+
+        long start_time;
+
+        // The tracer adds " timeout ms" when the run has one
+        long timeout = 0;
+        char *last = strrchr(request, ' ');
+        for (char *word = strstr(request, " timeout "); word != NULL; word = strstr(word + 1, " timeout ")) {
+            int length = 0;
+            if (sscanf(word, " timeout %ld%n", &timeout, &length) == 1 && word[length] == '\0') {
+                *word = '\0';
+                last = strrchr(request, ' ');
+                break;
+            }
+            timeout = 0;
+        }
+
+        // Then " sample rate" when the run was picked out of rate runs of a sampled command
+        long weight = 1;
+        for (char *word = strstr(request, " sample "); word != NULL; word = strstr(word + 1, " sample ")) {
+            int length = 0;
+            if (sscanf(word, " sample %ld%n", &weight, &length) == 1 && word[length] == '\0' && weight >= 1) {
+                *word = '\0';
+                last = strrchr(request, ' ');
+                break;
+            }
+            weight = 1;
+        }
+
+        // And " cpus mask" before that when it pinned the run, a bit for each core
+        unsigned long cpus = 0;
+        for (char *word = strstr(request, " cpus "); word != NULL; word = strstr(word + 1, " cpus ")) {
+            int length = 0;
+            if (sscanf(word, " cpus %lx%n", &cpus, &length) == 1 && word[length] == '\0') {
+                *word = '\0';
+                last = strrchr(request, ' ');
+                break;
+            }
+            cpus = 0;
+        }
+
+        // And " pipeline" right after the time when its stages are in the process group named after the pid
+        int pipeline = last != NULL && strcmp(last, " pipeline") == 0;
+        if (pipeline) {
+            *last = '\0';
+            last = strrchr(request, ' ');
+        }
+
+        // A pipeline sends all of it as the program, the name is its first word and the time the last one
+        if (sscanf(request, "start %d %1023s", &pid, program) != 2 || last == NULL || sscanf(last, " %ld", &start_time) != 1) {
+            // Debug: malformed request
+            count_metric(&metrics->parse_failures, 1);
+            return;
+        }
+        count_metric(&metrics->events_ingested, 1);
+        if (flight != NULL) {
+            flight->pid = pid;
+        }
+        stamp(PHASE_PARSE);
+
+        // Save start information to file
+        if (save_run(pid, program, start_time) == -1) {
+            return;
+        }
+        stamp(PHASE_PERSIST);
+
+        struct Info *info = create_info(pid, program, start_time, 1);
+
+        if (info != NULL) {
+            record_activity(info->command, start_time, 1, 0, 0);
+            info->weight = weight;
+            count_sampling(info->command, weight);
+            watch_info(info);
+            info->cpus = cpus;
+            info->pipeline = pipeline;
+            place_run(info);
+            if (timeout > 0) {
+                // Counted from the start the tracer saw, not from when the request got here
+                add_timer(&info->deadline, start_time + timeout - now_ms());
+            }
+            publish(info);
+        }
+        stamp(PHASE_APPLY);
+
+    } else if (strncmp (request, "end", 3) == 0) {
+
+        int pid;
+
+        long end_time;
+
+        // The tracer adds " output out_bytes err_bytes dropped_bytes" last when it captured the output
+        long output_bytes[3];
+        int has_output = 0;
+        char *output = strstr(request, " output ");
+        if (output != NULL) {
+            has_output = sscanf(output, " output %ld %ld %ld", &output_bytes[0], &output_bytes[1], &output_bytes[2]) == 3;
+            *output = '\0';
+        }
+
+        // And " perf task_clock_ns context_switches page_faults cpu_migrations cycles instructions" after that with --perf
+        long perf_counts[PERF_COUNTERS];
+        int has_perf = 0;
+        char *perf = strstr(request, " perf ");
+        if (perf != NULL) {
+            has_perf = sscanf(perf, " perf %ld %ld %ld %ld %ld %ld", &perf_counts[0], &perf_counts[1], &perf_counts[2], &perf_counts[3], &perf_counts[4], &perf_counts[5]) == PERF_COUNTERS;
+            *perf = '\0';
+        }
+
+        // The tracer adds " tree cpu_us peak_kb read_bytes write_bytes" when it accounted for the whole process tree
+        long tree_usage[4];
+        int num_fields = sscanf(request, "end %d %ld tree %ld %ld %ld %ld", &pid, &end_time, &tree_usage[0], &tree_usage[1], &tree_usage[2], &tree_usage[3]);
+
+        if (num_fields != 2 && num_fields != 6) {
+            // Debug: malformed request
+            count_metric(&metrics->parse_failures, 1);
+            return;
+        }
+        count_metric(&metrics->events_ingested, 1);
+        if (flight != NULL) {
+            flight->pid = pid;
+        }
+        stamp(PHASE_PARSE);
+
+        // The start time and name come from the running entry, an end without one is late or stray and the file already holds the run
+        struct Info *info = find_running(pid, 0);
+
+        if (info == NULL) {
+            // Debug: the run isn't running
+            count_metric(&metrics->ends_dropped, 1);
+            if (has_output) {
+                queue_output(pid);
+            }
+            return;
+        }
+
+        long elapsed_time = end_time - info->time;
+
+        // Save end information to file
+        if (save_run(pid, info->name, elapsed_time) == -1) {
+            return;
+        }
+        stamp(PHASE_PERSIST);
+
+        update_info(pid, elapsed_time, 0);
+
+        if (num_fields == 6) {
+            info->tree = 1;
+            info->tree_cpu_us = tree_usage[0];
+            info->tree_peak_kb = tree_usage[1];
+            info->tree_read_bytes = tree_usage[2];
+            info->tree_write_bytes = tree_usage[3];
+        }
+        if (has_perf) {
+            info->perf = 1;
+            memcpy(info->perf_counts, perf_counts, sizeof(perf_counts));
+            record_perf(info->command, perf_counts);
+        }
+        if (has_output) {
+            info->output = 1;
+            info->output_bytes[0] = output_bytes[0];
+            info->output_bytes[1] = output_bytes[1];
+            info->output_dropped = output_bytes[2];
+        }
+        publish(info);
+        if (has_output) {
+            queue_output(pid);
+        }
+        stamp(PHASE_APPLY);
+
+    } else if (strncmp (request, "status", 6) == 0) {
+    
+        // Open the server pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        // One clock read for the whole answer, the running list has every running entry
+        long time_now = now_ms();
+
+        struct Reply reply;
+        reply_open(&reply, client_fd, 0);
+
+        for (struct Info *info = oldest_running; info != NULL; info = info->next_indexed) {
+            reply_long(&reply, info->pid);
+            reply_string(&reply, " ");
+            reply_string(&reply, info->name);
+            reply_string(&reply, " ");
+            reply_long(&reply, time_now - info->time);
+
+            // Resource usage once the sampler got to the process, the CPU after its second sample
+            if (info->cpu_permille >= 0) {
+                reply_string(&reply, " cpu ");
+                reply_long(&reply, info->cpu_permille / 10);
+                reply_string(&reply, ".");
+                reply_long(&reply, info->cpu_permille % 10);
+                reply_string(&reply, "%");
+            }
+            if (info->sampled_at != 0) {
+                reply_string(&reply, " rss ");
+                reply_long(&reply, info->rss_kb);
+                reply_string(&reply, " kB threads ");
+                reply_long(&reply, info->threads);
+                reply_string(&reply, "\n");
+            } else {
+                reply_string(&reply, " \n");
+            }
+        }
+
+        reply_close(&reply);
+
+        write_jobs(client_fd);
+
+        close(client_fd);
+
+    } else if (strncmp (request, "query", 5) == 0) {
+
+        // Open the client pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        run_filter_query(client_fd, request);
+
+        close(client_fd);
+
+    } else if (strncmp (request, "stats-time", 10) == 0) {
+        
+        // Parse the list of PIDs from the request
+        char *token = strtok(request, " ");
+        token = strtok(NULL, " ");
+
+        struct PidSet pids;
+        pidset_parse(&pids, token);
+        stamp(PHASE_PARSE);
+
+        // Open the client pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        // One pass over the table, checking each entry against the pid bitmap
+        struct Query query = { .pids = &pids };
+        run_query(&query);
+        stamp(PHASE_APPLY);
+
+        long total_time = query.total_time;
+
+        free(pids.bits);
+
+        // Write the total time to the client pipe, with how far off it may be when some runs weren't traced
+        char buffer[BUFFER_SIZE];
+        int num_written = query.sampled == 0 ? snprintf(buffer, BUFFER_SIZE, "Total execution time is %ld ms\n", total_time)
+            : snprintf(buffer, BUFFER_SIZE, "Total execution time is %ld ms (estimated from %ld sampled runs, +/- %.0f ms at 95%%)\n",
+                total_time, query.sampled, 1.96 * sqrt(query.time_variance));
+        if (num_written < 0 || num_written >= BUFFER_SIZE) {
+            perror("Error formatting message");
+            _exit(1);
+        }
+        write_answer(client_fd, buffer, num_written);
+
+        finish_answer();
+        close(client_fd);
+    } else if (strncmp(request, "stats-command", 13) == 0) {
+        
+        // Parse the program name and list of PIDs from the request
+        char *token = strtok(request, " ");
+        token = strtok(NULL, " ");
+        char *program_name = token;
+        token = strtok(NULL, " ");
+
+        struct PidSet pids;
+        pidset_parse(&pids, token);
+        stamp(PHASE_PARSE);
+
+        // Open the client pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        struct Query query = { .pids = &pids, .program_name = program_name, .command = intern_command(program_name, 0) };
+        run_query(&query);
+        stamp(PHASE_APPLY);
+
+        long count = query.count;
+
+        free(pids.bits);
+
+        // Write the count to the client pipe, with how far off it may be when some runs weren't traced
+        char buffer[BUFFER_SIZE];
+        int num_written = query.sampled == 0 ? snprintf(buffer, BUFFER_SIZE, "%s was executed %ld times\n", program_name, count)
+            : snprintf(buffer, BUFFER_SIZE, "%s was executed %ld times (estimated from %ld sampled runs, +/- %.0f at 95%%)\n",
+                program_name, count, query.sampled, 1.96 * sqrt(query.count_variance));
+        if (num_written < 0 || num_written >= BUFFER_SIZE) {
+            perror("Error formatting message");
+            _exit(1);
+        }
+        write_answer(client_fd, buffer, num_written);
+
+        finish_answer();
+        close(client_fd);
+    }else if (strncmp(request, "stats-uniq", 10) == 0) {
+        // Parse the list of PIDs from the request
+        char *token = strtok(request, " ");
+        token = strtok(NULL, " ");
+
+        struct PidSet pids;
+        pidset_parse(&pids, token);
+        stamp(PHASE_PARSE);
+
+        // Open the client pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        struct Query query = { .pids = &pids, .uniq = 1 };
+        run_query(&query);
+        stamp(PHASE_APPLY);
+
+        struct Reply reply;
+        reply_open(&reply, client_fd, 1);
+
+        for (int i = 0; i < query.num_names; i++) {
+            reply_string(&reply, query.names[i]);
+            reply_string(&reply, "\n");
+        }
+
+        reply_close(&reply);
+
+        free(query.names);
+        free(pids.bits);
+
+        finish_answer();
+        close(client_fd);
+
+    } else if (strncmp(request, "stats-top", 9) == 0 || strncmp(request, "commands", 8) == 0) {
+
+        // Open the client pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        if (strncmp(request, "commands", 8) == 0) {
+            for (int c = 0; c < num_commands; c++) {
+                char label[BUFFER_SIZE];
+                snprintf(label, BUFFER_SIZE, "command %s", command_list[c]->name);
+                write_histogram(client_fd, command_list[c], label);
+            }
+        } else {
+            int n;
+            enum TopMetric metric;
+            parse_top(request, &n, &metric);
+            write_top(client_fd, n, metric, 1);
+        }
+
+        close(client_fd);
+
+    } else if (strncmp(request, "stats-trend", 11) == 0) {
+
+        // Parse "stats-trend second|minute|hour [periods] [command]"
+        char tier_name[BUFFER_SIZE] = "second";
+        char program_name[BUFFER_SIZE] = "";
+        long num_periods = DEFAULT_TREND_PERIODS;
+
+        sscanf(request, "stats-trend %1023s %ld %1023s", tier_name, &num_periods, program_name);
+
+        struct Tier *tier = &tiers[0];
+        for (int t = 0; t < ROLLUP_TIERS; t++) {
+            if (strcmp(tiers[t].name, tier_name) == 0) {
+                tier = &tiers[t];
+            }
+        }
+
+        struct Rollup *rollup = &global_rollup;
+        if (program_name[0] != '\0') {
+            struct Command *command = intern_command(program_name, 0);
+            rollup = command != NULL ? command->rollup : NULL;
+        }
+
+        // Open the client pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        write_trend(client_fd, rollup, tier, num_periods, now_ms());
+
+        close(client_fd);
+
+    } else if (strncmp(request, "stats-latency", 13) == 0 || strncmp(request, "stats-histogram", 15) == 0) {
+
+        // Parse the program name from the request
+        char *token = strtok(request, " ");
+        char *program_name = strtok(NULL, " ");
+
+        if (program_name == NULL) {
+            // Debug: request failed
+            answer_malformed(token);
+            return;
+        }
+
+        // Open the client pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        struct Command *command = intern_command(program_name, 0);
+
+        if (strcmp(token, "stats-histogram") == 0) {
+            write_histogram(client_fd, command, "histogram");
+        } else {
+            write_latency(client_fd, command, program_name);
+        }
+
+        close(client_fd);
+
+    } else if (strncmp(request, "stats-perf", 10) == 0 || strncmp(request, "perf-sums", 9) == 0) {
+
+        // Parse the program name from the request
+        char *token = strtok(request, " ");
+        char *program_name = strtok(NULL, " ");
+
+        if (program_name == NULL) {
+            // Debug: request failed
+            answer_malformed(token);
+            return;
+        }
+
+        // Open the client pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        struct Command *command = intern_command(program_name, 0);
+
+        if (strcmp(token, "perf-sums") == 0) {
+            write_perf_sums(client_fd, command);
+        } else {
+            write_perf(client_fd, command, program_name);
+        }
+
+        close(client_fd);
+
+    } else if (strncmp(request, "flight", 6) == 0) {
+
+        // Open the client pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        write_flight(client_fd);
+
+        close(client_fd);
+
+    } else if (strncmp(request, "stats-cores", 11) == 0) {
+
+        // Open the client pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        write_cores(client_fd);
+
+        close(client_fd);
+
+    } else if (strncmp(request, "output", 6) == 0) {
+
+        int pid;
+        char stream[BUFFER_SIZE] = "stdout";
+
+        if (sscanf(request, "output %d %1023s", &pid, stream) < 1 || (strcmp(stream, "stdout") != 0 && strcmp(stream, "stderr") != 0)) {
+            // Debug: malformed request
+            answer_malformed("output");
+            _exit(1);
+        }
+
+        // Open the client pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        write_output(client_fd, pid, strcmp(stream, "stdout") == 0 ? 0 : 1);
+
+        close(client_fd);
+
+    } else if (strncmp(request, "metrics", 7) == 0) {
+
+        // Open the client pipe for writing
+        int client_fd = open(client_pipe_name, O_WRONLY);
+        if (client_fd == -1) {
+            perror("Error opening client pipe");
+            _exit(1);
+        }
+
+        write_metrics(client_fd);
+
+        close(client_fd);
+
+    } else {
+        // Debug: request failed
+        count_metric(&metrics->parse_failures, 1);
+        perror("request");
+        _exit(1);
+    }
+}
+
+/**
+ * This function closes the runs whose process exited ORPHAN_GRACE
+ * milliseconds ago without an end, as if the end came when it exited
+ * @param[out] timeout Milliseconds until the next one is due, -1 if there are none
+ */
+int tick_orphans() {
+    long time_now = now_ms();
+
+    while (exited != NULL && exited->exited_at + ORPHAN_GRACE <= time_now) {
+        struct Info *info = exited;
+        long elapsed_time = info->exited_at - info->time;
+
+        save_run(info->pid, info->name, elapsed_time);
+
+        command_record(info->command, elapsed_time, 1);
+        record_activity(info->command, info->exited_at, 0, 1, elapsed_time);
+        finish_info(info, elapsed_time);
+        info->orphaned = 1;
+        publish(info);
+    }
+
+    return exited != NULL ? exited->exited_at + ORPHAN_GRACE - time_now : -1;
+}
+
+/**
+ * This function tells if the answer of a request can be kept: stats-time,
+ * stats-command and stats-uniq with the pids in the request itself
+ * @param[in] request
+ * @param[out] 1 if true 0 if false
+ */
+int is_cacheable(char *request) {
+    if (strncmp(request, "stats-time ", 11) != 0 && strncmp(request, "stats-command ", 14) != 0 && strncmp(request, "stats-uniq ", 11) != 0) {
+        return 0;
+    }
+    return strchr(request, PID_STREAM_PREFIX) == NULL;
+}
+
+/**
+ * This function compares two pid ranges by their first pid, for qsort
+ * @param[in] a
+ * @param[in] b
+ */
+int compare_ranges(const void *a, const void *b) {
+    long first = ((struct PidRange *) a)->first;
+    long second = ((struct PidRange *) b)->first;
+
+    return (first > second) - (first < second);
+}
+
+/**
+ * This function reads the pid and pid range arguments of a stats request
+ * into ranges sorted by their first pid, the ones that overlap merged
+ * @param[in] request
+ * @param[out] ranges Room for a range every two characters of the request
+ * @param[out] num_ranges
+ */
+int request_ranges(char *request, struct PidRange *ranges) {
+    // The pids come after the name of the request, and the program for stats-command
+    int skip = strncmp(request, "stats-command ", 14) == 0 ? 2 : 1;
+    char *token = request;
+    int num_ranges = 0;
+
+    while (*token != '\0') {
+        while (*token == ' ') {
+            token++;
+        }
+        if (skip > 0) {
+            skip--;
+            token += strcspn(token, " ");
+            continue;
+        }
+
+        char *end;
+        long first = strtol(token, &end, 10);
+        long last = first;
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 10);
+        }
+        if (end != token && (*end == ' ' || *end == '\0') && first <= last) {
+            ranges[num_ranges].first = first;
+            ranges[num_ranges].last = last;
+            num_ranges++;
+        }
+        token += strcspn(token, " ");
+    }
+
+    qsort(ranges, num_ranges, sizeof(struct PidRange), compare_ranges);
+
+    int merged = 0;
+    for (int r = 0; r < num_ranges; r++) {
+        if (merged > 0 && ranges[r].first <= ranges[merged - 1].last) {
+            if (ranges[r].last > ranges[merged - 1].last) {
+                ranges[merged - 1].last = ranges[r].last;
+            }
+        } else {
+            ranges[merged++] = ranges[r];
+        }
+    }
+
+    return merged;
+}
+
+/**
+ * This function tells if sorted ranges that don't overlap have a pid
+ * @param[in] ranges
+ * @param[in] num_ranges
+ * @param[in] pid
+ * @param[out] 1 if true 0 if false
+ */
+int ranges_have(struct PidRange *ranges, int num_ranges, int pid) {
+    // The last range starting at or before the pid is the only one that can have it
+    int low = 0;
+    int high = num_ranges;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (ranges[middle].first <= pid) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low > 0 && pid <= ranges[low - 1].last;
+}
+
+/**
+ * This function finds the kept answer of a request, checking that none of its
+ * pids changed since it was computed. The request is read into ranges once
+ * for all the generations it's checked against
+ * @param[in] request
+ * @param[out] answer NULL if there's none or it's stale
+ */
+struct Answer *find_answer(char *request) {
+    struct Answer *answer = &answers[hash_name(request) % CACHE_SIZE];
+
+    if (answer->request == NULL || strcmp(answer->request, request) != 0) {
+        return NULL;
+    }
+
+    // Older than the pids remembered, there's no telling what changed
+    if (generation - answer->generation >= CHANGE_LOG) {
+        return NULL;
+    }
+
+    if (answer->generation == generation) {
+        return answer;
+    }
+
+    struct PidRange *ranges = malloc((strlen(request) / 2 + 1) * sizeof(struct PidRange));
+    if (ranges == NULL) {
+        perror("malloc");
+        _exit(1);
+    }
+    int num_ranges = request_ranges(request, ranges);
+
+    for (long g = answer->generation + 1; g <= generation; g++) {
+        if (ranges_have(ranges, num_ranges, changed_pids[g % CHANGE_LOG])) {
+            answer = NULL;
+            break;
+        }
+    }
+
+    free(ranges);
+    return answer;
+}
+
+/**
+ * This function reads what a child wrote to the client pipe and keeps it when
+ * the child is done. The child ends the answer with a null byte, so one that
+ * died halfway isn't kept
+ * @param[in] channel
+ */
+void read_answer(struct Channel *channel) {
+    ssize_t bytes_read;
+
+    while (channel->out_len == 0 || channel->out[channel->out_len - 1] != '\0') {
+        if (channel->out_len == channel->out_size) {
+            if (channel->out_size > CACHE_MAX_ANSWER) {
+                // Too big to keep, read it to let the child go on
+                channel->out_len = 1;
+            } else {
+                channel->out_size *= 2;
+                channel->out = realloc(channel->out, channel->out_size);
+            }
+        }
+
+        bytes_read = read(channel->reader.fd, channel->out + channel->out_len, channel->out_size - channel->out_len);
+        if (bytes_read <= 0) {
+            break;
+        }
+        channel->out_len += bytes_read;
+    }
+
+    int complete = channel->out_len > 0 && channel->out[channel->out_len - 1] == '\0';
+    if (!complete && bytes_read == -1 && errno == EAGAIN) {
+        return;
+    }
+
+    int slot = hash_name(channel->request) % CACHE_SIZE;
+    pending_answers[slot] = NULL;
+
+    if (complete && channel->out_size <= CACHE_MAX_ANSWER) {
+        struct Answer *answer = &answers[slot];
+
+        // Don't replace an answer computed from a newer generation
+        if (answer->request == NULL || strcmp(answer->request, channel->request) != 0 || answer->generation < channel->generation) {
+            free(answer->request);
+            free(answer->answer);
+            answer->request = channel->request;
+            answer->answer = channel->out;
+            answer->answer_len = channel->out_len - 1;
+            answer->generation = channel->generation;
+            channel->request = NULL;
+            channel->out = NULL;
+        }
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, channel->reader.fd, NULL);
+    close(channel->reader.fd);
+    free(channel->request);
+    free(channel->out);
+    free(channel);
+}
+
+/**
+ * This function waits on the pipe a child copies its answer to
+ * @param[in] fd Read end of the pipe
+ * @param[in] request
+ */
+void add_answer(int fd, char *request) {
+    struct Channel *channel = calloc(1, sizeof(struct Channel));
+    channel->kind = CHANNEL_ANSWER;
+    channel->reader.fd = fd;
+    channel->request = strdup(request);
+    channel->generation = generation;
+    channel->out_size = BUFFER_SIZE;
+    channel->out = malloc(channel->out_size);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    pending_answers[hash_name(request) % CACHE_SIZE] = channel;
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = channel };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * This function applies a start or end request, or hands it to the shard that
+ * owns the pid when this is the coordinator of a sharded monitor
+ * @param[in] line With room for a newline after bytes_read
+ * @param[in] bytes_read
+ * @param[in] type
+ * @param[in] received Time it was read, in microseconds
+ */
+void ingest_line(char *line, ssize_t bytes_read, enum RequestType type, long received) {
+    begin_flight(type, received);
+
+    if (num_shards > 1) {
+        // Hand it to the shard that owns the pid
+        char *pid = strchr(line, ' ');
+        int shard = pid != NULL ? atoi(pid) % num_shards : 0;
+        line[bytes_read] = '\n';
+        write_all(shard_fds[shard], line, bytes_read + 1);
+    } else {
+        process_request(line);
+        enforce_retention();
+    }
+    record_latency(type, received);
+    flight = NULL;
+}
+
+/**
+ * This function queues a job given the request "submit priority u program [args...]"
+ * or "submit priority p pipeline"
+ * @param[in] line
+ */
+void submit_job(char *line) {
+    int priority;
+    char mode;
+    int offset = 0;
+
+    if (sscanf(line, "submit %d %c %n", &priority, &mode, &offset) != 2 || offset == 0 || line[offset] == '\0' || (mode != 'u' && mode != 'p')) {
+        // Debug: malformed request
+        count_metric(&metrics->parse_failures, 1);
+        return;
+    }
+
+    struct Job *job = calloc(1, sizeof(struct Job));
+    job->id = next_job_id++;
+    job->priority = priority;
+    job->submitted = now_ms();
+    job->pipeline = mode == 'p';
+    job->line = strdup(line + offset);
+
+    char name[BUFFER_SIZE];
+    sscanf(job->line, "%1023s", name);
+    job->command = intern_command(name, 1);
+
+    queue_job(job);
+}
+
+/**
+ * This function runs a job, its start and end are tracked like those a tracer sends
+ * @param[in] job
+ */
+void launch_job(struct Job *job) {
+    int pid = fork();
+
+    if (pid == 0) {
+        // The job gets nothing of the monitor but its output
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, 0);
+        }
+        syscall(SYS_close_range, 3, ~0U, 0);
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGUSR1, SIG_DFL);
+
+        if (job->pipeline) {
+            execl("/bin/sh", "sh", "-c", job->line, (char *) NULL);
+        } else {
+            char *args[BUFFER_SIZE / 2];
+            int num_args = 0;
+            for (char *arg = strtok(job->line, " "); arg != NULL && num_args < BUFFER_SIZE / 2 - 1; arg = strtok(NULL, " ")) {
+                args[num_args++] = arg;
+            }
+            args[num_args] = NULL;
+            execvp(args[0], args);
+        }
+
+        // Debug: exec failed
+        perror("exec");
+        _exit(127);
+
+    } else if (pid < 0) {
+        // Debug: fork failed, the job waits for the next one to end
+        perror("fork");
+        queue_job(job);
+        return;
+    }
+
+    job->pid = pid;
+    job->next_running = running_jobs;
+    running_jobs = job;
+    num_running_jobs++;
+    job->command->running_jobs++;
+
+    char line[BUFFER_SIZE];
+    int num_written = snprintf(line, BUFFER_SIZE - 1, "start %d %s %ld", pid, job->command->name, now_ms());
+    ingest_line(line, num_written, REQUEST_START, now_us());
+}
+
+/**
+ * This function runs queued jobs while fewer than max_jobs run, highest
+ * priority first, skipping those whose command already runs max_command_jobs
+ */
+void dispatch_jobs() {
+    struct Job *skipped[BUFFER_SIZE];
+    int num_skipped = 0;
+
+    while (num_running_jobs < max_jobs && num_skipped < BUFFER_SIZE) {
+        struct Job *job = unqueue_job();
+        if (job == NULL) {
+            break;
+        }
+
+        if (max_command_jobs > 0 && job->command->running_jobs >= max_command_jobs) {
+            skipped[num_skipped++] = job;
+        } else {
+            launch_job(job);
+        }
+    }
+
+    // Skipped jobs keep their place, the key doesn't change
+    for (int j = 0; j < num_skipped; j++) {
+        queue_job(skipped[j]);
+    }
+}
+
+/**
+ * This function ends the job a process was running, if it was running one
+ * @param[in] pid
+ * @param[out] job 1 if the process was running a job
+ */
+int finish_job(int pid) {
+    struct Job **previous = &running_jobs;
+
+    while (*previous != NULL && (*previous)->pid != pid) {
+        previous = &(*previous)->next_running;
+    }
+
+    struct Job *job = *previous;
+    if (job == NULL) {
+        return 0;
+    }
+
+    *previous = job->next_running;
+    num_running_jobs--;
+    job->command->running_jobs--;
+
+    char line[BUFFER_SIZE];
+    int num_written = snprintf(line, BUFFER_SIZE - 1, "end %d %ld", pid, now_ms());
+    ingest_line(line, num_written, REQUEST_END, now_us());
+
+    free(job->line);
+    free(job);
+    return 1;
+}
+
+/**
+ * This function does nothing, the signal is caught so epoll_wait returns when a job ends
+ * @param[in] signum
+ */
+void job_exited(int signum) {
+    (void) signum;
+}
+
+/**
+ * This function splits a query fanned out by the coordinator, "reply fifo
+ * query", in the fifo its answer goes to and the query itself
+ * @param[in] line
+ * @param[out] reply_name Fifo of the answer, left as it is if there's none, may be NULL
+ * @param[out] query The query, the line itself if it names no fifo
+ */
+char *split_reply(char *line, char *reply_name) {
+    int prefix = strlen(REPLY_PREFIX);
+    if (strncmp(line, REPLY_PREFIX, prefix) != 0) {
+        return line;
+    }
+
+    char *query = strchr(line + prefix, ' ');
+    if (query == NULL || query - line - prefix >= BUFFER_SIZE) {
+        return line;
+    }
+
+    if (reply_name != NULL) {
+        memcpy(reply_name, line + prefix, query - line - prefix);
+        reply_name[query - line - prefix] = '\0';
+    }
+    return query + 1;
+}
+
+/**
+ * This function answers a query with a child, from a kept answer when there's one
+ * @param[in] line
+ * @param[in] type
+ * @param[in] received Time the query was read, in microseconds
+ * @param[out] 0 on success -1 if there was no child for it and it's still to be answered
+ */
+int answer_query(char *line, enum RequestType type, long received) {
+    begin_flight(type, received);
+    query_children++;
+
+    // A query fanned out by the coordinator is answered through the fifo it names
+    char reply_name[BUFFER_SIZE] = "";
+    line = split_reply(line, reply_name);
+
+    // Repeated stats requests are answered from what was kept, a miss is kept for next time
+    struct Answer *answer = NULL;
+    int answer_pipe[2] = {-1, -1};
+
+    if (num_shards == 1 && is_cacheable(line)) {
+        int slot = hash_name(line) % CACHE_SIZE;
+
+        // The answer of the same request may be waiting in its pipe
+        if (pending_answers[slot] != NULL) {
+            read_answer(pending_answers[slot]);
+        }
+
+        answer = find_answer(line);
+        count_metric(answer != NULL ? &metrics->answer_hits : &metrics->answer_misses, 1);
+        if (answer == NULL && pending_answers[slot] == NULL && pipe(answer_pipe) == -1) {
+            // Debug: pipe failed, answer it without keeping it
+            answer_pipe[0] = answer_pipe[1] = -1;
+        }
+    }
+
+    // Create new process to process request
+    int pid = fork();
+
+    if (pid == 0) {
+        // Child process
+        flight->process = getpid();
+        stamp(PHASE_FORK);
+
+        if (reply_name[0] != '\0') {
+            strcpy(client_pipe_name, reply_name);
+        }
+
+        if (answer != NULL) {
+            int client_fd = open(client_pipe_name, O_WRONLY);
+            if (client_fd == -1) {
+                perror("Error opening client pipe");
+                _exit(1);
+            }
+            write_all(client_fd, answer->answer, answer->answer_len);
+            close(client_fd);
+        } else if (num_shards > 1 && type != REQUEST_METRICS && type != REQUEST_FLIGHT && type != REQUEST_OUTPUT && type != REQUEST_STATS_CORES) {
+            fan_out_request(line);
+        } else {
+            if (answer_pipe[1] != -1) {
+                close(answer_pipe[0]);
+                answer_fd = answer_pipe[1];
+            }
+            process_request(line);
+            finish_answer();
+        }
+        stamp(PHASE_RESPOND);
+        count_metric(&metrics->queries_served, 1);
+        record_latency(type, received);
+        _exit(0);
+
+    } else if (pid < 0) {
+        // Debug: fork failed
+        perror("fork");
+        query_children--;
+        if (answer_pipe[1] != -1) {
+            close(answer_pipe[0]);
+            close(answer_pipe[1]);
+        }
+        flight = NULL;
+        return -1;
     }
-    
-    if (information[i] != NULL) {
-        // Update the Info struct
-        information[i]->time = new_time;
-        information[i]->running = new_running;
+
+    if (answer_pipe[1] != -1) {
+        close(answer_pipe[1]);
+        add_answer(answer_pipe[0], line);
     }
+
+    flight = NULL;
+    return 0;
 }
 
 /**
- * This is the readln function
- * @param[in] fd file from witch is the lines will be read
+ * This function answers a query busy, on the pipe it would be answered
+ * through. The client opens it right after sending the query, so it's opened
+ * without blocking and tried again for a few milliseconds, a client that's
+ * gone can't hold the monitor
  * @param[in] line
- * @param[in] size
- * @param[out] total_bytes_read
  */
-ssize_t readln(int fd, char *line, size_t size) {
-    char buffer[BUFFER_SIZE];
-    ssize_t total_bytes_read = 0;
-    int bytes_read = 0;
-    int i;
+void reject_query(char *line) {
+    count_metric(&metrics->queries_rejected, 1);
 
-    while (total_bytes_read < size - 1) {
-        bytes_read = read(fd, buffer, BUFFER_SIZE);
-        if (bytes_read <= 0) {
+    char reply_name[BUFFER_SIZE] = "";
+    split_reply(line, reply_name);
+
+    int client_fd = -1;
+    for (int attempt = 0; attempt < BUSY_OPEN_TRIES && client_fd == -1; attempt++) {
+        client_fd = open(reply_name[0] != '\0' ? reply_name : client_pipe_name, O_WRONLY | O_NONBLOCK);
+        if (client_fd == -1 && errno == ENXIO) {
+            usleep(1000);
+        } else if (client_fd == -1) {
             break;
         }
-        for (i = 0; i < bytes_read; i++) {
-            if (buffer[i] == '\n') {
-                line[total_bytes_read] = '\0';
-                return total_bytes_read;
-            } else {
-                line[total_bytes_read] = buffer[i];
-                total_bytes_read++;
-            }
-        }
     }
 
-    line[total_bytes_read] = '\0';
-    return total_bytes_read;
+    if (client_fd == -1) {
+        // Debug: nobody is reading the answer
+        perror("Error opening client pipe");
+        return;
+    }
+
+    write_all(client_fd, BUSY_ANSWER, strlen(BUSY_ANSWER));
+    close(client_fd);
 }
 
 /**
- * This function processes the request that as been given by the client
- * @param[in] request
+ * This function gives the waiting queries to children, oldest first, while
+ * fewer than MAX_QUERY_CHILDREN are answering. When a child can't be made the
+ * query stays first in line for the next check
  */
-void process_request (char *request){
+void dispatch_queries() {
+    while (num_pending_queries > 0 && query_children < MAX_QUERY_CHILDREN) {
+        struct PendingQuery *query = &pending_queries[first_query];
 
-    char buffer[BUFFER_SIZE];
-    int num_written;
+        if (answer_query(query->line, query->type, query->received) == -1) {
+            return;
+        }
+        free(query->line);
 
-    if(strncmp (request, "start", 5) == 0) {
-        int pid;
+        first_query = (first_query + 1) % MAX_PENDING_QUERIES;
+        num_pending_queries--;
+    }
+}
 
-        char program[BUFFER_SIZE];
+/**
+ * This function handles one request read from the server pipe. Start, end,
+ * submit, place and watch requests are applied right away, queries wait until the pipe has
+ * been read so they never delay them, and are answered busy when there's no
+ * room for them or reading start and end requests is already lagging behind.
+ * Queries that stream their pids are never answered busy, the tracer would
+ * be left waiting to write them
+ * @param[in] line
+ * @param[in] bytes_read
+ */
+void handle_line(char *line, ssize_t bytes_read) {
+    long received = now_us();
+    enum RequestType type = request_type(split_reply(line, NULL));
 
-        long start_time;
+    if (strncmp(line, "start", 5) == 0 || strncmp(line, "end", 3) == 0) {
+        ingest_line(line, bytes_read, type, received);
+        return;
+    }
 
-        char *token;
-        token = strtok(request, " ");
-        token = strtok(NULL, " ");
-        pid = atoi(token);
-        token = strtok(NULL, " ");
-        strcpy(program, token);
-        token = strtok(NULL, " ");
-        start_time = atol(token);
+    if (strncmp(line, "submit", 6) == 0) {
+        begin_flight(type, received);
+        submit_job(line);
+        dispatch_jobs();
+        record_latency(type, received);
+        flight = NULL;
+        return;
+    }
 
-        // Save start information to file
-        char filename[BUFFER_SIZE];
-        sprintf(filename, "%s/%d", output_dir, pid);
+    if (strncmp(line, "place", 5) == 0) {
+        begin_flight(type, received);
+        place_request(line);
+        record_latency(type, received);
+        flight = NULL;
+        return;
+    }
 
-        int file_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (strncmp(line, "watch", 5) == 0) {
+        begin_flight(type, received);
 
-        if (file_fd == -1) {
-            // Debug: opening failed
-            perror("Error opening file");
-            _exit(1);
+        if (num_shards > 1) {
+            // Every shard sends the deltas of its own runs to the same fifo
+            line[bytes_read] = '\n';
+            for (int k = 0; k < num_shards; k++) {
+                write_all(shard_fds[k], line, bytes_read + 1);
+            }
+        } else {
+            add_watcher(line);
         }
+        record_latency(type, received);
+        flight = NULL;
+        return;
+    }
 
-        num_written = snprintf(buffer, BUFFER_SIZE, "%s %ld\n", program, start_time);
-        
-        if (num_written < 0 || num_written >= BUFFER_SIZE) {
-            // Debug: message formatting failed
-            perror("Formatting message!");
-            _exit(1);
-        }
+    int streamed = strchr(line, PID_STREAM_PREFIX) != NULL;
 
-        if (write(file_fd, buffer, num_written) != num_written) {
-            // Debug: writing failed
-            perror("Writing");
-            _exit(1);
+    if (may_reject && !streamed && (num_pending_queries == MAX_PENDING_QUERIES || received - drain_started > BUSY_LAG)) {
+        reject_query(line);
+        return;
+    }
+
+    if (num_pending_queries == MAX_PENDING_QUERIES) {
+        // Nothing waits behind a full queue, the query is answered now or busy without a child for it
+        if (answer_query(line, type, received) == -1) {
+            reject_query(line);
         }
+        return;
+    }
 
-        close(file_fd);
+    if (num_pending_queries > 0 || query_children >= MAX_QUERY_CHILDREN) {
+        count_metric(&metrics->queries_deferred, 1);
+    }
 
-        create_info(pid, program, start_time, 1);
+    struct PendingQuery *query = &pending_queries[(first_query + num_pending_queries) % MAX_PENDING_QUERIES];
+    query->line = strdup(line);
+    query->type = type;
+    query->received = received;
+    num_pending_queries++;
+}
 
-    } else if (strncmp (request, "end", 3) == 0) {
+/**
+ * This function tells which shard a process of the coordinator is
+ * @param[in] pid
+ * @param[out] shard -1 if it isn't a shard
+ */
+int shard_of(int pid) {
+    for (int k = 0; num_shards > 1 && k < num_shards; k++) {
+        if (shard_pids[k] == pid) {
+            return k;
+        }
+    }
+    return -1;
+}
 
-        int pid;
+/**
+ * This function stops the coordinator after one of its shards exited. The
+ * shard took its runs with it, and one forked again from here would inherit
+ * the state of the coordinator instead of a clean one, so the whole monitor
+ * goes away and the other shards with it. The tracers stop finding it
+ * @param[in] k Shard that exited
+ */
+void shard_exited(int k) {
+    fprintf(stderr, "Shard %d exited, stopping the monitor\n", k);
 
-        long end_time;
+    unlink(SHARDS_FILE);
+    unlink(server_pipe_name);
+    unlink(client_pipe_name);
+    _exit(1);
+}
 
-        char *token;
-        token = strtok(request, " ");
-        token = strtok(NULL, " ");
-        pid = atoi(token);
-        token = strtok(NULL, " ");
-        end_time = atol(token);
+/**
+ * This function receives requests until the monitor is killed. Start and end
+ * requests are applied here (or handed to the shard that owns the pid when this
+ * is the coordinator of a sharded monitor), every other request gets a child
+ * once the requests already in the server pipe were read.
+ * The same loop serves the aggregators subscribed to this monitor and reads
+ * the deltas of the child monitors when this is an aggregator
+ */
+void serve() {
 
-        // Load start information from file
-        char filename[BUFFER_SIZE];
-        sprintf(filename, "%s/%d", output_dir, pid);
+    mkfifo(client_pipe_name, 0666);
+    mkfifo(server_pipe_name, 0666);
 
-        int file_fd = open(filename, O_RDONLY);
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        // Debug: epoll failed
+        perror("epoll_create1");
+        _exit(1);
+    }
 
-        if (file_fd == -1) {
-            // Debug: opening failed
-            perror("Error opening file");
-            _exit(1);
-        }
+    // Receive requests from clients, keeping a writer open so the pipe
+    // doesn't reach end of file (and lose buffered requests) between clients
+    struct Channel server = { .kind = CHANNEL_SERVER };
+    reader_init(&server.reader, open(server_pipe_name, O_RDONLY | O_NONBLOCK));
+    if (server.reader.fd == -1) {
+        // Debug: open failed
+        perror("open");
+        _exit(1);
+    }
 
-        ssize_t bytes_read = read(file_fd, buffer, BUFFER_SIZE - 1);
+    int keep_open_fd = open(server_pipe_name, O_WRONLY);
+    if (keep_open_fd == -1) {
+        // Debug: open failed
+        perror("open");
+        _exit(1);
+    }
 
-        close(file_fd);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &server };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server.reader.fd, &event);
 
-        if (bytes_read < 0) {
-            // Debug: reading failed
-            perror("read");
+    // Let aggregators subscribe to the deltas of this monitor
+    struct Channel listener = { .kind = CHANNEL_LISTEN };
+    if (listen_path != NULL) {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        strncpy(address.sun_path, listen_path, sizeof(address.sun_path) - 1);
+        unlink(listen_path);
+
+        listener.reader.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener.reader.fd == -1 || bind(listener.reader.fd, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(listener.reader.fd, MAX_SUBSCRIBERS) == -1) {
+            // Debug: socket failed
+            perror("Error listening for aggregators");
             _exit(1);
         }
 
-        buffer[bytes_read] = '\0';
-
-        char program[BUFFER_SIZE];
-
-        long start_time;
-
-        char *token_before;
-        token_before = strtok(buffer, " ");
-        strcpy(program, token_before);
-        token_before = strtok(NULL, " ");
-        start_time = atol(token_before);
+        event.data.ptr = &listener;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener.reader.fd, &event);
+    }
 
-        long elapsed_time = end_time - start_time;
+    // Subscribing to a child never fails for good, it's retried until it works
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, request_dump);
+    signal(SIGCHLD, job_exited);
 
-        // Save end information to file
-        file_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    for (int k = 0; k < num_children; k++) {
+        connect_child(children[k]);
+    }
 
-        if (file_fd == -1) {
-            // Debug: opening failed
-            perror("Error opening file");
-            _exit(1);
-        }
+    struct epoll_event events[MAX_SUBSCRIBERS];
 
-        num_written = snprintf(buffer, BUFFER_SIZE,  "%s %ld\n", program, elapsed_time);
-        
-        if (num_written < 0 || num_written >= BUFFER_SIZE) {
-            // Debug: message formatting failed
-            perror("Formatting message!");
-            _exit(1);
-        }
+    while (1) {
 
-        if (write(file_fd, buffer, num_written) != num_written) {
-            // Debug: writing failed
-            perror("Writing");
-            _exit(1);
+        // Reap the children that already answered their request
+        int status;
+        int child;
+        while ((child = waitpid(-1, &status, WNOHANG)) > 0) {
+            if (child == compactor) {
+                compactor = 0;
+            } else if (child == compressor) {
+                compressor = 0;
+            } else if (shard_of(child) >= 0) {
+                shard_exited(shard_of(child));
+            } else if (finish_job(child)) {
+                continue;
+            } else if (query_children > 0) {
+                query_children--;
+            }
         }
 
-        close(file_fd);
+        // Jobs that ended left room for queued ones
+        dispatch_jobs();
 
-        update_info(pid, elapsed_time, 0);
+        // Queries left waiting by the last read get the children that are free now
+        dispatch_queries();
 
-    } else if (strncmp (request, "status", 6) == 0) {
-    
-        // Open the server pipe for writing
-        int client_fd = open(CLIENT_PIPE_NAME, O_WRONLY);
-        if (client_fd == -1) {
-            perror("Error opening client pipe");
-            _exit(1);
+        int timeout = -1;
+        for (int k = 0; k < num_children; k++) {
+            if (children[k]->reader.fd == -1 && connect_child(children[k]) == -1) {
+                timeout = RECONNECT_INTERVAL;
+            }
         }
 
-        int i = 0;
-        while (i < MAX_ENTRIES && information[i] != NULL){
-            if (information[i]->running == 1) {
-
-                struct timeval time_so_far;
-                gettimeofday(&time_so_far, NULL);
+        int tick_timeout = tick_watchers();
+        if (tick_timeout >= 0 && (timeout == -1 || tick_timeout < timeout)) {
+            timeout = tick_timeout;
+        }
 
-                long time_now = time_so_far.tv_sec * 1000 + time_so_far.tv_usec / 1000;
+        tick_timeout = tick_metrics();
+        if (tick_timeout >= 0 && (timeout == -1 || tick_timeout < timeout)) {
+            timeout = tick_timeout;
+        }
 
-                char buffer[BUFFER_SIZE];
-                int num_written = snprintf(buffer, BUFFER_SIZE, "%d %s %ld \n", information[i]->pid, information[i]->name, time_now - information[i]->time);
+        tick_timeout = tick_sampler();
+        if (tick_timeout >= 0 && (timeout == -1 || tick_timeout < timeout)) {
+            timeout = tick_timeout;
+        }
 
-                if (num_written < 0 || num_written >= BUFFER_SIZE) {
-                    perror("Error formatting message");
-                    _exit(1);
-                }
-                if (write(client_fd, buffer, num_written) != num_written) {
-                    perror("Error writing to client pipe");
-                    _exit(1);
-                }
-            }
-            i++;
+        tick_timeout = tick_orphans();
+        if (tick_timeout >= 0 && (timeout == -1 || tick_timeout < timeout)) {
+            timeout = tick_timeout;
         }
 
-        close(client_fd);
+        tick_timeout = tick_sampling();
+        if (tick_timeout >= 0 && (timeout == -1 || tick_timeout < timeout)) {
+            timeout = tick_timeout;
+        }
 
-    } else if (strncmp (request, "stats-time", 10) == 0) {
-        
-        // Open the client pipe for writing
-        int client_fd = open(CLIENT_PIPE_NAME, O_WRONLY);
-        if (client_fd == -1) {
-            perror("Error opening client pipe");
-            _exit(1);
+        tick_timeout = tick_retention();
+        if (tick_timeout >= 0 && (timeout == -1 || tick_timeout < timeout)) {
+            timeout = tick_timeout;
         }
 
-        // Parse the list of PIDs from the request
-        char *token = strtok(request, " ");
-        token = strtok(NULL, " ");
-        long total_time = 0;
-
-        int i = 0;
-        while (token != NULL) {
-            int pid = atoi(token);
-            while (i < MAX_ENTRIES && information[i] != NULL){
-                if (information[i]->pid == pid) {
-                    total_time += information[i]->time;
-                }
-                i++;
-            }
-            token = strtok(NULL, " ");
+        tick_timeout = tick_compaction();
+        if (tick_timeout >= 0 && (timeout == -1 || tick_timeout < timeout)) {
+            timeout = tick_timeout;
         }
 
+        tick_timeout = tick_compression();
+        if (tick_timeout >= 0 && (timeout == -1 || tick_timeout < timeout)) {
+            timeout = tick_timeout;
+        }
 
-        // Write the total time to the client pipe
-        char buffer[BUFFER_SIZE];
-        int num_written = snprintf(buffer, BUFFER_SIZE, "Total execution time is %ld ms\n", total_time);
-        if (num_written < 0 || num_written >= BUFFER_SIZE) {
-            perror("Error formatting message");
-            _exit(1);
+        if (num_pending_queries > 0 && (timeout == -1 || QUERY_POLL_INTERVAL < timeout)) {
+            timeout = QUERY_POLL_INTERVAL;
         }
-        if (write(client_fd, buffer, num_written) != num_written) {
-            perror("Error writing to client pipe");
-            _exit(1);
+
+        if (num_running_jobs > 0 && (timeout == -1 || JOB_POLL_INTERVAL < timeout)) {
+            timeout = JOB_POLL_INTERVAL;
         }
 
-        close(client_fd);
-    } else if (strncmp(request, "stats-command", 13) == 0) {
-        
-        // Open the client pipe for writing
-        int client_fd = open(CLIENT_PIPE_NAME, O_WRONLY);
-        if (client_fd == -1) {
-            perror("Error opening client pipe");
-            _exit(1);
+        int num_events = epoll_wait(epoll_fd, events, MAX_SUBSCRIBERS, timeout);
+
+        if (dump_requested) {
+            dump_flight();
+            dump_requested = 0;
         }
 
-        // Parse the program name and list of PIDs from the request
-        char *token = strtok(request, " ");
-        token = strtok(NULL, " ");
-        char *program_name = token;
-        token = strtok(NULL, " ");
-        int count = 0;
-        int i = 0;
+        for (int e = 0; e < num_events; e++) {
+            struct Channel *channel = events[e].data.ptr;
+            ssize_t bytes_read;
 
-        while (token != NULL) {
-            int pid = atoi(token);
+            switch (channel->kind) {
 
-            while (i < MAX_ENTRIES && information[i] != NULL){
-                if (information[i]->pid == pid) {
-                    if (strcmp(information[i]->name, program_name) == 0) {
-                        count++;
+            case CHANNEL_SERVER:
+                drain_started = now_us();
+                while ((bytes_read = readln(&channel->reader)) >= 0) {
+                    if (bytes_read > 0) {
+                        handle_line(channel->reader.line, bytes_read);
                     }
                 }
-                i++;
-            }
+                dispatch_queries();
+                break;
 
-            token = strtok(NULL, " ");
-        }
-
-        // Write the count to the client pipe
-        char buffer[BUFFER_SIZE];
-        int num_written = snprintf(buffer, BUFFER_SIZE, "%s was executed %d times\n", program_name, count);
-        if (num_written < 0 || num_written >= BUFFER_SIZE) {
-            perror("Error formatting message");
-            _exit(1);
-        }
-        if (write(client_fd, buffer, num_written) != num_written) {
-            perror("Error writing to client pipe");
-            _exit(1);
-        }
+            case CHANNEL_LISTEN:
+                accept_subscriber(channel->reader.fd);
+                break;
 
-        close(client_fd);
-    }else if (strncmp(request, "stats-uniq", 10) == 0) {
-        // Open the client pipe for writing
-        int client_fd = open(CLIENT_PIPE_NAME, O_WRONLY);
-        if (client_fd == -1) {
-            perror("Error opening client pipe");
-            _exit(1);
-        }
+            case CHANNEL_SUBSCRIBER:
+                for (int k = 0; k < MAX_SUBSCRIBERS; k++) {
+                    if (subscribers[k] != channel) {
+                        continue;
+                    }
+                    // Subscribers don't send anything, readable means they went away
+                    if ((events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) || flush_channel(channel) == -1) {
+                        drop_subscriber(k);
+                    }
+                }
+                break;
 
-        // Parse the list of PIDs from the request
-        char *token = strtok(request, " ");
-        token = strtok(NULL, " ");
-        char buffer[BUFFER_SIZE];
-        int i = 0;
-        char *program_save[BUFFER_SIZE];
-        int num_progs = 0;
-        int flag = 0;
-
-        while (token != NULL) {
-            int pid = atoi(token);
-
-            while (i < MAX_ENTRIES && information[i] != NULL){
-                if (information[i]->pid == pid) {
-                    for(int j = 0; j < num_progs ; j++){
-                        if(strcmp(information[i]->name, program_save[j]) == 0){
-                            flag = 1;
-                        }
+            case CHANNEL_WATCHER:
+                for (int k = 0; k < MAX_WATCHERS; k++) {
+                    if (watchers[k] != channel) {
+                        continue;
                     }
-                    if(flag == 0){
-                        program_save[num_progs] = malloc(sizeof(char));
-                        strcpy(program_save[num_progs], information[i]->name);
-                        num_progs++;
-
-                        // Write the program name to the client pipe
-                        int num_written = snprintf(buffer, BUFFER_SIZE, "%s\n", information[i]->name);
-                        if (num_written < 0 || num_written >= BUFFER_SIZE) {
-                            perror("Error formatting message");
-                            _exit(1);
-                        }
-                        if (write(client_fd, buffer, num_written) != num_written) {
-                            perror("Error writing to client pipe");
-                            _exit(1);
-                        }
+                    if (events[e].events & (EPOLLHUP | EPOLLERR)) {
+                        drop_watcher(k);
+                    } else {
+                        service_watcher(k);
                     }
                 }
-                flag = 0;
-                i++;
-            }
+                break;
 
-            token = strtok(NULL, " ");
-        }
+            case CHANNEL_ANSWER:
+                read_answer(channel);
+                break;
 
-        close(client_fd);
+            case CHANNEL_PIDFD:
+                mark_exited(channel->info);
+                break;
+
+            case CHANNEL_TIMER:
+                tick_wheel();
+                break;
 
-        // Free memory
-        for (int i = 0; i < num_progs; i++) {
-            free(program_save[i]);
+            case CHANNEL_CHILD:
+                while ((bytes_read = readln(&channel->reader)) >= 0) {
+                    apply_delta(channel->reader.line, channel->origin);
+                }
+                enforce_retention();
+                if (channel->reader.eof || errno != EAGAIN) {
+                    disconnect_child(channel);
+                }
+                break;
+            }
         }
 
-    } else {
-        // Debug: request failed
-        perror("request");
-        _exit(1);
     }
+
+    close(keep_open_fd);
+    close(server.reader.fd);
+    free(server.reader.line);
+
+    unlink(server_pipe_name);
+    unlink(client_pipe_name);
 }
 
 /**
@@ -440,10 +6249,48 @@ int main(int argc, char *argv[]) {
 
     int num_written;
 
-    if (argc < 2) {
+    int usage = argc < 2;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            num_shards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            listen_path = argv[++i];
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            sample_interval = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            max_jobs = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            max_command_jobs = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            max_entries = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            max_age = atol(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            max_memory = atol(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && strchr(argv[i + 1], '=') != NULL) {
+            // Read again once the sampling file exists
+            i++;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            target_rate = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc && num_children < MAX_CHILDREN) {
+            children[num_children] = calloc(1, sizeof(struct Channel));
+            children[num_children]->kind = CHANNEL_CHILD;
+            children[num_children]->path = argv[++i];
+            children[num_children]->origin = num_children + 1;
+            children[num_children]->reader.fd = -1;
+            num_children++;
+        } else {
+            usage = 1;
+        }
+    }
+
+    if (usage || num_shards < 1 || num_shards > MAX_SHARDS || (num_shards > 1 && num_children > 0)) {
 
         // Instructions on the usage of the program
-        num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s output_dir\n", argv[0]);
+        num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s output_dir [-s shards] [-l socket] [-a child_socket]... [-m metrics_file] [-r sample_interval] [-e max_entries] [-x max_age_seconds] [-b max_memory_kb] [-j max_jobs] [-k max_jobs_per_command] [-n command=rate]... [-t target_runs_per_second]\n", argv[0]);
     
         if (num_written < 0 || num_written >= BUFFER_SIZE) {
             perror("Formatting message!");
@@ -457,95 +6304,130 @@ int main(int argc, char *argv[]) {
         _exit(1);
     }
 
-    mkfifo(CLIENT_PIPE_NAME, 0666);
-    mkfifo(SERVER_PIPE_NAME, 0666);
-
     output_dir = argv[1];
+    started_at = now_ms();
 
-
-    while (1) {
-
-        // Receive request from client
-        int server_fd = open(SERVER_PIPE_NAME, O_RDONLY);
-        if (server_fd == -1) {
-            // Debug: open failed
-            perror("open");
+    // Tell the tracers where to capture the output of runs, from wherever they run
+    char output_path[PATH_MAX];
+    if (realpath(output_dir, output_path) != NULL) {
+        int output_dir_fd = open(OUTPUT_DIR_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (output_dir_fd == -1) {
+            // Debug: opening failed
+            perror("Error opening output dir file");
             _exit(1);
         }
 
-        char line[BUFFER_SIZE];
-        ssize_t bytes_read = readln(server_fd, line, BUFFER_SIZE - 1);
-        close(server_fd);
-
-        if (bytes_read > 0) {
+        num_written = snprintf(buffer, BUFFER_SIZE, "%s\n", output_path);
+        if (num_written < 0 || num_written >= BUFFER_SIZE || write(output_dir_fd, buffer, num_written) != num_written) {
+            perror("Writing");
+            _exit(1);
+        }
 
-            //line[bytes_read] = '\0';
+        close(output_dir_fd);
+    }
 
-            // Create new process to process request
-            int pid = fork();
+    if (max_jobs <= 0) {
+        max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
 
-            if (pid == 0) {
-                // Child process
-                process_request(line);
-                _exit(0);
+    // The shards count in their own block, the coordinator reads them all
+    map_metrics(num_shards > 1 ? num_shards + 1 : 1);
 
-            } else if (pid > 0) {
-                // Parent process
-                int status;
-                waitpid(pid, &status, WNOHANG);
+    // Tell the tracers how many shards there are, they send start and end straight to them
+    unlink(SHARDS_FILE);
 
-            } else {
-                // Debug: fork failed
-                perror("fork");
-                _exit(1);
+    // And which commands they only trace one in so many runs of, the shards inherit the rates
+    unlink(SAMPLING_FILE);
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            char *name = argv[++i];
+            char *equals = strchr(name, '=');
+            if (sampling == NULL) {
+                open_sampling();
+            }
+            *equals = '\0';
+            int slot = claim_sampling(name);
+            if (slot >= 0) {
+                sampling[slot].fixed = 1;
+                sampling[slot].rate = atol(equals + 1) < 1 ? 1 : atol(equals + 1);
             }
-
         }
-
     }
-
-    /*
-    // This is not working But it would be good if it did!
-    // Receive request from client
-    int server_fd = open(SERVER_PIPE_NAME, O_RDONLY);
-    open(SERVER_PIPE_NAME, O_WRONLY);
-    if (server_fd == -1) {
-        perror("open");
-        _exit(1);
+    if (target_rate > 0 && sampling == NULL) {
+        open_sampling();
     }
 
-    char line[BUFFER_SIZE];
-    ssize_t bytes_read;
-    
-
-    if ((bytes_read = readln(server_fd, line, BUFFER_SIZE - 1)) > 0) {
+    if (num_shards == 1) {
+        serve();
+        return 0;
+    }
 
-        line[bytes_read] = '\0';
+    for (int k = 0; k < num_shards; k++) {
+        char shard_server_name[BUFFER_SIZE];
+        snprintf(shard_server_name, BUFFER_SIZE, SHARD_SERVER_PIPE_NAME, k);
+        mkfifo(shard_server_name, 0666);
 
-        // Create new process to process request
         int pid = fork();
 
         if (pid == 0) {
-            // Child process
-            process_request(line);
-            _exit(0);
+            // Shard process, it goes away with the coordinator
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
 
-        } else if (pid > 0) {
-            // Parent process
-            int status;
-            waitpid(pid, &status, WNOHANG);
+            num_shards = 1;
+            may_reject = 0;
+            adapts_sampling = k == 0;
+            metrics = &metrics_blocks[k + 1];
+            recorder = &recorders[k + 1];
+            metrics_path = NULL;
+            strcpy(server_pipe_name, shard_server_name);
+            snprintf(client_pipe_name, BUFFER_SIZE, SHARD_CLIENT_PIPE_NAME, k);
 
-        } else {
+            // Every shard publishes its own deltas, on the socket name followed by the shard
+            if (listen_path != NULL) {
+                char *shard_listen_path = malloc(BUFFER_SIZE);
+                snprintf(shard_listen_path, BUFFER_SIZE, "%s.%d", listen_path, k);
+                listen_path = shard_listen_path;
+            }
+
+            serve();
+            _exit(0);
+
+        } else if (pid < 0) {
+            // Debug: fork failed
             perror("fork");
             _exit(1);
         }
 
+        shard_pids[k] = pid;
+        shard_fds[k] = open(shard_server_name, O_WRONLY);
+        if (shard_fds[k] == -1) {
+            // Debug: open failed
+            perror("open");
+            _exit(1);
+        }
+    }
+
+    int shards_fd = open(SHARDS_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (shards_fd == -1) {
+        // Debug: opening failed
+        perror("Error opening shards file");
+        _exit(1);
+    }
+
+    num_written = snprintf(buffer, BUFFER_SIZE, "%d\n", num_shards);
+
+    if (num_written < 0 || num_written >= BUFFER_SIZE || write(shards_fd, buffer, num_written) != num_written) {
+        perror("Writing");
+        _exit(1);
     }
 
-    close(server_fd);*/
+    close(shards_fd);
 
-    unlink(SERVER_PIPE_NAME);
-    unlink(CLIENT_PIPE_NAME);
+    // The coordinator holds no runs, the shards publish them
+    listen_path = NULL;
+    adapts_sampling = 0;
+
+    serve();
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,33 @@
+// @file sampling.h
+// Layout of the sampling file, shared by the monitor that writes it and the tracers that read it
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#define SAMPLING_FILE "tmp/sampling" ///< File with the sampling rate of the commands that aren't traced on every run
+#define SAMPLING_SLOTS 4096 ///< Commands the sampling file has room for
+#define SAMPLING_NAME 60 ///< Longest name of a command in the sampling file, plus one, longer ones are always traced
+
+/**
+ *  Sampling rate of a command, a slot of the sampling file found by the hash of its name
+ */
+struct SamplingSlot {
+    unsigned int rate; ///< One in this many runs of the command is traced, 0 while the slot is free
+    unsigned int claimed; ///< 1 once a shard took the slot for a command, it writes the name then the rate
+    unsigned int fixed; ///< 1 if the rate was given with "-n", the adaptive sampling leaves it alone
+    unsigned long runs; ///< Runs started since the last adjustment of the rates, the ones that weren't traced included
+    char name[SAMPLING_NAME]; ///< Name of the command
+};
+
+/**
+ * Return the hash of a name
+ * @param[in] name
+ */
+static inline unsigned long hash_name(char *name) {
+    unsigned long hash = 5381;
+    for (char *c = name; *c != '\0'; c++) {
+        hash = hash * 33 + (unsigned char) *c;
+    }
+    return hash;
+}
+
+#endif
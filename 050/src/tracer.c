@@ -1,4 +1,5 @@
 // @file tracer.c
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -6,10 +7,719 @@
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/perf_event.h>
+#include "sampling.h"
 
 #define SERVER_PIPE_NAME "tmp/server_pipe" ///< Name of the server pipe
 #define CLIENT_PIPE_NAME "tmp/client_pipe" ///< Name of the client pipe
+#define SHARD_SERVER_PIPE_NAME "tmp/server_pipe.%d" ///< Name of the server pipe of a shard, %d is the shard
+#define SHARDS_FILE "tmp/shards" ///< File written by a sharded monitor with the number of shards
+#define OUTPUT_DIR_FILE "tmp/output_dir" ///< File written by the monitor with its output directory, where "--capture" puts the output
+#define CAPTURE_LIMIT (16 << 20) ///< Bytes of each stream kept with "--capture", the rest is dropped
+#define MAX_PLACED_CORES 64 ///< Cores the monitor records the placement on, the ones past it are pinned but not recorded
+#define SPLICE_CHUNK 65536 ///< Most bytes moved by one splice, the size of a pipe
+#define PID_STREAM_NAME "tmp/pids_%d" ///< Name of the fifo used to stream long pid lists, %d is the tracer pid
+#define PID_STREAM_PREFIX '@' ///< Prefix that tells the monitor a pid argument names a fifo
+#define WATCH_PIPE_NAME "tmp/watch_%d" ///< Name of the fifo the monitor pushes status deltas to, %d is the tracer pid
+#define PLACE_PIPE_NAME "tmp/place_%d" ///< Name of the fifo the monitor answers placements through, %d is the tracer pid
+#define PLACE_TIMEOUT 5000 ///< Milliseconds waited for the monitor to pick a core before the run goes on unpinned
+#define BUSY_ANSWER "busy\n" ///< Answer of the monitor when it has no room for a query
+#define BUSY_BACKOFF 10 ///< Milliseconds waited before sending a query again the first time the monitor is busy
+#define BUSY_BACKOFF_MAX 1000 ///< Most milliseconds waited between two attempts
+#define BUSY_RETRIES 10 ///< Attempts before giving up on a busy monitor
+#define DEFAULT_WATCH_INTERVAL 1000 ///< Milliseconds between status updates when watching
 #define BUFFER_SIZE 1024 ///< Size of every buffer
+#define MAX_STAGES 1024 ///< Most programs in a pipeline
+#define CGROUP_ROOT "/sys/fs/cgroup" ///< Where the cgroup v2 hierarchy is mounted
+#define CGROUP_HYBRID_ROOT "/sys/fs/cgroup/unified" ///< Where it's mounted when cgroup v1 is mounted too
+#define CGROUP_ENV "TRACER_CGROUP" ///< Environment variable with the cgroup the runs get a leaf in, the tracer's own by default
+#define PERF_COUNTERS 6 ///< Counters opened for every process of a run with "--perf"
+#define CGROUP_LEAF "tracer-%d" ///< Name of the leaf cgroup of a run, %d is the tracer pid
+
+char watch_name[BUFFER_SIZE]; ///< Fifo being watched, removed when the tracer is interrupted
+
+/**
+ *  How the processes a run spawns are accounted for
+ */
+enum Tree {
+    TREE_OFF, ///< Only the processes the tracer forks
+    TREE_SUBREAPER, ///< The tracer is a child subreaper, descendants that are orphaned are waited for by it
+    TREE_CGROUP ///< The run gets a cgroup v2 leaf, its counters cover every descendant
+};
+
+enum Tree tree = TREE_OFF; ///< Read from "--tree"
+
+long timeout = 0; ///< Milliseconds the run may take before the monitor stops it, 0 for no limit, read from "--timeout"
+
+int perf = 0; ///< 1 if the performance counters of the run are read, set by "--perf"
+
+/**
+ *  Counters opened with "--perf", in the order the end request sends them
+ */
+struct {
+    __u32 type; ///< Software or hardware event
+    __u64 config; ///< Which event of its type
+} perf_events[PERF_COUNTERS] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS }
+};
+
+long perf_values[PERF_COUNTERS] = { -1, -1, -1, -1, -1, -1 }; ///< Counts of every process of the run added up, -1 for counters that couldn't be opened
+
+int capture = 0; ///< 1 if the stdout and stderr of the run are captured, set by "--capture"
+
+int capture_pipes[2][2]; ///< Pipes the run writes its stdout and stderr to with "--capture"
+
+long captured[2] = { 0, 0 }; ///< Bytes of stdout and stderr kept
+
+long dropped = 0; ///< Bytes of both streams past CAPTURE_LIMIT
+
+char capture_dir[BUFFER_SIZE / 2]; ///< Output directory of the monitor, read from OUTPUT_DIR_FILE
+
+int pinned = 0; ///< 1 if the run is pinned to run_cpus, set by "--cpus"
+
+cpu_set_t run_cpus; ///< Cores the processes of the run may run on with "--cpus"
+
+char cgroup_path[BUFFER_SIZE / 2]; ///< Leaf cgroup of the run when tree is TREE_CGROUP
+
+int pipeline_group = 0; ///< Process group of the stages of a pipeline, named after its first stage, 0 before it's forked
+
+/**
+ *  Program running according to the monitor, kept while watching the status
+ */
+struct Watched {
+    int pid; ///< Pid of the program
+    char *name; ///< Name of the program
+    long start_time; ///< Time it started, in milliseconds
+};
+
+/**
+ * Name of the pipe start and end requests about a pid go to: the server pipe,
+ * or the one of the shard that owns the pid if the monitor is sharded
+ * @param[in] pid
+ */
+char *server_pipe_for(int pid) {
+    static int num_shards = 0;
+    static char name[BUFFER_SIZE];
+
+    if (num_shards == 0) {
+        num_shards = 1;
+
+        int fd = open(SHARDS_FILE, O_RDONLY);
+        if (fd != -1) {
+            ssize_t bytes_read = read(fd, name, BUFFER_SIZE - 1);
+            if (bytes_read > 0) {
+                name[bytes_read] = '\0';
+                num_shards = atoi(name);
+            }
+            close(fd);
+        }
+    }
+
+    if (num_shards <= 1) {
+        return SERVER_PIPE_NAME;
+    }
+
+    snprintf(name, BUFFER_SIZE, SHARD_SERVER_PIPE_NAME, pid % num_shards);
+    return name;
+}
+
+/**
+ * Find how many runs a run stands for: the monitor may only want one in so
+ * many runs of a command traced, it tells which in SAMPLING_FILE. Called before
+ * the run is launched, so a run that isn't traced skips the work of accounting
+ * for it. Runs with "--timeout" or "--capture" are always traced, the monitor
+ * acts on them
+ * @param[in] program Name of the program, a pipeline goes by its first one
+ * @param[out] weight Sampling rate if the run is traced, 1 for every run, 0 if it isn't traced
+ */
+long sample_run(char *program) {
+    if (timeout > 0 || capture) {
+        return 1;
+    }
+
+    char name[SAMPLING_NAME];
+    program += strspn(program, " ");
+    size_t length = strcspn(program, " ");
+    if (length >= SAMPLING_NAME) {
+        return 1;
+    }
+    memcpy(name, program, length);
+    name[length] = '\0';
+
+    int fd = open(SAMPLING_FILE, O_RDONLY);
+    if (fd == -1) {
+        // No command is sampled
+        return 1;
+    }
+
+    // The same probing as the monitor, a slot is read at a time, the first one is mostly it
+    unsigned int rate = 1;
+    unsigned long slot = hash_name(name) % SAMPLING_SLOTS;
+    struct SamplingSlot entry;
+    for (int probe = 0; probe < SAMPLING_SLOTS; probe++, slot = (slot + 1) % SAMPLING_SLOTS) {
+        if (pread(fd, &entry, sizeof(entry), slot * sizeof(entry)) != sizeof(entry) || entry.rate == 0) {
+            break;
+        }
+        entry.name[SAMPLING_NAME - 1] = '\0';
+        if (strcmp(entry.name, name) == 0) {
+            rate = entry.rate;
+            break;
+        }
+    }
+
+    close(fd);
+
+    if (rate <= 1) {
+        return 1;
+    }
+
+    // Mix the pid with the time, so runs of the same pid aren't all picked or all skipped
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    unsigned long mixed = ((unsigned long) getpid() * 2654435761UL) ^ now.tv_usec;
+    mixed ^= mixed >> 16;
+
+    if (mixed % rate != 0) {
+        // Nothing of the run is sent, so nothing is accounted for
+        tree = TREE_OFF;
+        perf = 0;
+        return 0;
+    }
+    return rate;
+}
+
+/**
+ * Write " sample rate" for the start request of a run picked out of rate runs
+ * @param[out] buffer Empty if every run is traced
+ * @param[in] size
+ * @param[in] weight
+ */
+void sample_usage(char *buffer, size_t size, long weight) {
+    buffer[0] = '\0';
+
+    if (weight > 1) {
+        snprintf(buffer, size, " sample %ld", weight);
+    }
+}
+
+/**
+ * Get ready to account for the whole process tree of a run, before its
+ * processes are forked. Falls back to TREE_OFF if it can't be done
+ */
+void tree_prepare() {
+    if (tree == TREE_SUBREAPER) {
+        if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+            // Debug: prctl failed
+            perror("prctl");
+            tree = TREE_OFF;
+        }
+        return;
+    }
+
+    if (tree != TREE_CGROUP) {
+        return;
+    }
+
+    // The leaf goes in the cgroup of the environment, or the one the tracer is in (line "0::/path")
+    char parent[BUFFER_SIZE / 4] = "";
+    char *base = getenv(CGROUP_ENV);
+
+    if (base != NULL) {
+        snprintf(parent, sizeof(parent), "%s", base);
+    } else {
+        int fd = open("/proc/self/cgroup", O_RDONLY);
+        if (fd != -1) {
+            char text[BUFFER_SIZE];
+            ssize_t bytes_read = read(fd, text, BUFFER_SIZE - 1);
+            close(fd);
+
+            text[bytes_read > 0 ? bytes_read : 0] = '\0';
+            char *line = strncmp(text, "0::", 3) == 0 ? text : strstr(text, "\n0::");
+            if (line != NULL) {
+                line += line == text ? 3 : 4;
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(parent, sizeof(parent), "%s%s", access(CGROUP_ROOT "/cgroup.controllers", F_OK) == 0 ? CGROUP_ROOT : CGROUP_HYBRID_ROOT, line);
+            }
+        }
+    }
+
+    if (parent[0] == '\0') {
+        // Debug: no cgroup v2
+        write(2, "No cgroup v2 to create the run in\n", 34);
+        tree = TREE_OFF;
+        return;
+    }
+
+    snprintf(cgroup_path, sizeof(cgroup_path), "%s/" CGROUP_LEAF, parent, getpid());
+
+    if (mkdir(cgroup_path, 0755) == -1) {
+        // Debug: no permission on the cgroup
+        perror("Error creating cgroup");
+        tree = TREE_OFF;
+    }
+}
+
+/**
+ * Move a process the tracer just forked to the leaf cgroup of the run, before it execs
+ */
+void tree_enter() {
+    if (tree != TREE_CGROUP) {
+        return;
+    }
+
+    char path[BUFFER_SIZE];
+    snprintf(path, BUFFER_SIZE, "%s/cgroup.procs", cgroup_path);
+
+    int fd = open(path, O_WRONLY);
+    if (fd == -1 || write(fd, "0", 1) != 1) {
+        // Debug: the run is still traced, just not as a tree
+        perror("Error entering cgroup");
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/**
+ * Read a file of the leaf cgroup of the run
+ * @param[in] name Name of the file
+ * @param[out] buffer
+ * @param[out] bytes_read -1 if it can't be read
+ */
+ssize_t read_cgroup_file(char *name, char *buffer) {
+    char path[BUFFER_SIZE];
+    snprintf(path, BUFFER_SIZE, "%s/%s", cgroup_path, name);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    ssize_t bytes_read = read(fd, buffer, BUFFER_SIZE - 1);
+    close(fd);
+
+    if (bytes_read >= 0) {
+        buffer[bytes_read] = '\0';
+    }
+    return bytes_read;
+}
+
+/**
+ * Wait for the descendants of a run that outlived the processes the tracer forked
+ */
+void tree_wait() {
+    if (tree == TREE_SUBREAPER) {
+        // Orphaned descendants were reparented to the tracer
+        int status;
+        while (wait(&status) > 0);
+
+    } else if (tree == TREE_CGROUP) {
+        char path[BUFFER_SIZE];
+        char buffer[BUFFER_SIZE];
+        snprintf(path, BUFFER_SIZE, "%s/cgroup.events", cgroup_path);
+
+        int fd = open(path, O_RDONLY);
+
+        // cgroup.events raises POLLPRI when "populated" changes
+        while (read_cgroup_file("cgroup.events", buffer) > 0 && strstr(buffer, "populated 1") != NULL) {
+            struct pollfd events = { .fd = fd, .events = POLLPRI };
+            poll(&events, 1, fd != -1 ? 1000 : 10);
+        }
+
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+}
+
+/**
+ * Format what the whole process tree of a run used, as " tree cpu_us peak_kb
+ * read_bytes write_bytes" for the end request, and remove the leaf cgroup.
+ * With a subreaper the peak is the one of the biggest process, with a cgroup
+ * it's the one of the whole tree
+ * @param[out] buffer Empty when the tree isn't accounted for
+ * @param[in] size
+ */
+void tree_usage(char *buffer, size_t size) {
+    long cpu_us = 0, peak_kb = 0, read_bytes = 0, write_bytes = 0;
+
+    buffer[0] = '\0';
+
+    if (tree == TREE_SUBREAPER) {
+        struct rusage usage;
+        getrusage(RUSAGE_CHILDREN, &usage);
+
+        cpu_us = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+        peak_kb = usage.ru_maxrss;
+        read_bytes = usage.ru_inblock * 512;
+        write_bytes = usage.ru_oublock * 512;
+
+    } else if (tree == TREE_CGROUP) {
+        char text[BUFFER_SIZE];
+
+        if (read_cgroup_file("cpu.stat", text) > 0) {
+            sscanf(text, "usage_usec %ld", &cpu_us);
+        }
+        if (read_cgroup_file("memory.peak", text) > 0) {
+            peak_kb = atol(text) / 1024;
+        }
+
+        // One line per device, "major:minor rbytes=n wbytes=n ..."
+        if (read_cgroup_file("io.stat", text) > 0) {
+            for (char *field = text; (field = strpbrk(field, "rw")) != NULL; field++) {
+                if (strncmp(field, "rbytes=", 7) == 0) {
+                    read_bytes += atol(field + 7);
+                } else if (strncmp(field, "wbytes=", 7) == 0) {
+                    write_bytes += atol(field + 7);
+                }
+            }
+        }
+
+        rmdir(cgroup_path);
+
+    } else {
+        return;
+    }
+
+    snprintf(buffer, size, " tree %ld %ld %ld %ld", cpu_us, peak_kb, read_bytes, write_bytes);
+}
+
+/**
+ * Keep a child that was just forked from running its program until its
+ * counters are open, the counters start with the exec
+ * @param[in] go Pipe the parent writes to once they're open
+ */
+void perf_hold(int go[2]) {
+    if (!perf) {
+        return;
+    }
+
+    char ready;
+    close(go[1]);
+    if (read(go[0], &ready, 1) == -1) {
+        // Debug: reading failed, it runs without waiting
+        perror("Reading");
+    }
+    close(go[0]);
+}
+
+/**
+ * Open the counters of a child held by perf_hold and let it go. They're
+ * inherited by its threads and children, and count from its exec. Counters
+ * the kernel only allows for user space are opened for it alone, those the
+ * machine doesn't have are left out
+ * @param[in] pid
+ * @param[in] go
+ * @param[out] fds -1 for the counters that couldn't be opened
+ */
+void perf_open(int pid, int go[2], int fds[PERF_COUNTERS]) {
+    if (!perf) {
+        return;
+    }
+
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[c].type;
+        attr.config = perf_events[c].config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.enable_on_exec = 1;
+
+        fds[c] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fds[c] == -1 && (errno == EACCES || errno == EPERM)) {
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[c] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+    }
+
+    close(go[0]);
+    if (write(go[1], "", 1) == -1) {
+        // Debug: writing failed
+        perror("Writing");
+    }
+    close(go[1]);
+}
+
+/**
+ * Add the counts of a child that exited to perf_values and close its counters
+ * @param[in] fds
+ */
+void perf_collect(int fds[PERF_COUNTERS]) {
+    if (!perf) {
+        return;
+    }
+
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+        long long count;
+        if (fds[c] != -1 && read(fds[c], &count, sizeof(count)) == sizeof(count)) {
+            perf_values[c] = (perf_values[c] == -1 ? 0 : perf_values[c]) + count;
+        }
+        if (fds[c] != -1) {
+            close(fds[c]);
+        }
+    }
+}
+
+/**
+ * Write " perf task_clock_ns context_switches page_faults cpu_migrations cycles
+ * instructions" for the end request, -1 for those that couldn't be counted
+ * @param[out] buffer Empty without "--perf"
+ * @param[in] size
+ */
+void perf_usage(char *buffer, size_t size) {
+    buffer[0] = '\0';
+
+    if (perf) {
+        snprintf(buffer, size, " perf %ld %ld %ld %ld %ld %ld", perf_values[0], perf_values[1], perf_values[2], perf_values[3], perf_values[4], perf_values[5]);
+    }
+}
+
+/**
+ * Find out where the monitor keeps its output and open the pipes the run
+ * writes its stdout and stderr to. Without a monitor that told it the run
+ * goes on without being captured
+ */
+void capture_prepare() {
+    if (!capture) {
+        return;
+    }
+
+    int dir_fd = open(OUTPUT_DIR_FILE, O_RDONLY);
+    ssize_t bytes_read = dir_fd == -1 ? -1 : read(dir_fd, capture_dir, sizeof(capture_dir) - 1);
+    if (dir_fd != -1) {
+        close(dir_fd);
+    }
+
+    if (bytes_read <= 0) {
+        // Debug: the monitor didn't write it, the output isn't captured
+        perror("Error reading output dir file");
+        capture = 0;
+        return;
+    }
+    capture_dir[bytes_read] = '\0';
+    capture_dir[strcspn(capture_dir, "\n")] = '\0';
+
+    // Only the copies the processes get as their stdout and stderr survive the exec
+    for (int k = 0; k < 2; k++) {
+        if (pipe2(capture_pipes[k], O_CLOEXEC) == -1) {
+            // Debug: pipe failed
+            perror("pipe");
+            _exit(1);
+        }
+    }
+}
+
+/**
+ * Point the stdout and stderr of a child that was just forked to the capture pipes
+ * @param[in] out 0 for a stage of a pipeline whose stdout goes to the next one
+ */
+void capture_enter(int out) {
+    if (!capture) {
+        return;
+    }
+
+    if (out) {
+        dup2(capture_pipes[0][1], 1);
+    }
+    dup2(capture_pipes[1][1], 2);
+}
+
+/**
+ * Move what the run writes to "pid.out" and "pid.err" in the output
+ * directory until every process of the run closed them. The bytes are spliced
+ * from the pipes to the files, so they never go through the tracer. Past
+ * CAPTURE_LIMIT they're spliced to /dev/null instead, so the run isn't
+ * blocked, and counted as dropped
+ * @param[in] pid Pid the monitor knows the run by
+ */
+void capture_drain(int pid) {
+    if (!capture) {
+        return;
+    }
+
+    char *stream_names[2] = { "out", "err" };
+    int files[2];
+    struct pollfd streams[2];
+
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    for (int k = 0; k < 2; k++) {
+        close(capture_pipes[k][1]);
+
+        char filename[BUFFER_SIZE];
+        snprintf(filename, BUFFER_SIZE, "%s/%d.%s", capture_dir, pid, stream_names[k]);
+        files[k] = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (files[k] == -1) {
+            // Debug: opening failed, the stream is dropped
+            perror("Error opening output file");
+        }
+
+        streams[k].fd = capture_pipes[k][0];
+        streams[k].events = POLLIN;
+    }
+
+    int num_open = 2;
+    while (num_open > 0) {
+        if (poll(streams, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Debug: poll failed
+            perror("poll");
+            break;
+        }
+
+        for (int k = 0; k < 2; k++) {
+            if (streams[k].fd == -1 || streams[k].revents == 0) {
+                continue;
+            }
+
+            long room = CAPTURE_LIMIT - captured[k];
+            int kept = files[k] != -1 && room > 0;
+            ssize_t num_moved = splice(streams[k].fd, NULL, kept ? files[k] : null_fd, NULL,
+                kept && room < SPLICE_CHUNK ? room : SPLICE_CHUNK, SPLICE_F_MOVE);
+
+            if (num_moved == -1 && errno == EINVAL) {
+                // Debug: the file system can't splice, copied instead
+                char buffer[BUFFER_SIZE];
+                num_moved = read(streams[k].fd, buffer, kept && room < BUFFER_SIZE ? room : BUFFER_SIZE);
+                if (num_moved > 0 && kept && write(files[k], buffer, num_moved) != num_moved) {
+                    perror("Writing");
+                }
+            }
+
+            if (num_moved <= 0) {
+                close(streams[k].fd);
+                streams[k].fd = -1;
+                num_open--;
+            } else if (kept) {
+                captured[k] += num_moved;
+            } else {
+                dropped += num_moved;
+            }
+        }
+    }
+
+    for (int k = 0; k < 2; k++) {
+        if (files[k] != -1) {
+            close(files[k]);
+        }
+    }
+    close(null_fd);
+}
+
+/**
+ * Write " output stdout_bytes stderr_bytes dropped_bytes" for the end request
+ * @param[out] buffer Empty without "--capture"
+ * @param[in] size
+ */
+void capture_usage(char *buffer, size_t size) {
+    buffer[0] = '\0';
+
+    if (capture) {
+        snprintf(buffer, size, " output %ld %ld %ld", captured[0], captured[1], dropped);
+    }
+}
+
+/**
+ * Read a list of cores like "0-3,6" into run_cpus
+ * @param[in] list
+ * @param[out] result 0 on success -1 if the list isn't valid or has no core the run may use
+ */
+int parse_cpus(char *list) {
+    CPU_ZERO(&run_cpus);
+
+    while (*list != '\0') {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+
+        for (long c = first; c <= last; c++) {
+            CPU_SET(c, &run_cpus);
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+
+    // Cores the tracer itself can't run on can't be given to the run either
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        CPU_AND(&allowed, &allowed, &run_cpus);
+        if (CPU_COUNT(&allowed) == 0) {
+            return -1;
+        }
+    }
+
+    pinned = CPU_COUNT(&run_cpus) > 0;
+    return pinned ? 0 : -1;
+}
+
+/**
+ * Pin a child that was just forked to the cores of the run, before it execs
+ * so the program never runs anywhere else
+ */
+void cpus_enter() {
+    if (!pinned) {
+        return;
+    }
+
+    if (sched_setaffinity(0, sizeof(run_cpus), &run_cpus) == -1) {
+        // Debug: the cores may not exist or not be allowed
+        perror("sched_setaffinity");
+        _exit(1);
+    }
+}
+
+/**
+ * Write " cpus mask" for the start request, a bit for each of the first
+ * MAX_PLACED_CORES cores the run is pinned to
+ * @param[out] buffer Empty without "--cpus"
+ * @param[in] size
+ */
+void cpus_usage(char *buffer, size_t size) {
+    buffer[0] = '\0';
+
+    unsigned long mask = 0;
+    for (int c = 0; pinned && c < MAX_PLACED_CORES; c++) {
+        if (CPU_ISSET(c, &run_cpus)) {
+            mask |= 1UL << c;
+        }
+    }
+
+    if (mask != 0) {
+        snprintf(buffer, size, " cpus %lx", mask);
+    }
+}
 
 /**
  * Execute a single program given the request "execute -u"
@@ -18,6 +728,20 @@
  */
 void execute_program(char *program, char **args) {
 
+    // Runs the monitor doesn't sample run all the same, it's just not told about them
+    long weight = sample_run(program);
+
+    tree_prepare();
+    capture_prepare();
+
+    int go[2];
+    int perf_fds[PERF_COUNTERS];
+    if (perf && pipe(go) == -1) {
+        // Debug: pipe failed
+        perror("pipe");
+        _exit(1);
+    }
+
     // Execute program
     int pid = fork();
 
@@ -25,35 +749,427 @@ void execute_program(char *program, char **args) {
 
     int num_written;
 
-    if(pid == 0){
+    if(pid == 0){
+
+        // Child process
+        tree_enter();
+        cpus_enter();
+        capture_enter(1);
+        perf_hold(go);
+        execvp(program, args);
+
+        // Debug: execvp failed 
+        perror("execvp");
+        _exit(1);
+
+    } else if (pid > 0) {
+
+        // Parent process
+        perf_open(pid, go, perf_fds);
+
+        num_written = snprintf(buffer, BUFFER_SIZE, "Running PID %d\n", pid);
+        
+        if (num_written < 0 || num_written >= BUFFER_SIZE) {
+            // Debug: message formatting failed
+            perror("Formatting message!");
+            _exit(1);
+        }
+
+        if (write(1, buffer, num_written) != num_written) {
+            // Debug: Writing failed
+            perror("Writing");
+            _exit(1);
+        }
+
+
+        struct timeval start_time;
+        gettimeofday(&start_time, NULL);
+
+        long start_to_send = start_time.tv_sec * 1000 + start_time.tv_usec / 1000;
+
+        int server_fd = -1;
+
+        if (weight > 0) {
+            // Send start information to server
+            server_fd = open(server_pipe_for(pid), O_WRONLY);
+
+            if (server_fd == -1) {
+                // Debug: opening failed
+                perror("Error opening server pipe");
+                _exit(1);
+            }
+
+            char placement[BUFFER_SIZE];
+            cpus_usage(placement, BUFFER_SIZE);
+
+            char sample[BUFFER_SIZE];
+            sample_usage(sample, BUFFER_SIZE, weight);
+
+            num_written = timeout > 0 ? snprintf(buffer, BUFFER_SIZE, "start %d %s %ld%s%s timeout %ld\n", pid, program, start_to_send, placement, sample, timeout)
+                : snprintf(buffer, BUFFER_SIZE, "start %d %s %ld%s%s\n", pid, program, start_to_send, placement, sample);
+
+            if (num_written < 0 || num_written >= BUFFER_SIZE) {
+                // Debug: message formatting failed
+                perror("Formatting message!");
+                _exit(1);
+            }
+
+            if (write(server_fd, buffer, num_written) != num_written) {
+                // Debug: writing failed
+                perror("Writing");
+                _exit(1);
+            }
+
+            close(server_fd);
+        }
+
+        capture_drain(pid);
+
+        int status;
+        waitpid(pid, &status, 0);
+        tree_wait();
+        perf_collect(perf_fds);
+
+        char usage[BUFFER_SIZE];
+        tree_usage(usage, BUFFER_SIZE);
+
+        char counters[BUFFER_SIZE];
+        perf_usage(counters, BUFFER_SIZE);
+
+        char output[BUFFER_SIZE];
+        capture_usage(output, BUFFER_SIZE);
+
+        struct timeval end_time;
+        gettimeofday(&end_time, NULL);
+
+        long end_to_send = end_time.tv_sec * 1000 + end_time.tv_usec / 1000;
+
+        long elapsed_time = end_to_send - start_to_send;
+
+        // A run stopped for passing its timeout ends by a signal
+        if (WIFSIGNALED(status)) {
+            num_written = snprintf(buffer, BUFFER_SIZE, "Ended in %ld ms, killed by signal %d\n", elapsed_time, WTERMSIG(status));
+        } else {
+            num_written = snprintf(buffer, BUFFER_SIZE, "Ended in %ld ms\n", elapsed_time);
+        }
+        
+        if (num_written < 0 || num_written >= BUFFER_SIZE) {
+            // Debug: message formatting failed
+            perror("Formatting message!");
+            _exit(1);
+        }
+
+        if (write(1, buffer, num_written) != num_written) {
+            // Debug: writing failed
+            perror("Writing");
+            _exit(1);
+        }
+
+        // Send end information to server, unless it never heard of the run
+
+        if (weight == 0) {
+            return;
+        }
+
+        server_fd = open(server_pipe_for(pid), O_WRONLY);
+
+        if (server_fd == -1) {
+            // Debug: opening failed
+            perror("Error opening server pipe");
+            _exit(1);
+        }
+
+        num_written = snprintf(buffer, BUFFER_SIZE,  "end %d %ld%s%s%s\n", pid, end_to_send, usage, counters, output);
+        
+        if (num_written < 0 || num_written >= BUFFER_SIZE) {
+            // Debug: message formatting failed
+            perror("Formatting message!");
+            _exit(1);
+        }
+
+        if (write(server_fd, buffer, num_written) != num_written) {
+            // Debug: writing failed
+            perror("Writing");
+            _exit(1);
+        }
+        
+        close(server_fd);
+        
+    } else {
+        // Debug: fork failed
+        perror ("fork");
+        _exit(1);
+    }
+}
+
+/**
+ * Hand a program or a pipeline to the monitor, which runs it when there's room
+ * for it, given the request "submit [-p priority] -u | -p"
+ * @param[in] priority Higher runs first, jobs gain a level for every second they wait
+ * @param[in] mode 'u' for a program and its arguments, 'p' for a pipeline
+ * @param[in] args Program and arguments, or the pipeline
+ * @param[in] num_args
+ */
+void submit_job(int priority, char mode, char **args, int num_args) {
+
+    char buffer[PIPE_BUF];
+
+    int num_written = snprintf(buffer, PIPE_BUF, "submit %d %c", priority, mode);
+
+    for (int i = 0; i < num_args && num_written > 0 && num_written < PIPE_BUF; i++) {
+        num_written += snprintf(buffer + num_written, PIPE_BUF - num_written, " %s", args[i]);
+    }
+
+    if (num_written > 0 && num_written < PIPE_BUF) {
+        num_written += snprintf(buffer + num_written, PIPE_BUF - num_written, "\n");
+    }
+
+    if (num_written < 0 || num_written >= PIPE_BUF) {
+        // Debug: message formatting failed
+        perror("Formatting message!");
+        _exit(1);
+    }
+
+    int server_fd = open(SERVER_PIPE_NAME, O_WRONLY);
+
+    if (server_fd == -1) {
+        // Debug: opening failed
+        perror("Error opening server pipe");
+        _exit(1);
+    }
+
+    // One write so it can't mix with other clients
+    if (write(server_fd, buffer, num_written) != num_written) {
+        // Debug: writing failed
+        perror("Writing");
+        _exit(1);
+    }
+
+    close(server_fd);
+
+    num_written = snprintf(buffer, PIPE_BUF, "Submitted with priority %d\n", priority);
+
+    if (write(1, buffer, num_written) != num_written) {
+        // Debug: writing failed
+        perror("Writing");
+        _exit(1);
+    }
+}
+
+/**
+ * Pass a signal the tracer got on to the stages of its pipeline, they're in a
+ * process group of their own
+ * @param[in] signum
+ */
+void forward_signal(int signum) {
+    if (pipeline_group > 0) {
+        kill(-pipeline_group, signum);
+    }
+}
+
+/**
+ * Execute a pipeline given the request "execute -p" followed by the arguments in between "".
+ * Every stage is forked and wired first and held at a barrier, a pipe whose
+ * writing end the tracer closes to let them all go at once. The start time is
+ * taken then, and the monitor is told after, when the stages already run.
+ * The stages share a process group named after the first one, so the monitor
+ * stops all of them when the run passes its timeout
+ * @param[in] pipeline 
+ */
+void execute_pipeline(char *pipeline) {
+
+    // Split pipeline into programs
+
+    int pid_for_end = -1;
+    
+    char buffer[BUFFER_SIZE];
+
+    int num_written;
+
+    struct timeval start_time;
 
-        // Child process
-        execvp(program, args);
+    long start_to_send;
 
-        // Debug: execvp failed 
-        perror("execvp");
+    char *programs[MAX_STAGES];
+
+    int num_programs = 0;
+
+    // Runs the monitor doesn't sample run all the same, it's just not told about them
+    long weight = sample_run(pipeline);
+
+    char *program = strtok(pipeline, "|");
+
+    while (program != NULL && num_programs < MAX_STAGES) {
+        programs[num_programs++] = program;
+        program = strtok(NULL, "|");
+    }
+
+    // The pipes and counters are sized by the stages, there must be some and not too many
+    if (num_programs == 0 || program != NULL) {
+        num_written = snprintf(buffer, BUFFER_SIZE, "A pipeline needs between 1 and %d programs\n", MAX_STAGES);
+        if (write(2, buffer, num_written) != num_written) {
+            // Debug: writing failed
+            perror("Writing");
+        }
         _exit(1);
+    }
 
-    } else if (pid > 0) {
+    int pipes[num_programs - 1][2];
 
-        // Parent process
-        num_written = snprintf(buffer, BUFFER_SIZE, "Running PID %d\n", pid);
+    // Counters of every stage, added up once they all exited
+    int perf_fds[num_programs][PERF_COUNTERS];
+
+    tree_prepare();
+    capture_prepare();
+
+    for (int i = 0; i < num_programs - 1; i++) {
+
+        if (pipe(pipes[i]) == -1) {
+            // Debug: pipe failed
+            perror("pipe");
+            _exit(1);
+        }   
+    }
+
+    // The tracer may be stopped while the stages are in their own group
+    signal(SIGINT, forward_signal);
+    signal(SIGTERM, forward_signal);
+    signal(SIGHUP, forward_signal);
+
+    // Waited for by pid, a subreaper tracer also gets the descendants they leave behind
+    int stage_pids[num_programs];
+
+    // Nothing is ever written to it, the stages read it until it's closed
+    int barrier[2];
+    if (pipe2(barrier, O_CLOEXEC) == -1) {
+        // Debug: pipe failed
+        perror("pipe");
+        _exit(1);
+    }
+
+    for (int i = 0; i < num_programs; i++) {
         
-        if (num_written < 0 || num_written >= BUFFER_SIZE) {
-            // Debug: message formatting failed
-            perror("Formatting message!");
+        char *program = programs[i];
+        char *args[1024];
+        int num_args = 0;
+        char *arg = strtok(program, " ");
+
+        while (arg != NULL) {
+            args[num_args++] = arg;
+            arg = strtok(NULL, " ");
+        }
+
+        args[num_args] = NULL;
+
+        int go[2];
+        if (perf && pipe(go) == -1) {
+            // Debug: pipe failed
+            perror("pipe");
             _exit(1);
         }
 
-        if (write(1, buffer, num_written) != num_written) {
-            // Debug: Writing failed
-            perror("Writing");
+        int pid = fork();
+
+        if (pid == 0) {
+
+            // Child process, the first one starts the group of the pipeline
+            setpgid(0, i == 0 ? 0 : pid_for_end);
+
+            if (i > 0) {
+                dup2(pipes[i - 1][0], 0);
+            }
+
+            if (i < num_programs - 1) {
+                dup2(pipes[i][1], 1);
+            }
+
+            for (int j = 0; j < num_programs - 1; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
+
+            tree_enter();
+            cpus_enter();
+            capture_enter(i == num_programs - 1);
+            perf_hold(go);
+
+            // Wait for the other stages
+            char released;
+            close(barrier[1]);
+            if (read(barrier[0], &released, 1) == -1) {
+                // Debug: reading failed, it goes without waiting
+                perror("Reading");
+            }
+            close(barrier[0]);
+
+            execvp(args[0], args);
+
+            // Debug: execvp failed
+            perror("execvp");
+
+            _exit(1);
+
+        } else if (pid > 0) {
+
+            // Parent process
+            perf_open(pid, go, perf_fds[i]);
+
+            if (i == 0) {
+                pid_for_end = pid;
+                pipeline_group = pid;
+            }
+            stage_pids[i] = pid;
+
+            // Also here, whichever of the two runs first
+            setpgid(pid, pid_for_end);
+
+        } else {
+            // Debug: fork failed
+            perror ("fork");
             _exit(1);
         }
+    }
+
+
+    for (int i = 0; i < num_programs - 1; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+
+    // The stages take the terminal while they run, so they can read it and get its signals
+    int foreground = isatty(0) && tcgetpgrp(0) == getpgrp();
+    if (foreground) {
+        signal(SIGTTOU, SIG_IGN);
+        tcsetpgrp(0, pipeline_group);
+    }
 
+    // Every stage exists, they start together now
+    gettimeofday(&start_time, NULL);
+    close(barrier[1]);
+    close(barrier[0]);
 
+    start_to_send = start_time.tv_sec * 1000 + start_time.tv_usec / 1000;
+
+    num_written = snprintf(buffer, BUFFER_SIZE, "Running PID %d\n", pid_for_end);
+
+    if (num_written < 0 || num_written >= BUFFER_SIZE) {
+        // Debug: message formatting failed
+        perror("Formatting message!");
+        _exit(1);
+    }
+
+    if (write(1, buffer, num_written) != num_written) {
+        // Debug: writing failed
+        perror("Writing");
+        _exit(1);
+    }
+
+    int server_fd = -1;
+
+    if (weight > 0) {
         // Send start information to server
-        int server_fd = open(SERVER_PIPE_NAME, O_WRONLY);
+
+        server_fd = open(server_pipe_for(pid_for_end), O_WRONLY);
 
         if (server_fd == -1) {
             // Debug: opening failed
@@ -61,13 +1177,16 @@ void execute_program(char *program, char **args) {
             _exit(1);
         }
 
-        struct timeval start_time;
-        gettimeofday(&start_time, NULL);
+        char placement[BUFFER_SIZE];
+        cpus_usage(placement, BUFFER_SIZE);
 
-        long start_to_send = start_time.tv_sec * 1000 + start_time.tv_usec / 1000;
+        char sample[BUFFER_SIZE];
+        sample_usage(sample, BUFFER_SIZE, weight);
+
+        // " pipeline" tells the monitor the stages are in the process group named after the pid
+        num_written = timeout > 0 ? snprintf(buffer, BUFFER_SIZE, "start %d %s %ld pipeline%s%s timeout %ld\n", pid_for_end, pipeline, start_to_send, placement, sample, timeout)
+            : snprintf(buffer, BUFFER_SIZE, "start %d %s %ld pipeline%s%s\n", pid_for_end, pipeline, start_to_send, placement, sample);
 
-        num_written = snprintf(buffer, BUFFER_SIZE, "start %d %s %ld\n", pid, program, start_to_send);
-        
         if (num_written < 0 || num_written >= BUFFER_SIZE) {
             // Debug: message formatting failed
             perror("Formatting message!");
@@ -79,262 +1198,619 @@ void execute_program(char *program, char **args) {
             perror("Writing");
             _exit(1);
         }
-        
+
         close(server_fd);
+    }
+
+    // The output of the last stage and the errors of every one
+    capture_drain(pid_for_end);
 
+    // The pipeline ends the way its last stage does, like in a shell
+    int last_status = 0;
+    for (int i = 0; i < num_programs; i++) {
         int status;
-        waitpid(pid, &status, 0);
+        if (waitpid(stage_pids[i], &status, 0) == stage_pids[i] && i == num_programs - 1) {
+            last_status = status;
+        }
+    }
+    tree_wait();
 
-        struct timeval end_time;
-        gettimeofday(&end_time, NULL);
+    if (foreground) {
+        tcsetpgrp(0, getpgrp());
+    }
 
-        long end_to_send = end_time.tv_sec * 1000 + end_time.tv_usec / 1000;
+    for (int i = 0; i < num_programs; i++) {
+        perf_collect(perf_fds[i]);
+    }
+
+    char usage[BUFFER_SIZE];
+    tree_usage(usage, BUFFER_SIZE);
+
+    char counters[BUFFER_SIZE];
+    perf_usage(counters, BUFFER_SIZE);
+
+    char output[BUFFER_SIZE];
+    capture_usage(output, BUFFER_SIZE);
+
+    struct timeval end_time;
+    gettimeofday(&end_time, NULL);
+
+    long end_to_send = end_time.tv_sec * 1000 + end_time.tv_usec / 1000;
+
+    long elapsed_time = end_to_send - start_to_send;
+
+    // A pipeline stopped for passing its timeout ends by a signal
+    if (WIFSIGNALED(last_status)) {
+        num_written = snprintf(buffer, BUFFER_SIZE, "Ended in %ld ms, killed by signal %d\n", elapsed_time, WTERMSIG(last_status));
+    } else {
+        num_written = snprintf(buffer, BUFFER_SIZE, "Ended in %ld ms\n", elapsed_time);
+    }
+    
+    if (num_written < 0 || num_written >= BUFFER_SIZE) {
+        // Debug: message formatting failed
+        perror("Formatting message!");
+        _exit(1);
+    }
+
+    if (write(1, buffer, num_written) != num_written) {
+        // Debug: writing failed
+        perror("Writing");
+        _exit(1);
+    }
+
+    // Send information to server, unless it never heard of the run
+
+    if (weight == 0) {
+        return;
+    }
+
+    server_fd = open(server_pipe_for(pid_for_end), O_WRONLY);
+
+    if (server_fd == -1) {
+        // Debug: opening failed
+        perror("Error opening server pipe");
+        _exit(1);
+    }
+
+    num_written = snprintf(buffer, BUFFER_SIZE, "end %d %ld%s%s%s\n", pid_for_end, end_to_send, usage, counters, output);
+    
+    if (num_written < 0 || num_written >= BUFFER_SIZE) {
+        // Debug: message formatting failed
+        perror("Formatting message!");
+        _exit(1);
+    }
+
+    if (write(server_fd, buffer, num_written) != num_written) {
+        // Debug: writing failed
+        perror("Writing");
+        _exit(1);
+    }
+    
+    close(server_fd);
+}
+
+/**
+ * Send a stats request followed by a list of pids and pid ranges (like "1000-5000").
+ * Lists that fit in one atomic pipe write go inline, longer ones (or "-", that reads
+ * the pids from stdin) are streamed to the monitor through a fifo of their own
+ * @param[in] request Request and arguments before the pids, like "stats-command ls"
+ * @param[in] pids
+ * @param[in] num_pids
+ */
+void send_pid_request(char *request, char **pids, int num_pids) {
+
+    char buffer[PIPE_BUF];
+
+    int num_written;
+
+    int stream = 0;
+
+    size_t length = strlen(request) + 1;
+
+    for (int i = 0; i < num_pids; i++) {
+        length += strlen(pids[i]) + 1;
+        if (strcmp(pids[i], "-") == 0) {
+            stream = 1;
+        }
+    }
+
+    if (length > PIPE_BUF) {
+        stream = 1;
+    }
+
+    char stream_name[BUFFER_SIZE];
+    snprintf(stream_name, BUFFER_SIZE, PID_STREAM_NAME, getpid());
+
+    if (stream) {
+        unlink(stream_name);
+        if (mkfifo(stream_name, 0666) == -1) {
+            // Debug: mkfifo failed
+            perror("mkfifo");
+            _exit(1);
+        }
+    }
+
+    int server_fd = open(SERVER_PIPE_NAME, O_WRONLY);
+
+    if (server_fd == -1) {
+        // Debug: opening failed
+        perror("Error opening server pipe");
+        _exit(1);
+    }
+
+    // Send the whole request line with one write so it can't mix with other clients
+    if (stream) {
+        num_written = snprintf(buffer, PIPE_BUF, "%s %c%s\n", request, PID_STREAM_PREFIX, stream_name);
+    } else {
+        num_written = snprintf(buffer, PIPE_BUF, "%s", request);
+        for (int i = 0; i < num_pids; i++) {
+            num_written += snprintf(buffer + num_written, PIPE_BUF - num_written, " %s", pids[i]);
+        }
+        num_written += snprintf(buffer + num_written, PIPE_BUF - num_written, "\n");
+    }
+
+    if (num_written < 0 || num_written >= PIPE_BUF) {
+        // Debug: message formatting failed
+        perror("Formatting message!");
+        _exit(1);
+    }
+
+    if (write(server_fd, buffer, num_written) != num_written) {
+        // Debug: writing failed
+        perror("Writing");
+        _exit(1);
+    }
+
+    close(server_fd);
+
+    if (!stream) {
+        return;
+    }
+
+    // Stream the pids, a buffer full at a time
+    int stream_fd = open(stream_name, O_WRONLY);
+
+    if (stream_fd == -1) {
+        // Debug: opening failed
+        perror("Error opening pid stream");
+        _exit(1);
+    }
+
+    num_written = 0;
+
+    for (int i = 0; i < num_pids; i++) {
+
+        if (strcmp(pids[i], "-") == 0) {
+
+            if (num_written > 0 && write(stream_fd, buffer, num_written) != num_written) {
+                // Debug: writing failed
+                perror("Writing");
+                _exit(1);
+            }
+            num_written = 0;
 
-        long elapsed_time = end_to_send - start_to_send;
+            ssize_t bytes_read;
 
-        num_written = snprintf(buffer, BUFFER_SIZE, "Ended in %ld ms\n", elapsed_time);
-        
-        if (num_written < 0 || num_written >= BUFFER_SIZE) {
-            // Debug: message formatting failed
-            perror("Formatting message!");
-            _exit(1);
-        }
+            while ((bytes_read = read(0, buffer, PIPE_BUF)) > 0) {
+                if (write(stream_fd, buffer, bytes_read) != bytes_read) {
+                    // Debug: writing failed
+                    perror("Writing");
+                    _exit(1);
+                }
+            }
 
-        if (write(1, buffer, num_written) != num_written) {
-            // Debug: writing failed
-            perror("Writing");
-            _exit(1);
+            buffer[num_written++] = ' ';
+            continue;
         }
 
-        // Send end information to server
-
-        server_fd = open(SERVER_PIPE_NAME, O_WRONLY);
+        size_t pid_length = strlen(pids[i]) + 1;
 
-        if (server_fd == -1) {
-            // Debug: opening failed
-            perror("Error opening server pipe");
-            _exit(1);
+        if (num_written + pid_length > PIPE_BUF) {
+            if (write(stream_fd, buffer, num_written) != num_written) {
+                // Debug: writing failed
+                perror("Writing");
+                _exit(1);
+            }
+            num_written = 0;
         }
 
-        num_written = snprintf(buffer, BUFFER_SIZE,  "end %d %ld\n", pid, end_to_send);
-        
-        if (num_written < 0 || num_written >= BUFFER_SIZE) {
-            // Debug: message formatting failed
-            perror("Formatting message!");
-            _exit(1);
+        if (pid_length <= PIPE_BUF) {
+            memcpy(buffer + num_written, pids[i], pid_length - 1);
+            num_written += pid_length;
+            buffer[num_written - 1] = ' ';
         }
+    }
 
-        if (write(server_fd, buffer, num_written) != num_written) {
-            // Debug: writing failed
-            perror("Writing");
-            _exit(1);
-        }
-        
-        close(server_fd);
-        
-    } else {
-        // Debug: fork failed
-        perror ("fork");
+    if (num_written > 0 && write(stream_fd, buffer, num_written) != num_written) {
+        // Debug: writing failed
+        perror("Writing");
         _exit(1);
     }
+
+    close(stream_fd);
+    unlink(stream_name);
 }
 
 /**
- * Execute a pipeline given the request "execute -p" followed by the arguments in between ""
- * @param[in] pipeline 
+ * Remove the watch fifo when the tracer is interrupted
+ * @param[in] signum
  */
-void execute_pipeline(char *pipeline) {
+void stop_watching(int signum) {
+    (void) signum;
+    unlink(watch_name);
+    _exit(0);
+}
 
-    // Split pipeline into programs
+/**
+ * Watch the status given the request "status --watch [interval]". The monitor is
+ * asked once and then pushes deltas, the elapsed times are updated here on each tick
+ * @param[in] interval Milliseconds between updates
+ */
+void watch_status(long interval) {
 
-    int pid_for_end;
-    
     char buffer[BUFFER_SIZE];
 
     int num_written;
 
-    struct timeval start_time;
+    snprintf(watch_name, BUFFER_SIZE, WATCH_PIPE_NAME, getpid());
+    unlink(watch_name);
 
-    long start_to_send;
+    if (mkfifo(watch_name, 0666) == -1) {
+        // Debug: mkfifo failed
+        perror("mkfifo");
+        _exit(1);
+    }
 
-    char *programs[1024];
+    signal(SIGINT, stop_watching);
+    signal(SIGTERM, stop_watching);
 
-    int num_programs = 0;
+    // Open for reading first so the monitor can open it without waiting
+    int watch_fd = open(watch_name, O_RDONLY | O_NONBLOCK);
 
-    char *program = strtok(pipeline, "|");
+    if (watch_fd == -1) {
+        // Debug: opening failed
+        perror("Opening watch pipe");
+        _exit(1);
+    }
 
-    while (program != NULL) {
-        programs[num_programs++] = program;
-        program = strtok(NULL, "|");
+    int server_fd = open(SERVER_PIPE_NAME, O_WRONLY);
+
+    if (server_fd == -1) {
+        // Debug: opening failed
+        perror("Error opening server pipe");
+        stop_watching(0);
     }
 
-    int pipes[num_programs - 1][2];
+    num_written = snprintf(buffer, BUFFER_SIZE, "watch %s %ld\n", watch_name, interval);
 
-    for (int i = 0; i < num_programs - 1; i++) {
+    if (num_written < 0 || num_written >= BUFFER_SIZE) {
+        // Debug: message formatting failed
+        perror("Formatting message!");
+        stop_watching(0);
+    }
 
-        if (pipe(pipes[i]) == -1) {
-            // Debug: pipe failed
-            perror("pipe");
-            _exit(1);
-        }   
+    if (write(server_fd, buffer, num_written) != num_written) {
+        // Debug: writing failed
+        perror("Writing");
+        stop_watching(0);
     }
 
-    for (int i = 0; i < num_programs; i++) {
-        
-        char *program = programs[i];
-        char *args[1024];
-        int num_args = 0;
-        char *arg = strtok(program, " ");
+    close(server_fd);
 
-        while (arg != NULL) {
-            args[num_args++] = arg;
-            arg = strtok(NULL, " ");
-        }
+    // Wait for the monitor to open its end
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET(watch_fd, &read_set);
+    select(watch_fd + 1, &read_set, NULL, NULL, NULL);
 
-        args[num_args] = NULL;
+    fcntl(watch_fd, F_SETFL, fcntl(watch_fd, F_GETFL) & ~O_NONBLOCK);
 
-        int pid = fork();
+    struct Watched *watched = NULL;
+    int num_watched = 0;
+    int max_watched = 0;
 
-        if (pid == 0) {
+    long last_print = 0;
 
-            // Child process
-            if (i > 0) {
-                dup2(pipes[i - 1][0], 0);
-            }
+    char line[BUFFER_SIZE];
+    int line_len = 0;
 
-            if (i < num_programs - 1) {
-                dup2(pipes[i][1], 1);
-            }
+    ssize_t bytes_read;
 
-            for (int j = 0; j < num_programs - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
+    while ((bytes_read = read(watch_fd, buffer, BUFFER_SIZE)) > 0) {
 
-            execvp(args[0], args);
+        for (int i = 0; i < bytes_read; i++) {
 
-            // Debug: execvp failed
-            perror("execvp");
+            if (buffer[i] != '\n') {
+                if (line_len < BUFFER_SIZE - 1) {
+                    line[line_len++] = buffer[i];
+                }
+                continue;
+            }
 
-            _exit(1);
+            line[line_len] = '\0';
+            line_len = 0;
 
-        } else if (pid > 0) {
+            char name[BUFFER_SIZE];
+            int pid;
+            long time;
 
-            // Parent process
-            if (i == 0) {
+            num_written = 0;
 
-                pid_for_end = pid;
+            if (sscanf(line, "+ %d %1023s %ld", &pid, name, &time) == 3) {
 
-                num_written = snprintf(buffer, BUFFER_SIZE, "Running PID %d\n", pid);
-        
-                if (num_written < 0 || num_written >= BUFFER_SIZE) {
-                    // Debug: message formatting failed
-                    perror("Formatting message!");
-                    _exit(1);
+                if (num_watched == max_watched) {
+                    max_watched = max_watched == 0 ? 64 : max_watched * 2;
+                    watched = realloc(watched, max_watched * sizeof(struct Watched));
                 }
+                watched[num_watched].pid = pid;
+                watched[num_watched].name = strdup(name);
+                watched[num_watched].start_time = time;
+                num_watched++;
 
-                if (write(1, buffer, num_written) != num_written) {
-                    // Debug: writing failed
-                    perror("Writing");
-                    _exit(1);
+                num_written = snprintf(line, BUFFER_SIZE, "Started PID %d %s\n", pid, name);
+
+            } else if (sscanf(line, "- %d %1023s %ld", &pid, name, &time) == 3) {
+
+                for (int j = 0; j < num_watched; j++) {
+                    if (watched[j].pid == pid) {
+                        free(watched[j].name);
+                        watched[j] = watched[--num_watched];
+                        break;
+                    }
                 }
 
-                // Send start information to server
+                num_written = snprintf(line, BUFFER_SIZE, "Ended PID %d %s in %ld ms\n", pid, name, time);
 
-                int server_fd = open(SERVER_PIPE_NAME, O_WRONLY);
+            } else if (strcmp(line, "resync") == 0) {
 
-                if (server_fd == -1) {
-                    // Debug: opening failed
-                    perror("Error opening server pipe");
-                    _exit(1);
+                // The monitor dropped deltas, a new snapshot follows
+                for (int j = 0; j < num_watched; j++) {
+                    free(watched[j].name);
                 }
+                num_watched = 0;
 
-                gettimeofday(&start_time, NULL);
+            } else if (sscanf(line, "tick %ld", &time) == 1 && time - last_print >= interval) {
 
-                start_to_send = start_time.tv_sec * 1000 + start_time.tv_usec / 1000;
+                // A sharded monitor sends one tick per shard, only the first one prints
+                last_print = time;
 
-                num_written = snprintf(buffer, BUFFER_SIZE, "start %d %s %ld\n", pid, pipeline, start_to_send);
-                
-                if (num_written < 0 || num_written >= BUFFER_SIZE) {
-                    // Debug: message formatting failed
-                    perror("Formatting message!");
-                    _exit(1);
-                }
+                for (int j = 0; j < num_watched; j++) {
+                    num_written = snprintf(line, BUFFER_SIZE, "%d %s %ld \n", watched[j].pid, watched[j].name, time - watched[j].start_time);
 
-                if (write(server_fd, buffer, num_written) != num_written) {
-                    // Debug: writing failed
-                    perror("Writing");
-                    _exit(1);
+                    if (num_written > 0 && num_written < BUFFER_SIZE && write(1, line, num_written) != num_written) {
+                        // Debug: writing failed
+                        perror("Writing");
+                        stop_watching(0);
+                    }
                 }
-                
-                close(server_fd);
-            
+
+                num_written = snprintf(line, BUFFER_SIZE, "\n");
             }
 
-        } else {
-            // Debug: fork failed
-            perror ("fork");
+            if (num_written > 0 && num_written < BUFFER_SIZE && write(1, line, num_written) != num_written) {
+                // Debug: writing failed
+                perror("Writing");
+                stop_watching(0);
+            }
+        }
+    }
+
+    close(watch_fd);
+    unlink(watch_name);
+}
+
+/**
+ * Copy the answer of the monitor to the request just sent to stdout
+ * @param[out] busy 1 if the monitor answered busy and nothing was printed
+ */
+int print_answer() {
+
+    char buffer[BUFFER_SIZE];
+
+    int client_fd = open(CLIENT_PIPE_NAME, O_RDONLY);
+
+    if (client_fd == -1) {
+        // Debug: opening failed
+        perror("Opening client pipe");
+        _exit(1);
+    }
+
+    ssize_t bytes_read;
+
+    // Busy answers are held back until something else shows up, answers
+    // written at the same time can arrive together
+    char held[BUFFER_SIZE];
+    size_t num_held = 0;
+    size_t busy_length = strlen(BUSY_ANSWER);
+    int only_busy = 1;
+
+    while ((bytes_read = read(client_fd, buffer, sizeof(buffer))) > 0) {
+
+        if (only_busy) {
+            for (ssize_t i = 0; i < bytes_read && only_busy; i++) {
+                only_busy = buffer[i] == BUSY_ANSWER[(num_held + i) % busy_length];
+            }
+            if (only_busy && num_held + bytes_read <= sizeof(held)) {
+                memcpy(held + num_held, buffer, bytes_read);
+                num_held += bytes_read;
+                continue;
+            }
+            only_busy = 0;
+            if (write(1, held, num_held) != (ssize_t) num_held) {
+                // Debug: writing failed
+                perror("Writing");
+                _exit(1);
+            }
+            num_held = 0;
+        }
+
+        if (write(1, buffer, bytes_read) != bytes_read) {
+            // Debug: writing failed
+            perror("Writing");
             _exit(1);
         }
     }
 
+    if (bytes_read == -1) {
+        // Debug: reading failed
+        perror("Reading");
+        _exit(1);
+    }
 
-    for (int i = 0; i < num_programs - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+    close(client_fd);
+
+    if (only_busy && num_held > 0 && num_held % busy_length == 0) {
+        return 1;
     }
 
-    for (int i = 0; i < num_programs; i++) {
-        int status;
-        wait(&status);
+    if (write(1, held, num_held) != (ssize_t) num_held) {
+        // Debug: writing failed
+        perror("Writing");
+        _exit(1);
     }
 
-    struct timeval end_time;
-    gettimeofday(&end_time, NULL);
+    return 0;
+}
 
-    long end_to_send = end_time.tv_sec * 1000 + end_time.tv_usec / 1000;
+/**
+ * Wait before a query is sent again to a busy monitor, twice
+ * as long each attempt up to BUSY_BACKOFF_MAX and with some jitter so the
+ * tracers that were turned away together don't come back together
+ * @param[in] attempt Attempts that got a busy answer before this one
+ */
+void back_off(int attempt) {
+    if (attempt + 1 >= BUSY_RETRIES) {
+        char *message = "Monitor is busy, try again later\n";
+        if (write(2, message, strlen(message)) == -1) {
+            // Debug: writing failed
+            perror("Writing");
+        }
+        _exit(1);
+    }
 
-    long elapsed_time = end_to_send - start_to_send;
+    long delay = BUSY_BACKOFF;
+    for (int i = 0; i < attempt && delay < BUSY_BACKOFF_MAX; i++) {
+        delay *= 2;
+    }
+    if (delay > BUSY_BACKOFF_MAX) {
+        delay = BUSY_BACKOFF_MAX;
+    }
+
+    srand(getpid() ^ attempt);
+    delay = delay / 2 + rand() % (delay / 2 + 1);
+    usleep(delay * 1000);
+}
+
+/**
+ * Send a request that fits in one line and copy the answer of the monitor to stdout,
+ * sending it again later while the monitor is busy
+ * @param[in] request Request without the newline
+ */
+void request_and_print(char *request) {
+
+    char buffer[BUFFER_SIZE];
+
+    int num_written = snprintf(buffer, BUFFER_SIZE, "%s\n", request);
 
-    num_written = snprintf(buffer, BUFFER_SIZE, "Ended in %ld ms\n", elapsed_time);
-    
     if (num_written < 0 || num_written >= BUFFER_SIZE) {
         // Debug: message formatting failed
         perror("Formatting message!");
         _exit(1);
     }
 
-    if (write(1, buffer, num_written) != num_written) {
-        // Debug: writing failed
-        perror("Writing");
+    for (int attempt = 0; ; attempt++) {
+
+        int server_fd = open(SERVER_PIPE_NAME, O_WRONLY);
+
+        if (server_fd == -1) {
+            // Debug: opening failed
+            perror("Error opening server pipe");
+            _exit(1);
+        }
+
+        if (write(server_fd, buffer, num_written) != num_written) {
+            // Debug: writing failed
+            perror("Writing");
+            _exit(1);
+        }
+
+        close(server_fd);
+
+        // Receive response from server
+        if (print_answer() == 0) {
+            break;
+        }
+
+        back_off(attempt);
+    }
+}
+
+/**
+ * Ask the monitor which core to pin the run to, given "--cpus round-robin"
+ * or "--cpus least-loaded". The answer comes through a fifo of this tracer,
+ * so runs launched together don't take each other's core. Without an answer
+ * in PLACE_TIMEOUT milliseconds, or a core in it, the run isn't pinned
+ * @param[in] policy
+ */
+void ask_placement(char *policy) {
+
+    char buffer[BUFFER_SIZE];
+
+    char place_name[BUFFER_SIZE];
+    snprintf(place_name, BUFFER_SIZE, PLACE_PIPE_NAME, getpid());
+    unlink(place_name);
+
+    if (mkfifo(place_name, 0666) == -1) {
+        // Debug: mkfifo failed
+        perror("mkfifo");
         _exit(1);
     }
 
-    // Send information to server
+    // Open for reading first so the monitor can open it without waiting
+    int place_fd = open(place_name, O_RDONLY | O_NONBLOCK);
+
+    if (place_fd == -1) {
+        // Debug: opening failed
+        perror("Opening place pipe");
+        unlink(place_name);
+        _exit(1);
+    }
 
     int server_fd = open(SERVER_PIPE_NAME, O_WRONLY);
 
     if (server_fd == -1) {
         // Debug: opening failed
         perror("Error opening server pipe");
+        unlink(place_name);
         _exit(1);
     }
 
-    num_written = snprintf(buffer, BUFFER_SIZE, "end %d %ld\n", pid_for_end, end_to_send);
-    
-    if (num_written < 0 || num_written >= BUFFER_SIZE) {
-        // Debug: message formatting failed
-        perror("Formatting message!");
-        _exit(1);
-    }
+    int num_written = snprintf(buffer, BUFFER_SIZE, "place %s %s\n", policy, place_name);
 
-    if (write(server_fd, buffer, num_written) != num_written) {
+    if (num_written < 0 || num_written >= BUFFER_SIZE || write(server_fd, buffer, num_written) != num_written) {
         // Debug: writing failed
         perror("Writing");
+        unlink(place_name);
         _exit(1);
     }
-    
-    close(server_fd);
+
+    close(server_fd);
+
+    struct pollfd answer = { .fd = place_fd, .events = POLLIN };
+    ssize_t bytes_read = 0;
+    if (poll(&answer, 1, PLACE_TIMEOUT) == 1) {
+        bytes_read = read(place_fd, buffer, BUFFER_SIZE - 1);
+    }
+    buffer[bytes_read > 0 ? bytes_read : 0] = '\0';
+    buffer[strcspn(buffer, "\n")] = '\0';
+
+    close(place_fd);
+    unlink(place_name);
+
+    if (parse_cpus(buffer) == -1) {
+        // Debug: the monitor had no core to give
+        fprintf(stderr, "The monitor gave no core to place the run on, it runs unpinned\n");
+    }
 }
 
 /**
@@ -351,7 +1827,7 @@ int main(int argc, char *argv[]) {
     if (argc < 2) {
 
         // Instructions on the usage of the program
-        num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s [execute [-u | -p] program [args...] | status | stats-time pids... | stats-command command pids... | stats-uniq pids...]\n", argv[0]);
+        num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s [execute [--tree subreaper | cgroup] [--perf] [--capture] [--cpus list | round-robin | least-loaded] [--timeout duration] [-u | -p] program [args...] | submit [-p priority] [-u | -p] program [args...] | status [--watch [interval]] | stats-time pids... | stats-command command pids... | stats-uniq pids... | stats-latency command | stats-perf command | stats-cores | stats-trend [second | minute | hour] [periods] [command] | stats-top n [--by time | count | p99] | query [--name-prefix prefix] [--running] [--finished] [--min-ms ms] [--max-ms ms] | output pid [stdout | stderr] | metrics | flight] (pids can be ranges like 1000-5000 or - to read them from stdin)\n", argv[0]);
     
         if (num_written < 0 || num_written >= BUFFER_SIZE) {
             // Debug: message formatting failed
@@ -369,10 +1845,87 @@ int main(int argc, char *argv[]) {
     }
 
     if (strcmp(argv[1], "execute") == 0) {
+
+        // "--tree subreaper|cgroup" goes before the mode, the rest is as without it
+        if (argc >= 4 && strcmp(argv[2], "--tree") == 0) {
+            if (strcmp(argv[3], "subreaper") == 0) {
+                tree = TREE_SUBREAPER;
+            } else if (strcmp(argv[3], "cgroup") == 0) {
+                tree = TREE_CGROUP;
+            }
+            argv[2] = argv[0];
+            argv[3] = argv[1];
+            argv += 2;
+            argc -= 2;
+        }
+
+        // And "--perf", that reads the counters of every process of the run
+        if (argc >= 3 && strcmp(argv[2], "--perf") == 0) {
+            perf = 1;
+            argv[2] = argv[1];
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        }
+
+        // And "--capture", that keeps the stdout and stderr of the run in the output directory
+        if (argc >= 3 && strcmp(argv[2], "--capture") == 0) {
+            capture = 1;
+            argv[2] = argv[1];
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+        }
+
+        // And "--cpus list", like 0-3,6, or "--cpus round-robin|least-loaded" to let the monitor pick a core
+        if (argc >= 4 && strcmp(argv[2], "--cpus") == 0) {
+            if (strcmp(argv[3], "round-robin") == 0 || strcmp(argv[3], "least-loaded") == 0) {
+                ask_placement(argv[3]);
+            } else if (parse_cpus(argv[3]) == -1) {
+                num_written = snprintf(buffer, BUFFER_SIZE, "Invalid list of cores: %s\n", argv[3]);
+                if (write(2, buffer, num_written) != num_written) {
+                    // Debug: writing failed
+                    perror("Writing");
+                }
+                _exit(1);
+            }
+            argv[2] = argv[0];
+            argv[3] = argv[1];
+            argv += 2;
+            argc -= 2;
+        }
+
+        // So does "--timeout duration", like 500ms, 30s, 5m or 2h, seconds without a unit
+        if (argc >= 4 && strcmp(argv[2], "--timeout") == 0) {
+            char *duration = argv[3];
+            char *unit;
+            double amount = strtod(duration, &unit);
+            double scale = 0;
+            if (strcmp(unit, "ms") == 0) {
+                scale = 1;
+            } else if (strcmp(unit, "m") == 0) {
+                scale = 60000;
+            } else if (strcmp(unit, "h") == 0) {
+                scale = 3600000;
+            } else if (strcmp(unit, "s") == 0 || *unit == '\0') {
+                scale = 1000;
+            }
+            timeout = amount * scale;
+            argv[2] = argv[0];
+            argv[3] = argv[1];
+            argv += 2;
+            argc -= 2;
+
+            // A duration that isn't one, has an unknown unit or is under a millisecond gets the usage
+            if (unit == duration || !(amount * scale >= 1 && amount * scale <= LONG_MAX)) {
+                argc = 0;
+            }
+        }
+
         if (argc < 4 || (strcmp(argv[2], "-u") != 0 && strcmp(argv[2], "-p") != 0)) {
 
             // Instructions on the usage of the program
-            num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s execute [-u | -p] program [args...]\n", argv[0]);
+            num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s execute [--tree subreaper | cgroup] [--perf] [--capture] [--cpus list | round-robin | least-loaded] [--timeout duration] [-u | -p] program [args...]\n", argv[0]);
     
             if (num_written < 0 || num_written >= BUFFER_SIZE) {
                 // Debug: message formatting failed
@@ -411,70 +1964,49 @@ int main(int argc, char *argv[]) {
 
 
 
-    } else if (strcmp(argv[1], "status") == 0) {
-
-        // Send status request to server
-
-        int server_fd = open(SERVER_PIPE_NAME, O_WRONLY);
-
-        if (server_fd == -1) {
-            // Debug: opening failed
-            perror("Error opening server pipe");
-            _exit(1);
-        }
-
-        num_written = snprintf(buffer, BUFFER_SIZE, "status\n");
-        
-        if (num_written < 0 || num_written >= BUFFER_SIZE) {
-            // Debug: message formatting failed
-            perror("Formatting message!");
-            _exit(1);
-        }
+    } else if (strcmp(argv[1], "submit") == 0) {
 
-        if (write(server_fd, buffer, num_written) != num_written) {
-            // Debug: writing failed
-            perror("Writing");
-            _exit(1);
+        // "-p priority" goes before the mode, told apart from "-p pipeline" by what follows it
+        int priority = 0;
+        int first = 2;
+        if (argc >= 6 && strcmp(argv[2], "-p") == 0 && (strcmp(argv[4], "-u") == 0 || strcmp(argv[4], "-p") == 0)) {
+            priority = atoi(argv[3]);
+            first = 4;
         }
-        
-        close(server_fd);
-
-        // Receive response from server
 
-        int client_fd = open(CLIENT_PIPE_NAME, O_RDONLY);
+        if (argc < first + 2 || (strcmp(argv[first], "-u") != 0 && strcmp(argv[first], "-p") != 0)) {
 
-        if (client_fd == -1) {
-            // Debug: opening failed
-            perror("Opening client pipe");
-            _exit(1);
-        }
+            // Instructions on the usage of the program
+            num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s submit [-p priority] [-u | -p] program [args...]\n", argv[0]);
 
-        ssize_t bytes_read;
+            if (num_written < 0 || num_written >= BUFFER_SIZE) {
+                // Debug: message formatting failed
+                perror("Formatting message!");
+                _exit(1);
+            }
 
-        while ((bytes_read = read(client_fd, buffer, sizeof(buffer))) > 0) {
-            if (write(1, buffer, bytes_read) != bytes_read) {
+            if (write(2, buffer, num_written) != num_written) {
                 // Debug: writing failed
                 perror("Writing");
                 _exit(1);
             }
-        }
-
-        if (bytes_read == -1) {
-            // Debug: reading failed
-            perror("Reading");
             _exit(1);
         }
 
-        close(client_fd);
+        submit_job(priority, argv[first][1], &argv[first + 1], argc - first - 1);
 
+    } else if (strcmp(argv[1], "stats-cores") == 0) {
 
-    } else if (strcmp(argv[1], "stats-time") == 0) {
+        // Send stats-cores request to server
+        request_and_print("stats-cores");
 
-        if (argc < 3) {
+    } else if (strcmp(argv[1], "output") == 0) {
+
+        if (argc < 3 || (argc >= 4 && strcmp(argv[3], "stdout") != 0 && strcmp(argv[3], "stderr") != 0)) {
 
             // Instructions on the usage of the program
-            num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s stats-time pids...\n", argv[0]);
-    
+            num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s output pid [stdout | stderr]\n", argv[0]);
+
             if (num_written < 0 || num_written >= BUFFER_SIZE) {
                 // Debug: message formatting failed
                 perror("Formatting message!");
@@ -486,98 +2018,58 @@ int main(int argc, char *argv[]) {
                 perror("Writing");
                 _exit(1);
             }
-
             _exit(1);
         }
 
+        // Send output request to server, stdout unless told otherwise
+        snprintf(buffer, BUFFER_SIZE, "output %d %s", atoi(argv[2]), argc >= 4 ? argv[3] : "stdout");
+        request_and_print(buffer);
 
+    } else if (strcmp(argv[1], "status") == 0 && argc >= 3 && strcmp(argv[2], "--watch") == 0) {
 
-        // Send stats-time request to server
+        watch_status(argc >= 4 ? atol(argv[3]) : DEFAULT_WATCH_INTERVAL);
 
-        int server_fd = open(SERVER_PIPE_NAME, O_WRONLY);
+    } else if (strcmp(argv[1], "status") == 0) {
 
-        if (server_fd == -1) {
-            // Debug: opening failed
-            perror("Error opening server pipe");
-            _exit(1);
-        }
+        // Send status request to server
+        request_and_print("status");
 
-        num_written = snprintf(buffer, BUFFER_SIZE, "stats-time");
-        
-        if (num_written < 0 || num_written >= BUFFER_SIZE) {
-            // Debug: message formatting failed
-            perror("Formatting message!");
-            _exit(1);
-        }
 
-        if (write(server_fd, buffer, num_written) != num_written) {
-            // Debug: writing failed
-            perror("Writing");
-            _exit(1);
-        }
+    } else if (strcmp(argv[1], "stats-time") == 0) {
 
-        for (int i = 2; i < argc; i++) {
-            num_written = snprintf(buffer, BUFFER_SIZE, " %s", argv[i]);
-        
+        if (argc < 3) {
+
+            // Instructions on the usage of the program
+            num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s stats-time pids...\n", argv[0]);
+    
             if (num_written < 0 || num_written >= BUFFER_SIZE) {
                 // Debug: message formatting failed
                 perror("Formatting message!");
                 _exit(1);
             }
 
-            if (write(server_fd, buffer, num_written) != num_written) {
+            if (write(2, buffer, num_written) != num_written) {
                 // Debug: writing failed
                 perror("Writing");
                 _exit(1);
             }
-        }
-
-        num_written = snprintf(buffer, BUFFER_SIZE, "\n");
-        
-        if (num_written < 0 || num_written >= BUFFER_SIZE) {
-            // Debug: message formatting failed
-            perror("Formatting message!");
-            _exit(1);
-        }
 
-        if (write(server_fd, buffer, num_written) != num_written) {
-            // Debug: writing failed
-            perror("Writing");
             _exit(1);
         }
-        
-        close(server_fd);
-
-
 
-        // Receive response from server
-
-        int client_fd = open(CLIENT_PIPE_NAME, O_RDONLY);
 
-        if (client_fd == -1) {
-            // Debug: opening failed
-            perror("Opening client pipe");
-            _exit(1);
-        }
 
-        ssize_t bytes_read;
+        // Send stats-time request to server
 
-        while ((bytes_read = read(client_fd, buffer, sizeof(buffer))) > 0) {
-            if (write(1, buffer, bytes_read) != bytes_read) {
-                // Debug: writing failed
-                perror("Writing");
-                _exit(1);
+        // The monitor only answers busy when the pids are in the request, so they're never read twice
+        for (int attempt = 0; ; attempt++) {
+            send_pid_request("stats-time", &argv[2], argc - 2);
+            if (print_answer() == 0) {
+                break;
             }
+            back_off(attempt);
         }
 
-        if (bytes_read == -1) {
-            // Debug: reading failed
-            perror("Reading");
-            _exit(1);
-        }
-
-        close(client_fd);
-
 
 
     } else if (strcmp(argv[1], "stats-command") == 0) {
@@ -606,97 +2098,119 @@ int main(int argc, char *argv[]) {
 
         // Send stats-command request to server
 
-        int server_fd = open(SERVER_PIPE_NAME, O_WRONLY);
-
-        if (server_fd == -1) {
-            // Debug: opening failed
-            perror("Error opening server pipe");
-            _exit(1);
-        }
-
         num_written = snprintf(buffer, BUFFER_SIZE, "stats-command %s", command);
-        
+
         if (num_written < 0 || num_written >= BUFFER_SIZE) {
             // Debug: message formatting failed
             perror("Formatting message!");
             _exit(1);
         }
 
-        if (write(server_fd, buffer, num_written) != num_written) {
-            // Debug: writing failed
-            perror("Writing");
-            _exit(1);
+        for (int attempt = 0; ; attempt++) {
+            send_pid_request(buffer, &argv[3], argc - 3);
+            if (print_answer() == 0) {
+                break;
+            }
+            back_off(attempt);
         }
-        
-        for (int i = 3; i < argc; i++) {
-            num_written = snprintf(buffer, BUFFER_SIZE, " %s", argv[i]);
-        
+
+
+
+    } else if (strcmp(argv[1], "stats-uniq") == 0) {
+
+        if (argc < 3) {
+
+            // Instructions on the usage of the program
+            num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s stats-uniq pids...\n", argv[0]);
+    
             if (num_written < 0 || num_written >= BUFFER_SIZE) {
                 // Debug: message formatting failed
                 perror("Formatting message!");
                 _exit(1);
             }
 
-            if (write(server_fd, buffer, num_written) != num_written) {
+            if (write(2, buffer, num_written) != num_written) {
                 // Debug: writing failed
                 perror("Writing");
                 _exit(1);
             }
-        }
 
-        num_written = snprintf(buffer, BUFFER_SIZE, "\n");
-        
-        if (num_written < 0 || num_written >= BUFFER_SIZE) {
-            // Debug: message formatting failed
-            perror("Formatting message!");
             _exit(1);
         }
 
-        if (write(server_fd, buffer, num_written) != num_written) {
-            // Debug: writing failed
-            perror("Writing");
-            _exit(1);
+        // Send stats-uniq request to server
+
+        for (int attempt = 0; ; attempt++) {
+            send_pid_request("stats-uniq", &argv[2], argc - 2);
+            if (print_answer() == 0) {
+                break;
+            }
+            back_off(attempt);
         }
 
-        close(server_fd);
 
-        // Receive response from server
 
-        int client_fd = open(CLIENT_PIPE_NAME, O_RDONLY);
+    } else if (strcmp(argv[1], "flight") == 0 && argc == 2) {
 
-        if (client_fd == -1) {
-            // Debug: opening failed
-            perror("Opening client pipe");
-            _exit(1);
-        }
+        // Send flight request to server, the trace goes to stdout
+        request_and_print("flight");
 
-        ssize_t bytes_read;
+    } else if (strcmp(argv[1], "metrics") == 0 && argc == 2) {
+
+        // Send metrics request to server
+        request_and_print("metrics");
+
+    } else if (strcmp(argv[1], "query") == 0) {
+
+        // Translate the filters to the words the monitor expects
+        num_written = snprintf(buffer, BUFFER_SIZE, "query");
+
+        for (int i = 2; i < argc && num_written > 0 && num_written < BUFFER_SIZE; i++) {
+            if (strcmp(argv[i], "--running") == 0 || strcmp(argv[i], "--finished") == 0) {
+                num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, " %s", argv[i] + 2);
+            } else if (i + 1 < argc && strcmp(argv[i], "--name-prefix") == 0) {
+                num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, " prefix %s", argv[++i]);
+            } else if (i + 1 < argc && strcmp(argv[i], "--min-ms") == 0) {
+                num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, " min %ld", atol(argv[++i]));
+            } else if (i + 1 < argc && strcmp(argv[i], "--max-ms") == 0) {
+                num_written += snprintf(buffer + num_written, BUFFER_SIZE - num_written, " max %ld", atol(argv[++i]));
+            } else {
+
+                // Instructions on the usage of the program
+                num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s query [--name-prefix prefix] [--running] [--finished] [--min-ms ms] [--max-ms ms]\n", argv[0]);
+
+                if (num_written < 0 || num_written >= BUFFER_SIZE) {
+                    // Debug: message formatting failed
+                    perror("Formatting message!");
+                    _exit(1);
+                }
+
+                if (write(2, buffer, num_written) != num_written) {
+                    // Debug: writing failed
+                    perror("Writing");
+                    _exit(1);
+                }
 
-        while ((bytes_read = read(client_fd, buffer, sizeof(buffer))) > 0) {
-            if (write(1, buffer, bytes_read) != bytes_read) {
-                // Debug: writing failed
-                perror("Writing");
                 _exit(1);
             }
         }
 
-        if (bytes_read == -1) {
-            // Debug: reading failed
-            perror("Reading");
+        if (num_written < 0 || num_written >= BUFFER_SIZE) {
+            // Debug: message formatting failed
+            perror("Formatting message!");
             _exit(1);
         }
 
-        close(client_fd);
+        // Send query request to server
+        request_and_print(buffer);
 
+    } else if (strcmp(argv[1], "stats-top") == 0) {
 
-
-    } else if (strcmp(argv[1], "stats-uniq") == 0) {
-
-        if (argc < 3) {
+        if (argc != 3 && !(argc == 5 && strcmp(argv[3], "--by") == 0)) {
 
             // Instructions on the usage of the program
-            num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s stats-uniq pids...\n", argv[0]);
-    
+            num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s stats-top n [--by time | count | p99]\n", argv[0]);
+
             if (num_written < 0 || num_written >= BUFFER_SIZE) {
                 // Debug: message formatting failed
                 perror("Formatting message!");
@@ -712,96 +2226,104 @@ int main(int argc, char *argv[]) {
             _exit(1);
         }
 
-        // Send stats-uniq request to server
+        // Send stats-top request to server
 
-        int server_fd = open(SERVER_PIPE_NAME, O_WRONLY);
+        num_written = snprintf(buffer, BUFFER_SIZE, "stats-top %s %s", argv[2], argc == 5 ? argv[4] : "time");
 
-        if (server_fd == -1) {
-            // Debug: opening failed
-            perror("Error opening server pipe");
+        if (num_written < 0 || num_written >= BUFFER_SIZE) {
+            // Debug: message formatting failed
+            perror("Formatting message!");
             _exit(1);
         }
 
-        num_written = snprintf(buffer, BUFFER_SIZE, "stats-uniq");
-        
+        request_and_print(buffer);
+
+    } else if (strcmp(argv[1], "stats-trend") == 0) {
+
+        // Send stats-trend request to server, "second" periods and every command by default
+
+        num_written = snprintf(buffer, BUFFER_SIZE, "stats-trend %s %s %s", argc > 2 ? argv[2] : "second", argc > 3 ? argv[3] : "60", argc > 4 ? argv[4] : "");
+
         if (num_written < 0 || num_written >= BUFFER_SIZE) {
             // Debug: message formatting failed
             perror("Formatting message!");
             _exit(1);
         }
 
-        if (write(server_fd, buffer, num_written) != num_written) {
-            // Debug: writing failed
-            perror("Writing");
-            _exit(1);
-        }
-        
-        for (int i = 2; i < argc; i++) {
-            num_written = snprintf(buffer, BUFFER_SIZE, " %s", argv[i]);
-        
+        request_and_print(buffer);
+
+    } else if (strcmp(argv[1], "stats-perf") == 0) {
+
+        if (argc != 3) {
+
+            // Instructions on the usage of the program
+            num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s stats-perf command\n", argv[0]);
+
             if (num_written < 0 || num_written >= BUFFER_SIZE) {
                 // Debug: message formatting failed
                 perror("Formatting message!");
                 _exit(1);
             }
 
-            if (write(server_fd, buffer, num_written) != num_written) {
+            if (write(2, buffer, num_written) != num_written) {
                 // Debug: writing failed
                 perror("Writing");
                 _exit(1);
             }
+
+            _exit(1);
         }
 
-        num_written = snprintf(buffer, BUFFER_SIZE, "\n");
-        
+        // Send stats-perf request to server
+
+        num_written = snprintf(buffer, BUFFER_SIZE, "stats-perf %s", argv[2]);
+
         if (num_written < 0 || num_written >= BUFFER_SIZE) {
             // Debug: message formatting failed
             perror("Formatting message!");
             _exit(1);
         }
 
-        if (write(server_fd, buffer, num_written) != num_written) {
-            // Debug: writing failed
-            perror("Writing");
-            _exit(1);
-        }
-
-        close(server_fd);
+        request_and_print(buffer);
 
-        // Receive response from server
+    } else if (strcmp(argv[1], "stats-latency") == 0) {
 
-        int client_fd = open(CLIENT_PIPE_NAME, O_RDONLY);
+        if (argc != 3) {
 
-        if (client_fd == -1) {
-            // Debug: opening failed
-            perror("Opening client pipe");
-            _exit(1);
-        }
+            // Instructions on the usage of the program
+            num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s stats-latency command\n", argv[0]);
 
-        ssize_t bytes_read;
+            if (num_written < 0 || num_written >= BUFFER_SIZE) {
+                // Debug: message formatting failed
+                perror("Formatting message!");
+                _exit(1);
+            }
 
-        while ((bytes_read = read(client_fd, buffer, sizeof(buffer))) > 0) {
-            if (write(1, buffer, bytes_read) != bytes_read) {
+            if (write(2, buffer, num_written) != num_written) {
                 // Debug: writing failed
                 perror("Writing");
                 _exit(1);
             }
-        }
 
-        if (bytes_read == -1) {
-            // Debug: reading failed
-            perror("Reading");
             _exit(1);
         }
 
-        close(client_fd);
+        // Send stats-latency request to server
 
+        num_written = snprintf(buffer, BUFFER_SIZE, "stats-latency %s", argv[2]);
+
+        if (num_written < 0 || num_written >= BUFFER_SIZE) {
+            // Debug: message formatting failed
+            perror("Formatting message!");
+            _exit(1);
+        }
 
+        request_and_print(buffer);
 
     } else {
 
         // Instructions on the usage of the program
-        num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s [execute [-u | -p] program [args...] | status | stats-time pids... | stats-command command pids... | stats-uniq pids...]\n", argv[0]);
+        num_written = snprintf(buffer, BUFFER_SIZE, "Usage: %s [execute [--tree subreaper | cgroup] [--perf] [--capture] [--cpus list | round-robin | least-loaded] [--timeout duration] [-u | -p] program [args...] | submit [-p priority] [-u | -p] program [args...] | status [--watch [interval]] | stats-time pids... | stats-command command pids... | stats-uniq pids... | stats-latency command | stats-perf command | stats-cores | stats-trend [second | minute | hour] [periods] [command] | stats-top n [--by time | count | p99] | query [--name-prefix prefix] [--running] [--finished] [--min-ms ms] [--max-ms ms] | output pid [stdout | stderr] | metrics | flight] (pids can be ranges like 1000-5000 or - to read them from stdin)\n", argv[0]);
     
         if (num_written < 0 || num_written >= BUFFER_SIZE) {
             // Debug: message formatting failed